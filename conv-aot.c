@@ -0,0 +1,621 @@
+/* Ahead-of-time compiler for a fixed stack of convolution layers.
+
+   conv-aot reads a model description and writes one C translation unit
+   in which every layer is a function of its own, with the image and
+   kernel shapes, stride, scale and epilogue as literal constants, so
+   that nothing is dispatched or looked up at run time. The loops are
+   those of conv.hpp: MB kernels at a time, broadcast against NP output
+   columns, sums in double. Activations are [X][Y][C] floats, channels
+   innermost, and each layer is a valid convolution of its input, so a
+   layer's output is the next layer's input as it is.
+
+   A model description has one directive per line; # starts a comment:
+
+     input <rows> <columns> <channels>
+     conv <kernels> <kernel_order> <stride> [relu] [bias] [scale=<s>]
+          [weights=random:<seed> | weights=embed:<file> | weights=mmap:<file>]
+
+   A weights file holds the layer's int16 kernels [M][C][K][K], followed
+   by M float biases if the layer has a bias, both little-endian. Embedded
+   weights are compiled into the program; mmap'd ones are mapped from the
+   file when the program starts. random weights are generated here and
+   embedded.
+
+   Build and use:
+     gcc -O2 conv-aot.c -o conv-aot
+     ./conv-aot model.txt net.c
+     gcc -O3 -march=native -fopenmp net.c -o net -lm
+     ./net [runs]
+
+   The generated program checks the network against an unspecialised
+   reference and times every layer. Build it with -DCONV_NET_NO_MAIN to
+   link net_init and net_run into another program.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LAYERS 256
+#define MAX_BLOCK 16              /* kernels per block, as conv.hpp's MB */
+#define NP 4                      /* output columns per block */
+
+enum weight_source
+{
+    WEIGHTS_RANDOM,
+    WEIGHTS_EMBED,
+    WEIGHTS_MMAP
+};
+
+struct layer
+{
+    int in_rows, in_cols, nchannels;
+    int nkernels, kernel_order, stride;
+    int out_rows, out_cols;
+    int relu, bias;
+    double scale;
+    enum weight_source source;
+    unsigned seed;
+    char path[1024];
+};
+
+/* a layer's kernels and biases, as the weights file holds them */
+static void load_weights(const struct layer *layer, int16_t **kernels, float **bias)
+{
+    long count = (long)layer->nkernels * layer->nchannels * layer->kernel_order *
+                 layer->kernel_order;
+    FILE *f;
+    long i;
+
+    *kernels = malloc(count * sizeof(int16_t));
+    *bias = calloc(layer->nkernels, sizeof(float));
+    if (layer->source == WEIGHTS_RANDOM)
+    {
+        /* small values of both signs, so relu has something to cut */
+        unsigned state = layer->seed * 2654435761u + 1;
+        for (i = 0; i < count; i++)
+        {
+            state = state * 1103515245u + 12345u;
+            (*kernels)[i] = (int16_t)((state >> 16) % 1024) - 512;
+        }
+        for (i = 0; i < layer->nkernels && layer->bias; i++)
+        {
+            state = state * 1103515245u + 12345u;
+            (*bias)[i] = (float)((int)((state >> 16) % 256) - 128);
+        }
+        return;
+    }
+
+    f = fopen(layer->path, "rb");
+    if (f == NULL || fread(*kernels, sizeof(int16_t), count, f) != (size_t)count ||
+        (layer->bias && fread(*bias, sizeof(float), layer->nkernels, f) !=
+                            (size_t)layer->nkernels))
+    {
+        fprintf(stderr, "FATAL: cannot read %ld kernel values%s from %s\n", count,
+                layer->bias ? " and the biases" : "", layer->path);
+        exit(1);
+    }
+    fclose(f);
+}
+
+/* parse the model description into layers; returns the number of layers */
+static int read_model(const char *path, struct layer *layers)
+{
+    FILE *f = fopen(path, "r");
+    char line[2048];
+    int nlayers = 0, rows = 0, cols = 0, channels = 0, lineno = 0;
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "FATAL: cannot read %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *word, *save;
+        struct layer *layer = &layers[nlayers];
+
+        lineno++;
+        if (strchr(line, '#') != NULL)
+        {
+            *strchr(line, '#') = '\0';
+        }
+        word = strtok_r(line, " \t\r\n", &save);
+        if (word == NULL)
+        {
+            continue;
+        }
+        if (strcmp(word, "input") == 0)
+        {
+            char *a = strtok_r(NULL, " \t\r\n", &save), *b = strtok_r(NULL, " \t\r\n", &save);
+            char *c = strtok_r(NULL, " \t\r\n", &save);
+            if (c == NULL || nlayers > 0 || (rows = atoi(a)) < 1 || (cols = atoi(b)) < 1 ||
+                (channels = atoi(c)) < 1)
+            {
+                fprintf(stderr, "FATAL: %s:%d: input needs rows, columns and channels, "
+                                "before any layer\n", path, lineno);
+                exit(1);
+            }
+            continue;
+        }
+        if (strcmp(word, "conv") != 0)
+        {
+            fprintf(stderr, "FATAL: %s:%d: unknown directive '%s'\n", path, lineno, word);
+            exit(1);
+        }
+        if (channels == 0 || nlayers == MAX_LAYERS)
+        {
+            fprintf(stderr, "FATAL: %s:%d: %s\n", path, lineno,
+                    channels == 0 ? "conv before input" : "too many layers");
+            exit(1);
+        }
+
+        memset(layer, 0, sizeof(*layer));
+        layer->in_rows = rows;
+        layer->in_cols = cols;
+        layer->nchannels = channels;
+        layer->scale = 1.0;
+        layer->seed = nlayers + 1;
+        word = strtok_r(NULL, " \t\r\n", &save);
+        layer->nkernels = word != NULL ? atoi(word) : 0;
+        word = strtok_r(NULL, " \t\r\n", &save);
+        layer->kernel_order = word != NULL ? atoi(word) : 0;
+        word = strtok_r(NULL, " \t\r\n", &save);
+        layer->stride = word != NULL ? atoi(word) : 0;
+        while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            if (strcmp(word, "relu") == 0)
+            {
+                layer->relu = 1;
+            }
+            else if (strcmp(word, "bias") == 0)
+            {
+                layer->bias = 1;
+            }
+            else if (strncmp(word, "scale=", 6) == 0)
+            {
+                layer->scale = strtod(word + 6, NULL);
+            }
+            else if (strncmp(word, "weights=random:", 15) == 0)
+            {
+                layer->source = WEIGHTS_RANDOM;
+                layer->seed = (unsigned)strtoul(word + 15, NULL, 10);
+            }
+            else if (strncmp(word, "weights=embed:", 14) == 0 ||
+                     strncmp(word, "weights=mmap:", 13) == 0)
+            {
+                layer->source = word[8] == 'e' ? WEIGHTS_EMBED : WEIGHTS_MMAP;
+                snprintf(layer->path, sizeof(layer->path), "%s", strchr(word + 8, ':') + 1);
+            }
+            else
+            {
+                fprintf(stderr, "FATAL: %s:%d: unknown layer option '%s'\n", path, lineno,
+                        word);
+                exit(1);
+            }
+        }
+        if (layer->nkernels < 1 || layer->kernel_order < 1 || layer->stride < 1 ||
+            layer->kernel_order > rows || layer->kernel_order > cols)
+        {
+            fprintf(stderr, "FATAL: %s:%d: conv needs kernels, a kernel order no larger than "
+                            "its %d x %d input, and a stride\n", path, lineno, rows, cols);
+            exit(1);
+        }
+        layer->out_rows = (rows - layer->kernel_order) / layer->stride + 1;
+        layer->out_cols = (cols - layer->kernel_order) / layer->stride + 1;
+        rows = layer->out_rows;
+        cols = layer->out_cols;
+        channels = layer->nkernels;
+        nlayers++;
+    }
+    fclose(f);
+    if (nlayers == 0)
+    {
+        fprintf(stderr, "FATAL: %s has no layers\n", path);
+        exit(1);
+    }
+    return nlayers;
+}
+
+/* the layer's weights as static arrays */
+static void emit_weights(FILE *out, int l, const struct layer *layer)
+{
+    long count = (long)layer->nkernels * layer->nchannels * layer->kernel_order *
+                 layer->kernel_order;
+    int16_t *kernels;
+    float *bias;
+    long i;
+
+    load_weights(layer, &kernels, &bias);
+    fprintf(out, "static const int16_t layer%d_kernels[%ld] = {", l, count);
+    for (i = 0; i < count; i++)
+    {
+        fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", kernels[i]);
+    }
+    fprintf(out, "\n};\n");
+    if (layer->bias)
+    {
+        fprintf(out, "static const float layer%d_bias_data[%d] = {", l, layer->nkernels);
+        for (i = 0; i < layer->nkernels; i++)
+        {
+            fprintf(out, "%s%.9g,", i % 8 == 0 ? "\n    " : " ", bias[i]);
+        }
+        fprintf(out, "\n};\n");
+    }
+    free(kernels);
+    free(bias);
+}
+
+/* the specialised function of one layer */
+static void emit_layer(FILE *out, int l, const struct layer *layer)
+{
+    int mb = layer->nkernels < MAX_BLOCK ? layer->nkernels : MAX_BLOCK;
+    int mblocks = (layer->nkernels + mb - 1) / mb;
+    int K = layer->kernel_order, C = layer->nchannels, S = layer->stride;
+
+    fprintf(out, "\n/* layer %d: %d kernels of %dx%d over %d channels, stride %d, "
+                 "%d x %d -> %d x %d%s%s */\n",
+            l, layer->nkernels, K, K, C, S, layer->in_rows, layer->in_cols, layer->out_rows,
+            layer->out_cols, layer->bias ? ", bias" : "", layer->relu ? ", relu" : "");
+    if (layer->source != WEIGHTS_MMAP)
+    {
+        emit_weights(out, l, layer);
+    }
+    fprintf(out, "static const int16_t *layer%d_weights;\n", l);
+    fprintf(out, "static float layer%d_bias[%d];\n", l, layer->nkernels);
+    fprintf(out, "static double *layer%d_packed; /* [%d][%d][%d][%d][%d] */\n\n", l, mblocks, K,
+            K, C, mb);
+
+    fprintf(out,
+            "static inline __attribute__((always_inline)) void layer%d_block(\n"
+            "    const float *restrict in, float *restrict out, int mb, int x, int y, int np)\n"
+            "{\n"
+            "    const double *k = layer%d_packed + (long)mb * %ld;\n"
+            "    double sum[%d][%d] = {{0}};\n"
+            "\n"
+            "    for (int kx = 0; kx < %d; kx++)\n"
+            "    {\n"
+            "        for (int ky = 0; ky < %d; ky++)\n"
+            "        {\n"
+            "            const double *kxy = k + (kx * %d + ky) * %d;\n"
+            "            const float *pixel = in + ((long)(x * %d + kx) * %d + y * %d + ky) * %d;\n"
+            "            for (int c = 0; c < %d; c++)\n"
+            "            {\n"
+            "                for (int p = 0; p < np; p++)\n"
+            "                {\n"
+            "                    double v = pixel[p * %d + c];\n"
+            "#pragma omp simd\n"
+            "                    for (int j = 0; j < %d; j++)\n"
+            "                    {\n"
+            "                        sum[p][j] += v * kxy[c * %d + j];\n"
+            "                    }\n"
+            "                }\n"
+            "            }\n"
+            "        }\n"
+            "    }\n",
+            l, l, (long)K * K * C * mb, NP, mb, K, K, K, C * mb, S, layer->in_cols, S, C, C,
+            S * C, mb, mb);
+    fprintf(out,
+            "    for (int p = 0; p < np; p++)\n"
+            "    {\n"
+            "        float *o = out + ((long)x * %d + y + p) * %d + mb * %d;\n"
+            "        for (int j = 0; j < %d && mb * %d + j < %d; j++)\n"
+            "        {\n"
+            "            double r = sum[p][j] * %.17g + layer%d_bias[mb * %d + j];\n"
+            "%s"
+            "            o[j] = (float)r;\n"
+            "        }\n"
+            "    }\n"
+            "}\n\n",
+            layer->out_cols, layer->nkernels, mb, mb, mb, layer->nkernels, layer->scale, l, mb,
+            layer->relu ? "            r = r > 0.0 ? r : 0.0;\n" : "");
+    fprintf(out,
+            "static void layer%d(const float *restrict in, float *restrict out)\n"
+            "{\n"
+            "#pragma omp parallel for collapse(2) schedule(static)\n"
+            "    for (int mb = 0; mb < %d; mb++)\n"
+            "    {\n"
+            "        for (int x = 0; x < %d; x++)\n"
+            "        {\n"
+            "            int y = 0;\n"
+            "            for (; y + %d <= %d; y += %d)\n"
+            "            {\n"
+            "                layer%d_block(in, out, mb, x, y, %d);\n"
+            "            }\n"
+            "            for (; y < %d; y++)\n"
+            "            {\n"
+            "                layer%d_block(in, out, mb, x, y, 1);\n"
+            "            }\n"
+            "        }\n"
+            "    }\n"
+            "}\n",
+            l, mblocks, layer->out_rows, NP, layer->out_cols, NP, l, NP, layer->out_cols, l);
+}
+
+/* setup of one layer's weights in net_init: map or point at them, and pack */
+static void emit_layer_init(FILE *out, int l, const struct layer *layer)
+{
+    int mb = layer->nkernels < MAX_BLOCK ? layer->nkernels : MAX_BLOCK;
+    int mblocks = (layer->nkernels + mb - 1) / mb;
+    int K = layer->kernel_order, C = layer->nchannels;
+    long count = (long)layer->nkernels * C * K * K;
+
+    if (layer->source == WEIGHTS_MMAP)
+    {
+        fprintf(out, "    layer%d_weights = map_weights(\"%s\", %ld, %d ? layer%d_bias : NULL, "
+                     "%d);\n",
+                l, layer->path, count, layer->bias, l, layer->nkernels);
+    }
+    else
+    {
+        fprintf(out, "    layer%d_weights = layer%d_kernels;\n", l, l);
+        if (layer->bias)
+        {
+            fprintf(out, "    memcpy(layer%d_bias, layer%d_bias_data, sizeof(layer%d_bias));\n",
+                    l, l, l);
+        }
+    }
+    fprintf(out, "    layer%d_packed = pack_kernels(layer%d_weights, %d, %d, %d, %d, %d);\n", l,
+            l, layer->nkernels, C, K, mb, mblocks);
+}
+
+static const char *runtime_source =
+    "/* map a weights file, [M][C][K][K] int16 kernels then M float biases */\n"
+    "static const int16_t *map_weights(const char *path, long count, float *bias, int nkernels)\n"
+    "{\n"
+    "    long bytes = count * sizeof(int16_t) + (bias != NULL ? nkernels * sizeof(float) : 0);\n"
+    "    int fd = open(path, O_RDONLY);\n"
+    "    struct stat info;\n"
+    "    char *data;\n"
+    "\n"
+    "    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size != bytes)\n"
+    "    {\n"
+    "        fprintf(stderr, \"FATAL: %s must be a weights file of %ld bytes\\n\", path, bytes);\n"
+    "        exit(1);\n"
+    "    }\n"
+    "    data = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);\n"
+    "    close(fd);\n"
+    "    if (data == MAP_FAILED)\n"
+    "    {\n"
+    "        fprintf(stderr, \"FATAL: cannot map %s: %s\\n\", path, strerror(errno));\n"
+    "        exit(1);\n"
+    "    }\n"
+    "    if (bias != NULL)\n"
+    "    {\n"
+    "        memcpy(bias, data + count * sizeof(int16_t), nkernels * sizeof(float));\n"
+    "    }\n"
+    "    return (const int16_t *)data;\n"
+    "}\n"
+    "\n"
+    "/* [M/MB][K][K][C][MB] doubles, the missing kernels of the last block zero */\n"
+    "static double *pack_kernels(const int16_t *kernels, int nkernels, int nchannels,\n"
+    "                            int kernel_order, int mb, int mblocks)\n"
+    "{\n"
+    "    double *packed = calloc((long)mblocks * kernel_order * kernel_order * nchannels * mb,\n"
+    "                            sizeof(double));\n"
+    "\n"
+    "    for (int m = 0; m < nkernels; m++)\n"
+    "        for (int c = 0; c < nchannels; c++)\n"
+    "            for (int x = 0; x < kernel_order; x++)\n"
+    "                for (int y = 0; y < kernel_order; y++)\n"
+    "                    packed[(((long)(m / mb * kernel_order + x) * kernel_order + y) *\n"
+    "                                nchannels + c) * mb + m % mb] =\n"
+    "                        kernels[((long)(m * nchannels + c) * kernel_order + x) *\n"
+    "                                    kernel_order + y];\n"
+    "    return packed;\n"
+    "}\n";
+
+static const char *harness_source =
+    "#ifndef CONV_NET_NO_MAIN\n"
+    "/* the plain loops of one layer, from the weights as stored */\n"
+    "static void reference_layer(const struct net_layer *layer, const float *in, float *out)\n"
+    "{\n"
+    "    int K = layer->kernel_order, C = layer->nchannels, S = layer->stride;\n"
+    "\n"
+    "#pragma omp parallel for collapse(2)\n"
+    "    for (int x = 0; x < layer->out_rows; x++)\n"
+    "        for (int y = 0; y < layer->out_cols; y++)\n"
+    "            for (int m = 0; m < layer->nkernels; m++)\n"
+    "            {\n"
+    "                double sum = 0.0, r;\n"
+    "                for (int c = 0; c < C; c++)\n"
+    "                    for (int kx = 0; kx < K; kx++)\n"
+    "                        for (int ky = 0; ky < K; ky++)\n"
+    "                            sum += (double)in[((long)(x * S + kx) * layer->in_cols +\n"
+    "                                               y * S + ky) * C + c] *\n"
+    "                                   (*layer->weights)[((long)(m * C + c) * K + kx) * K + ky];\n"
+    "                r = sum * layer->scale + layer->bias[m];\n"
+    "                r = layer->relu && r < 0.0 ? 0.0 : r;\n"
+    "                out[((long)x * layer->out_cols + y) * layer->nkernels + m] = (float)r;\n"
+    "            }\n"
+    "}\n"
+    "\n"
+    "static double seconds(void)\n"
+    "{\n"
+    "    struct timespec t;\n"
+    "    clock_gettime(CLOCK_MONOTONIC, &t);\n"
+    "    return t.tv_sec + t.tv_nsec * 1e-9;\n"
+    "}\n"
+    "\n"
+    "int main(int argc, char **argv)\n"
+    "{\n"
+    "    int runs = argc > 1 ? atoi(argv[1]) : 10;\n"
+    "    long largest = NET_INPUT_ELEMENTS;\n"
+    "    float *input = malloc(NET_INPUT_ELEMENTS * sizeof(float));\n"
+    "    float *output = malloc(NET_OUTPUT_ELEMENTS * sizeof(float));\n"
+    "    float *a, *b;\n"
+    "    double error = 0.0, peak = 0.0, start, total = 0.0, macs = 0.0;\n"
+    "    double layer_seconds[NET_LAYERS] = {0};\n"
+    "\n"
+    "    for (int l = 0; l < NET_LAYERS; l++)\n"
+    "    {\n"
+    "        long n = (long)net_layers[l].out_rows * net_layers[l].out_cols * "
+    "net_layers[l].nkernels;\n"
+    "        largest = n > largest ? n : largest;\n"
+    "    }\n"
+    "    a = malloc(largest * sizeof(float));\n"
+    "    b = malloc(largest * sizeof(float));\n"
+    "    srandom(1);\n"
+    "    for (long i = 0; i < NET_INPUT_ELEMENTS; i++)\n"
+    "    {\n"
+    "        input[i] = random() % 256;\n"
+    "    }\n"
+    "    start = seconds();\n"
+    "    net_init();\n"
+    "    printf(\"%d layers, weights ready in %.2f ms, %d threads\\n\", NET_LAYERS,\n"
+    "           (seconds() - start) * 1e3, omp_get_max_threads());\n"
+    "\n"
+    "    /* the reference, layer by layer from the input */\n"
+    "    memcpy(a, input, NET_INPUT_ELEMENTS * sizeof(float));\n"
+    "    for (int l = 0; l < NET_LAYERS; l++)\n"
+    "    {\n"
+    "        float *t;\n"
+    "        reference_layer(&net_layers[l], a, b);\n"
+    "        t = a, a = b, b = t;\n"
+    "    }\n"
+    "    net_run(input, output);\n"
+    "    for (long i = 0; i < NET_OUTPUT_ELEMENTS; i++)\n"
+    "    {\n"
+    "        double d = fabs((double)output[i] - a[i]);\n"
+    "        error = d > error ? d : error;\n"
+    "        peak = fabs(a[i]) > peak ? fabs(a[i]) : peak;\n"
+    "    }\n"
+    "\n"
+    "    for (int r = 0; r < runs; r++)\n"
+    "    {\n"
+    "        const float *in = input;\n"
+    "        float *bufs[2] = {a, b};\n"
+    "        for (int l = 0; l < NET_LAYERS; l++)\n"
+    "        {\n"
+    "            float *o = l == NET_LAYERS - 1 ? output : bufs[l % 2];\n"
+    "            start = seconds();\n"
+    "            net_layers[l].run(in, o);\n"
+    "            layer_seconds[l] += seconds() - start;\n"
+    "            in = o;\n"
+    "        }\n"
+    "    }\n"
+    "    printf(\"%6s %8s %6s %7s %16s %10s %8s\\n\", \"layer\", \"kernels\", \"order\", "
+    "\"stride\",\n"
+    "           \"output\", \"ms\", \"GMAC/s\");\n"
+    "    for (int l = 0; l < NET_LAYERS; l++)\n"
+    "    {\n"
+    "        const struct net_layer *layer = &net_layers[l];\n"
+    "        char shape[32];\n"
+    "        double m = (double)layer->out_rows * layer->out_cols * layer->nkernels *\n"
+    "                   layer->nchannels * layer->kernel_order * layer->kernel_order;\n"
+    "        snprintf(shape, sizeof(shape), \"%dx%dx%d\", layer->out_rows, layer->out_cols,\n"
+    "                 layer->nkernels);\n"
+    "        printf(\"%6d %8d %6d %7d %16s %10.3f %8.2f\\n\", l, layer->nkernels, "
+    "layer->kernel_order,\n"
+    "               layer->stride, shape, layer_seconds[l] / runs * 1e3,\n"
+    "               m * runs / layer_seconds[l] * 1e-9);\n"
+    "        total += layer_seconds[l];\n"
+    "        macs += m;\n"
+    "    }\n"
+    "    printf(\"network: %.3f ms, %.2f GMAC/s; relative error against the reference %.2e\\n\",\n"
+    "           total / runs * 1e3, macs * runs / total * 1e-9, error / (peak > 0.0 ? peak : 1.0));\n"
+    "    return 0;\n"
+    "}\n"
+    "#endif\n";
+
+int main(int argc, char **argv)
+{
+    static struct layer layers[MAX_LAYERS];
+    const struct layer *last;
+    FILE *out;
+    int nlayers, l;
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: conv-aot <model description> <output.c>\n");
+        exit(1);
+    }
+    nlayers = read_model(argv[1], layers);
+    last = &layers[nlayers - 1];
+    out = fopen(argv[2], "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "FATAL: cannot write %s: %s\n", argv[2], strerror(errno));
+        exit(1);
+    }
+
+    fprintf(out, "/* Generated by conv-aot from %s; do not edit.\n\n"
+                 "   gcc -O3 -march=native -fopenmp %s -o net -lm\n*/\n\n",
+            argv[1], argv[2]);
+    fprintf(out, "#include <errno.h>\n#include <fcntl.h>\n#include <math.h>\n"
+                 "#include <omp.h>\n#include <stdint.h>\n#include <stdio.h>\n"
+                 "#include <stdlib.h>\n#include <string.h>\n#include <time.h>\n"
+                 "#include <unistd.h>\n#include <sys/mman.h>\n#include <sys/stat.h>\n\n");
+    fprintf(out, "#define NET_LAYERS %d\n#define NET_INPUT_ELEMENTS %ldL"
+                 "  /* [%d][%d][%d] */\n#define NET_OUTPUT_ELEMENTS %ldL  /* [%d][%d][%d] */\n\n",
+            nlayers, (long)layers[0].in_rows * layers[0].in_cols * layers[0].nchannels,
+            layers[0].in_rows, layers[0].in_cols, layers[0].nchannels,
+            (long)last->out_rows * last->out_cols * last->nkernels, last->out_rows,
+            last->out_cols, last->nkernels);
+    fputs(runtime_source, out);
+    for (l = 0; l < nlayers; l++)
+    {
+        emit_layer(out, l, &layers[l]);
+    }
+
+    /* the table the harness walks, and the entry points */
+    fprintf(out, "\nstruct net_layer\n{\n"
+                 "    void (*run)(const float *restrict, float *restrict);\n"
+                 "    const int16_t **weights;\n    const float *bias;\n"
+                 "    int in_rows, in_cols, nchannels, nkernels, kernel_order, stride;\n"
+                 "    int out_rows, out_cols, relu;\n    double scale;\n};\n\n"
+                 "static const struct net_layer net_layers[NET_LAYERS] = {\n");
+    for (l = 0; l < nlayers; l++)
+    {
+        const struct layer *layer = &layers[l];
+        fprintf(out, "    {layer%d, &layer%d_weights, layer%d_bias, %d, %d, %d, %d, %d, %d, %d, "
+                     "%d, %d, %.17g},\n",
+                l, l, l, layer->in_rows, layer->in_cols, layer->nchannels, layer->nkernels,
+                layer->kernel_order, layer->stride, layer->out_rows, layer->out_cols,
+                layer->relu, layer->scale);
+    }
+    fprintf(out, "};\n\n/* map or point at every layer's weights and pack them */\n"
+                 "void net_init(void)\n{\n");
+    for (l = 0; l < nlayers; l++)
+    {
+        emit_layer_init(out, l, &layers[l]);
+    }
+    fprintf(out, "}\n\n/* the network on a [%d][%d][%d] input, into a [%d][%d][%d] output;\n"
+                 "   one call at a time, as the activations between layers are static */\n"
+                 "void net_run(const float *input, float *output)\n{\n",
+            layers[0].in_rows, layers[0].in_cols, layers[0].nchannels, last->out_rows,
+            last->out_cols, last->nkernels);
+    if (nlayers == 1)
+    {
+        fprintf(out, "    layer0(input, output);\n}\n\n");
+    }
+    else
+    {
+        long largest = 0;
+        for (l = 0; l < nlayers - 1; l++)
+        {
+            long n = (long)layers[l].out_rows * layers[l].out_cols * layers[l].nkernels;
+            largest = n > largest ? n : largest;
+        }
+        fprintf(out, "    static float *buffers[2];\n\n"
+                     "    if (buffers[0] == NULL)\n    {\n"
+                     "        buffers[0] = malloc(%ldL * sizeof(float));\n"
+                     "        buffers[1] = malloc(%ldL * sizeof(float));\n    }\n"
+                     "    layer0(input, buffers[0]);\n",
+                largest, largest);
+        for (l = 1; l < nlayers - 1; l++)
+        {
+            fprintf(out, "    layer%d(buffers[%d], buffers[%d]);\n", l, (l - 1) % 2, l % 2);
+        }
+        fprintf(out, "    layer%d(buffers[%d], output);\n}\n\n", nlayers - 1, (nlayers - 2) % 2);
+    }
+    fputs(harness_source, out);
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "FATAL: cannot write %s: %s\n", argv[2], strerror(errno));
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,292 @@
+/* Coroutine front end for the direct convolution engine.
+
+   When the image is far larger than the last level cache, each task of
+   the direct engine starts by missing to DRAM on the C * K image rows it
+   reads, and the core waits. Here every tile of work is processed by a
+   coroutine that first issues software prefetches for the tile's image
+   rows, then suspends; a thread round-robins several such coroutines
+   (lanes), so by the time a lane resumes to compute, its data has had
+   the other lanes' compute time to arrive (group prefetching).
+
+   Build:
+     gcc -O3 -fopenmp -DCONV_NO_MAIN -c conv-harness.c
+     g++ -std=c++20 -O3 -fopenmp conv-coro.cpp conv-harness.o -o conv-coro -lm -lpthread
+
+   Usage:
+     conv-coro <image_width> <image_height> <kernel_order> <number of channels>
+               <number of kernels> [lanes,lanes,...]
+*/
+
+#include <atomic>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+#include <unistd.h>
+#include <xmmintrin.h>
+
+#include "conv.h"
+
+namespace
+{
+
+/* what every tile of one convolution shares */
+struct conv_shape
+{
+    const double *image; /* packed, [C][W+K][H+K] */
+    const double *kernels; /* packed, [M/MR][C][K][K][MR] */
+    float *output;
+    int width, height, nchannels, nkernels, kernel_order;
+    int tile_cols; /* output heights per tile */
+    direct_row_fn row;
+};
+
+/* tile_cols outputs from height h0 of output row w, for kernel group mb */
+struct tile
+{
+    int mb, w, h0, hcount;
+};
+
+tile tile_at(const conv_shape &shape, long index)
+{
+    long hblocks = (shape.height + shape.tile_cols - 1) / shape.tile_cols;
+    long per_group = shape.width * hblocks;
+    tile t;
+
+    t.mb = index / per_group;
+    t.w = index % per_group / hblocks;
+    t.h0 = index % hblocks * shape.tile_cols;
+    t.hcount = shape.height - t.h0 < shape.tile_cols ? shape.height - t.h0 : shape.tile_cols;
+    return t;
+}
+
+/* ask for the C * K image rows a tile reads to be brought into L2 */
+void prefetch_tile(const conv_shape &shape, const tile &t)
+{
+    long padded_height = shape.height + shape.kernel_order;
+    long channel_stride = (shape.width + shape.kernel_order) * padded_height;
+    long bytes = (t.hcount + shape.kernel_order - 1) * sizeof(double);
+
+    for (int c = 0; c < shape.nchannels; c++)
+    {
+        for (int x = 0; x < shape.kernel_order; x++)
+        {
+            const char *row = (const char *)(shape.image + c * channel_stride +
+                                             (t.w + x) * padded_height + t.h0);
+            for (long b = 0; b < bytes + 63; b += 64)
+            {
+                _mm_prefetch(row + b, _MM_HINT_T1);
+            }
+        }
+    }
+}
+
+void compute_tile(const conv_shape &shape, const tile &t)
+{
+    long padded_height = shape.height + shape.kernel_order;
+    long channel_stride = (shape.width + shape.kernel_order) * padded_height;
+    long out_stride = (long)shape.width * shape.height;
+    long block_size = (long)shape.nchannels * shape.kernel_order * shape.kernel_order * CONV_MR;
+    int m0 = t.mb * CONV_MR;
+    int mcount = shape.nkernels - m0 < CONV_MR ? shape.nkernels - m0 : CONV_MR;
+
+    shape.row(shape.image + t.w * padded_height + t.h0, shape.kernels + t.mb * block_size,
+              shape.output + m0 * out_stride + (long)t.w * shape.height + t.h0,
+              channel_stride, (int)padded_height, out_stride, mcount, t.hcount,
+              shape.nchannels, shape.kernel_order);
+}
+
+/* a coroutine that is resumed until done, one suspension point at a time */
+class lane
+{
+public:
+    struct promise_type
+    {
+        lane get_return_object()
+        {
+            return lane(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::abort(); }
+    };
+
+    explicit lane(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    lane(lane &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    lane(const lane &) = delete;
+    lane &operator=(const lane &) = delete;
+    ~lane()
+    {
+        if (handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    bool done() const { return handle_.done(); }
+    void resume() { handle_.resume(); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/* take tiles from the shared counter until none are left: prefetch the
+   tile, let the thread's other lanes run, then compute it. The frame
+   lives as long as the lane, so there is no allocation per tile */
+lane run_lane(const conv_shape &shape, std::atomic<long> &next, long ntiles)
+{
+    for (;;)
+    {
+        long index = next.fetch_add(1, std::memory_order_relaxed);
+        if (index >= ntiles)
+        {
+            co_return;
+        }
+        tile t = tile_at(shape, index);
+        prefetch_tile(shape, t);
+        co_await std::suspend_always{};
+        compute_tile(shape, t);
+    }
+}
+
+/* the direct convolution with nlanes interleaved tiles per thread */
+void interleaved_conv(const conv_shape &shape, int nlanes)
+{
+    long hblocks = (shape.height + shape.tile_cols - 1) / shape.tile_cols;
+    long ntiles = (long)(shape.nkernels + CONV_MR - 1) / CONV_MR * shape.width * hblocks;
+    std::atomic<long> next{0};
+
+#pragma omp parallel
+    {
+        std::vector<lane> lanes;
+        int live = nlanes;
+
+        for (int i = 0; i < nlanes; i++)
+        {
+            lanes.push_back(run_lane(shape, next, ntiles));
+        }
+        while (live > 0)
+        {
+            live = 0;
+            for (lane &l : lanes)
+            {
+                if (!l.done())
+                {
+                    l.resume();
+                    live += !l.done();
+                }
+            }
+        }
+    }
+}
+
+/* output heights per tile, so that the image rows of every lane of a
+   thread fit in half of L2 together; a multiple of CONV_NR vectors */
+int tile_cols_for(int nchannels, int kernel_order, int nlanes)
+{
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE) > 0 ? sysconf(_SC_LEVEL2_CACHE_SIZE) : 1L << 20;
+    long per_col = (long)nchannels * kernel_order * sizeof(double);
+    int step = CONV_NR * 8;
+    long cols = l2 / 2 / nlanes / per_col - kernel_order;
+
+    cols = cols / step * step;
+    return cols < step ? step : (int)cols;
+}
+
+/* mean seconds per call of f over at least half a second */
+template <typename F>
+double time_calls(F f)
+{
+    double start;
+    int runs = 0;
+
+    f();
+    start = now_seconds();
+    while (now_seconds() - start < 0.5 || runs < 3)
+    {
+        f();
+        runs++;
+    }
+    return (now_seconds() - start) / runs;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "Usage: conv-coro <image_width> <image_height> <kernel_order> "
+                        "<number of channels> <number of kernels> [lanes,lanes,...]\n");
+        exit(1);
+    }
+    int width = atoi(argv[1]), height = atoi(argv[2]), kernel_order = atoi(argv[3]);
+    int nchannels = atoi(argv[4]), nkernels = atoi(argv[5]);
+    std::vector<int> lane_counts;
+    const char *list = argc > 6 ? argv[6] : "1,2,4,8";
+
+    for (const char *p = list; p != nullptr; p = strchr(p, ','), p = p != nullptr ? p + 1 : p)
+    {
+        if (atoi(p) > 0)
+        {
+            lane_counts.push_back(atoi(p));
+        }
+    }
+
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    float ***image = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    float ***control = new_empty_3d_matrix_float(nkernels, width, height);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    double *packed = (double *)malloc((long)padded_width * padded_height * nchannels *
+                                      sizeof(double));
+    double *packed_kernels = pack_kernels(kernels, nchannels, nkernels, kernel_order);
+    const double *kernel_copies[1] = {packed_kernels};
+    struct conv_view control_view = conv_view_float3d(control, width, height);
+    enum conv_isa isa = select_isa();
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    double image_bytes = (double)padded_width * padded_height * nchannels * sizeof(double);
+
+    pack_image(image, packed, padded_width, padded_height, nchannels);
+    printf("Packed image %.1f MB, LLC %.1f MB%s, %d threads\n", image_bytes / (1 << 20),
+           llc / (double)(1 << 20),
+           llc > 0 && image_bytes < llc ? " (image fits: not a memory-bound shape)" : "",
+           omp_get_max_threads());
+
+    double plain = time_calls([&] {
+        direct_conv_packed(packed, kernel_copies, &control_view, width, height, nchannels,
+                           nkernels, kernel_order, isa, nullptr);
+    });
+    printf("%12s %10s %14s %10s %12s\n", "executor", "tile cols", "us per conv", "speedup",
+           "SAD");
+    printf("%12s %10s %14.1f %10.2f %12s\n", "plain loop", "row", plain * 1e6, 1.0, "-");
+
+    for (int nlanes : lane_counts)
+    {
+        conv_shape shape = {packed, packed_kernels, **output, width, height, nchannels,
+                            nkernels, kernel_order,
+                            tile_cols_for(nchannels, kernel_order, nlanes),
+                            conv_direct_row_kernel(isa)};
+        char label[32];
+
+        memset(**output, 0, (long)nkernels * width * height * sizeof(float));
+        double t = time_calls([&] { interleaved_conv(shape, nlanes); });
+        snprintf(label, sizeof(label), "%d lanes", nlanes);
+        printf("%12s %10d %14.1f %10.2f %12f\n", label, shape.tile_cols, t * 1e6, plain / t,
+               sum_abs_diff(output, control, nkernels, width, height));
+    }
+
+    free(packed);
+    free(packed_kernels);
+    free_3d_matrix_float(image);
+    free_3d_matrix_float(control);
+    free_3d_matrix_float(output);
+    free_4d_matrix_int16(kernels);
+    return 0;
+}
@@ -34,15 +34,38 @@
    Version 1.1 : Fixed bug in code to create 4d matrix
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/io_uring.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 #include <omp.h>
 #include <math.h>
 #include <stdint.h>
 #include <x86intrin.h>
 
+#include "conv.h"
+
 /* the following two definitions of DEBUGGING control whether or not
    debugging information is written out. To put the program into
    debugging mode, uncomment the following line: */
@@ -148,6 +171,23 @@ int16_t ***new_empty_3d_matrix_int16(int dim0, int dim1, int dim2)
     return mat3d;
 }
 
+/* free a 3d matrix allocated by new_empty_3d_matrix_float */
+void free_3d_matrix_float(float ***matrix)
+{
+    free(**matrix);
+    free(*matrix);
+    free(matrix);
+}
+
+/* free a 4d matrix allocated by new_empty_4d_matrix_int16 */
+void free_4d_matrix_int16(int16_t ****matrix)
+{
+    free(***matrix);
+    free(**matrix);
+    free(*matrix);
+    free(matrix);
+}
+
 /* take a copy of the matrix and return in a newly allocated matrix */
 int16_t ****copy_4d_matrix(int16_t ****source_matrix, int dim0,
                            int dim1, int dim2, int dim3)
@@ -281,15 +321,12 @@ int16_t ***gen_random_3d_matrix_int16(int dim0, int dim1, int dim2)
     return mat3d;
 }
 
-/* check the sum of absolute differences is within reasonable epsilon */
-void check_result(float ***result, float ***control,
-                  int dim0, int dim1, int dim2)
+/* sum of absolute differences between two 3d matrices */
+double sum_abs_diff(float ***result, float ***control,
+                    int dim0, int dim1, int dim2)
 {
     int i, j, k;
     double sum_abs_diff = 0.0;
-    const double EPSILON = 0.0625;
-
-    // printf("SAD\n");
 
     for (i = 0; i < dim0; i++)
     {
@@ -303,15 +340,26 @@ void check_result(float ***result, float ***control,
             }
         }
     }
+    return sum_abs_diff;
+}
+
+/* check the sum of absolute differences is within reasonable epsilon */
+void check_result(float ***result, float ***control,
+                  int dim0, int dim1, int dim2)
+{
+    double sum_abs_diff_total = sum_abs_diff(result, control, dim0, dim1, dim2);
+    const double EPSILON = 0.0625;
 
-    if (sum_abs_diff > EPSILON)
+    // printf("SAD\n");
+
+    if (sum_abs_diff_total > EPSILON)
     {
         fprintf(stderr, "WARNING: sum of absolute differences (%f) > EPSILON (%f)\n",
-                sum_abs_diff, EPSILON);
+                sum_abs_diff_total, EPSILON);
     }
     else
     {
-        printf("COMMENT: sum of absolute differences (%f)  within acceptable range (%f)\n", sum_abs_diff, EPSILON);
+        printf("COMMENT: sum of absolute differences (%f)  within acceptable range (%f)\n", sum_abs_diff_total, EPSILON);
     }
 }
 
@@ -345,174 +393,8526 @@ void multichannel_conv(float ***image, int16_t ****kernels,
     }
 }
 
-/* TODO the fast version of matmul written by the student */
-void student_conv(float ***image, int16_t ****kernels, float ***output,
-                  int width, int height, int nchannels, int nkernels,
-                  int kernel_order)
+/* instruction sets the direct convolution kernels are compiled for.
+   ISA_AVX512VL uses AVX-512 masking on 256-bit vectors, which avoids the
+   frequency licence that 512-bit FMAs take on many Xeons */
+static const char *isa_names[] = {"scalar", "avx2", "avx512vl", "avx512"};
+
+
+/* pick the widest instruction set supported by the running cpu, unless
+   CONV_ISA=scalar|avx2|avx512vl asks for a narrower one */
+enum conv_isa detect_isa(void)
 {
-    /* Declare loop variables */
-    int h, w, x, y, c, m;
+    const char *forced = getenv("CONV_ISA");
+
+    if (forced != NULL)
+    {
+        if (strcmp(forced, "scalar") == 0)
+        {
+            return ISA_SCALAR;
+        }
+        if (strcmp(forced, "avx2") == 0)
+        {
+            return ISA_AVX2;
+        }
+        if (strcmp(forced, "avx512vl") == 0)
+        {
+            return ISA_AVX512VL;
+        }
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+    {
+        return ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return ISA_AVX2;
+    }
+    return ISA_SCALAR;
+}
 
-    /* Set pointers for access to kernels, output & image */
-    int16_t *kernel_pointer = ***kernels;
-    float *output_pointer = **output;
-    float *image_pointer = **image;
+/* a view of a whole [dim0][dim1][dim2] float matrix */
+struct conv_view conv_view_float3d(float ***matrix, int dim1, int dim2)
+{
+    struct conv_view view = {matrix[0][0], 0, {(long)dim1 * dim2, dim2, 1, 0}};
+    return view;
+}
 
-    /* Calculate constants */
-    int kernel_order_squared = kernel_order * kernel_order;
-    int m_index, c_index, x_index, mo_index, w_index, h_index;
-    int m_mult = kernel_order_squared * nchannels;
-    int mo_mult = width * height;
-    __m128 sum4;
+/* a view of a whole [dim0][dim1][dim2][dim3] int16 matrix */
+struct conv_view conv_view_int16_4d(int16_t ****matrix, int dim1, int dim2, int dim3)
+{
+    struct conv_view view = {matrix[0][0][0], 0,
+                             {(long)dim1 * dim2 * dim3, (long)dim2 * dim3, dim3, 1}};
+    return view;
+}
+
+/* the view starting at index start of one axis, e.g. the crop of an
+   image from row x0, the channels from c0 or the kernels from m0 */
+struct conv_view conv_view_slice(struct conv_view view, int axis, long start)
+{
+    view.offset += start * view.strides[axis];
+    return view;
+}
+
+/* copy the [W+K][H+K][C] image into a planar [C][W+K][H+K] double
+   tensor, so that neighbouring output heights are contiguous in memory.
+   Products of the 13-bit image values and 10-bit kernel values are
+   exact in double precision, and so are their sums */
+void pack_image_view(const struct conv_view *image, double *packed, int padded_width,
+                     int padded_height, int nchannels)
+{
+    const float *data = (const float *)image->data + image->offset;
+    long plane = (long)padded_width * padded_height;
+    int w, h, c;
+
+#pragma omp parallel for private(h, c)
+    for (w = 0; w < padded_width; w++)
+    {
+        for (h = 0; h < padded_height; h++)
+        {
+            const float *pixel = data + w * image->strides[0] + h * image->strides[1];
+            for (c = 0; c < nchannels; c++)
+            {
+                packed[c * plane + (long)w * padded_height + h] = pixel[c * image->strides[2]];
+            }
+        }
+    }
+}
+
+void pack_image(float ***image, double *packed, int padded_width,
+                int padded_height, int nchannels)
+{
+    struct conv_view view = conv_view_float3d(image, padded_height, nchannels);
+    pack_image_view(&view, packed, padded_width, padded_height, nchannels);
+}
+
+/* convert the kernels to double and interleave groups of CONV_MR kernels
+   as [M/MR][C][K][K][MR], zero-filling the missing kernels of the last
+   group, so a kernel block can broadcast its weights in order */
+double *pack_kernels_view(const struct conv_view *kernels, int nchannels, int nkernels,
+                          int kernel_order)
+{
+    const int16_t *data = (const int16_t *)kernels->data + kernels->offset;
+    int mblocks = (nkernels + CONV_MR - 1) / CONV_MR;
+    int block_size = nchannels * kernel_order * kernel_order * CONV_MR;
+    double *packed = calloc((long)mblocks * block_size, sizeof(double));
+    int m, c, x, y;
 
-/* Parallelize the outer loop using OpenMP */
-#pragma omp parallel for
     for (m = 0; m < nkernels; m++)
     {
-        mo_index = m * mo_mult;
-        m_index = m * m_mult;
-        for (w = 0; w < width; w++)
+        double *block = packed + (long)(m / CONV_MR) * block_size;
+        for (c = 0; c < nchannels; c++)
         {
-            w_index = w * height + mo_index;
-            for (h = 0; h < height; h++)
+            for (x = 0; x < kernel_order; x++)
             {
-                h_index = h + w_index;
-                double sum = 0.0;
-                for (c = 0; c < nchannels; c++)
+                for (y = 0; y < kernel_order; y++)
                 {
-                    int c_index = c * kernel_order_squared + m_index;
-                    if (kernel_order == 1)
-                    {
-                        for (x = 0; x < kernel_order; x++)
-                        {
-                            x_index = x * kernel_order + c_index;
-                            sum += image[w + x][h][c] * kernel_pointer[x_index];
-                        }
-                    }
-                    else if (kernel_order == 3)
+                    int k = (c * kernel_order + x) * kernel_order + y;
+                    block[k * CONV_MR + m % CONV_MR] =
+                        data[m * kernels->strides[0] + c * kernels->strides[1] +
+                             x * kernels->strides[2] + y * kernels->strides[3]];
+                }
+            }
+        }
+    }
+    return packed;
+}
+
+double *pack_kernels(int16_t ****kernels, int nchannels, int nkernels,
+                     int kernel_order)
+{
+    struct conv_view view = conv_view_int16_4d(kernels, nchannels, kernel_order, kernel_order);
+    return pack_kernels_view(&view, nchannels, nkernels, kernel_order);
+}
+
+/* compute one output row (fixed w, every h) for up to CONV_MR kernels.
+   img points at row w of channel 0 of the packed image, kern at the
+   packed block of the kernels and out at output[m0][w] */
+void direct_row_scalar(const double *img, const double *kern, float *out,
+                       long channel_stride, int row_stride, long out_stride,
+                       int mcount, int height, int nchannels, int kernel_order)
+{
+    int h, i, c, x, y;
+
+    for (h = 0; h < height; h++)
+    {
+        double sum[CONV_MR] = {0.0};
+        const double *k = kern;
+        for (c = 0; c < nchannels; c++)
+        {
+            for (x = 0; x < kernel_order; x++)
+            {
+                const double *row = img + c * channel_stride + x * row_stride + h;
+                for (y = 0; y < kernel_order; y++)
+                {
+                    for (i = 0; i < CONV_MR; i++)
                     {
-                        for (x = 0; x < kernel_order; x++)
-                        {
-                            x_index = x * kernel_order + c_index;
-                            /* Apply the kernel to the image by summing the products of corresponding elements */
-                            sum += image[w + x][h][c] * kernel_pointer[x_index];
-                            sum += image[w + x][h + 1][c] * kernel_pointer[1 + x_index];
-                            sum += image[w + x][h + 2][c] * kernel_pointer[2 + x_index];
-                        }
+                        sum[i] += row[y] * k[i];
                     }
-                    else if (kernel_order == 5)
+                    k += CONV_MR;
+                }
+            }
+        }
+        for (i = 0; i < mcount; i++)
+        {
+            out[i * out_stride + h] = (float)sum[i];
+        }
+    }
+}
+
+/* one CONV_MR x (CONV_NR * 8) block of outputs with 512-bit vectors.
+   Every load and store goes through a k-mask, so the last block of a
+   row is handled by the same code with a partial mask */
+__attribute__((target("avx512f,avx512vl"), always_inline)) static inline void
+direct_block_avx512(const double *img, const double *kern, float *out,
+                    long channel_stride, int row_stride, long out_stride,
+                    int mcount, int remaining, int nchannels, int kernel_order)
+{
+    __m512d acc[CONV_MR][CONV_NR];
+    __mmask8 mask[CONV_NR];
+    int i, j, c, x, y;
+
+    for (j = 0; j < CONV_NR; j++)
+    {
+        int lanes = remaining - j * 8;
+        lanes = lanes < 0 ? 0 : (lanes > 8 ? 8 : lanes);
+        mask[j] = (__mmask8)((1u << lanes) - 1);
+        for (i = 0; i < CONV_MR; i++)
+        {
+            acc[i][j] = _mm512_setzero_pd();
+        }
+    }
+
+    for (c = 0; c < nchannels; c++)
+    {
+        for (x = 0; x < kernel_order; x++)
+        {
+            const double *row = img + c * channel_stride + x * row_stride;
+            for (y = 0; y < kernel_order; y++)
+            {
+                __m512d v[CONV_NR];
+                for (j = 0; j < CONV_NR; j++)
+                {
+                    v[j] = _mm512_maskz_loadu_pd(mask[j], row + y + j * 8);
+                }
+                for (i = 0; i < CONV_MR; i++)
+                {
+                    __m512d k = _mm512_set1_pd(kern[i]);
+                    for (j = 0; j < CONV_NR; j++)
                     {
-                        for (x = 0; x < kernel_order; x++)
-                        {
-                            x_index = x * kernel_order + c_index;
-                            /* Apply the kernel to the image by summing the products of corresponding elements */
-                            sum += image[w + x][h][c] * kernel_pointer[x_index];
-                            sum += image[w + x][h + 1][c] * kernel_pointer[1 + x_index];
-                            sum += image[w + x][h + 2][c] * kernel_pointer[2 + x_index];
-                            sum += image[w + x][h + 3][c] * kernel_pointer[3 + x_index];
-                            sum += image[w + x][h + 4][c] * kernel_pointer[4 + x_index];
-                        }
+                        acc[i][j] = _mm512_fmadd_pd(k, v[j], acc[i][j]);
                     }
-                    else if (kernel_order == 7)
+                }
+                kern += CONV_MR;
+            }
+        }
+    }
+
+    for (i = 0; i < mcount; i++)
+    {
+        for (j = 0; j < CONV_NR; j++)
+        {
+            _mm256_mask_storeu_ps(out + i * out_stride + j * 8, mask[j],
+                                  _mm512_cvtpd_ps(acc[i][j]));
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512vl"))) void
+direct_row_avx512(const double *img, const double *kern, float *out,
+                  long channel_stride, int row_stride, long out_stride,
+                  int mcount, int height, int nchannels, int kernel_order)
+{
+    int h;
+
+    for (h = 0; h < height; h += CONV_NR * 8)
+    {
+        direct_block_avx512(img + h, kern, out + h, channel_stride, row_stride,
+                            out_stride, mcount, height - h, nchannels, kernel_order);
+    }
+}
+
+/* the AVX-512 kernel on 256-bit vectors: same k-masked tails, but no
+   512-bit instructions, so it runs at the AVX2 frequency licence */
+__attribute__((target("avx512f,avx512vl,fma"), always_inline)) static inline void
+direct_block_avx512vl(const double *img, const double *kern, float *out,
+                      long channel_stride, int row_stride, long out_stride,
+                      int mcount, int remaining, int nchannels, int kernel_order)
+{
+    __m256d acc[CONV_MR][CONV_NR];
+    __mmask8 mask[CONV_NR];
+    int i, j, c, x, y;
+
+    for (j = 0; j < CONV_NR; j++)
+    {
+        int lanes = remaining - j * 4;
+        lanes = lanes < 0 ? 0 : (lanes > 4 ? 4 : lanes);
+        mask[j] = (__mmask8)((1u << lanes) - 1);
+        for (i = 0; i < CONV_MR; i++)
+        {
+            acc[i][j] = _mm256_setzero_pd();
+        }
+    }
+
+    for (c = 0; c < nchannels; c++)
+    {
+        for (x = 0; x < kernel_order; x++)
+        {
+            const double *row = img + c * channel_stride + x * row_stride;
+            for (y = 0; y < kernel_order; y++)
+            {
+                __m256d v[CONV_NR];
+                for (j = 0; j < CONV_NR; j++)
+                {
+                    v[j] = _mm256_maskz_loadu_pd(mask[j], row + y + j * 4);
+                }
+                for (i = 0; i < CONV_MR; i++)
+                {
+                    __m256d k = _mm256_set1_pd(kern[i]);
+                    for (j = 0; j < CONV_NR; j++)
                     {
-                        for (x = 0; x < kernel_order; x++)
-                        {
-                            x_index = x * kernel_order + c_index;
-                            /* Apply the kernel to the image by summing the products of corresponding elements */
-                            sum += image[w + x][h][c] * kernel_pointer[x_index];
-                            sum += image[w + x][h + 1][c] * kernel_pointer[1 + x_index];
-                            sum += image[w + x][h + 2][c] * kernel_pointer[2 + x_index];
-                            sum += image[w + x][h + 3][c] * kernel_pointer[3 + x_index];
-                            sum += image[w + x][h + 4][c] * kernel_pointer[4 + x_index];
-                            sum += image[w + x][h + 5][c] * kernel_pointer[5 + x_index];
-                            sum += image[w + x][h + 6][c] * kernel_pointer[6 + x_index];
-                        }
+                        acc[i][j] = _mm256_fmadd_pd(k, v[j], acc[i][j]);
                     }
                 }
-                output_pointer[h_index] = (float)sum;
+                kern += CONV_MR;
             }
         }
     }
+
+    for (i = 0; i < mcount; i++)
+    {
+        for (j = 0; j < CONV_NR; j++)
+        {
+            _mm_mask_storeu_ps(out + i * out_stride + j * 4, mask[j],
+                               _mm256_cvtpd_ps(acc[i][j]));
+        }
+    }
 }
 
-int main(int argc, char **argv)
+__attribute__((target("avx512f,avx512vl,fma"))) void
+direct_row_avx512vl(const double *img, const double *kern, float *out,
+                    long channel_stride, int row_stride, long out_stride,
+                    int mcount, int height, int nchannels, int kernel_order)
 {
-    // float image[W][H][C];
-    // float kernels[M][C][K][K];
-    // float output[M][W][H];
+    int h;
 
-    float ***image;
-    int16_t ****kernels;
-    float ***control_output, ***output;
-    long long mul_time, mul_time_control;
-    int width, height, kernel_order, nchannels, nkernels;
-    struct timeval start_time;
-    struct timeval stop_time;
-    struct timeval start_time_control;
-    struct timeval stop_time_control;
+    for (h = 0; h < height; h += CONV_NR * 4)
+    {
+        direct_block_avx512vl(img + h, kern, out + h, channel_stride, row_stride,
+                              out_stride, mcount, height - h, nchannels, kernel_order);
+    }
+}
+
+/* lane masks for _mm256_maskload_pd / _mm_maskstore_ps: a window of
+   the table starting at (8 - lanes) has exactly 'lanes' leading ones */
+static const int64_t avx2_mask_pd[16] = {-1, -1, -1, -1, -1, -1, -1, -1,
+                                         0, 0, 0, 0, 0, 0, 0, 0};
+static const int32_t avx2_mask_ps[16] = {-1, -1, -1, -1, -1, -1, -1, -1,
+                                         0, 0, 0, 0, 0, 0, 0, 0};
+
+/* one CONV_MR x (CONV_NR * 4) block of outputs with 256-bit vectors.
+   Full blocks use plain loads; the tail block (masked != 0) blends the
+   out-of-range lanes away with maskload/maskstore instead of falling
+   back to a scalar epilogue */
+__attribute__((target("avx2,fma"), always_inline)) static inline void
+direct_block_avx2(const double *img, const double *kern, float *out,
+                  long channel_stride, int row_stride, long out_stride,
+                  int mcount, int remaining, int nchannels, int kernel_order,
+                  int masked)
+{
+    __m256d acc[CONV_MR][CONV_NR];
+    __m256i load_mask[CONV_NR];
+    __m128i store_mask[CONV_NR];
+    int i, j, c, x, y;
 
-    if (argc != 6)
+    for (j = 0; j < CONV_NR; j++)
     {
-        fprintf(stderr, "Usage: conv-harness <image_width> <image_height> <kernel_order> <number of channels> <number of kernels>\n");
-        exit(1);
+        int lanes = remaining - j * 4;
+        lanes = lanes < 0 ? 0 : (lanes > 4 ? 4 : lanes);
+        load_mask[j] = _mm256_loadu_si256((const __m256i *)(avx2_mask_pd + 8 - lanes));
+        store_mask[j] = _mm_loadu_si128((const __m128i *)(avx2_mask_ps + 8 - lanes));
+        for (i = 0; i < CONV_MR; i++)
+        {
+            acc[i][j] = _mm256_setzero_pd();
+        }
     }
-    else
+
+    for (c = 0; c < nchannels; c++)
     {
-        width = atoi(argv[1]);
-        height = atoi(argv[2]);
-        kernel_order = atoi(argv[3]);
-        nchannels = atoi(argv[4]);
-        nkernels = atoi(argv[5]);
+        for (x = 0; x < kernel_order; x++)
+        {
+            const double *row = img + c * channel_stride + x * row_stride;
+            for (y = 0; y < kernel_order; y++)
+            {
+                __m256d v[CONV_NR];
+                for (j = 0; j < CONV_NR; j++)
+                {
+                    v[j] = masked ? _mm256_maskload_pd(row + y + j * 4, load_mask[j])
+                                  : _mm256_loadu_pd(row + y + j * 4);
+                }
+                for (i = 0; i < CONV_MR; i++)
+                {
+                    __m256d k = _mm256_broadcast_sd(kern + i);
+                    for (j = 0; j < CONV_NR; j++)
+                    {
+                        acc[i][j] = _mm256_fmadd_pd(k, v[j], acc[i][j]);
+                    }
+                }
+                kern += CONV_MR;
+            }
+        }
     }
-    switch (kernel_order)
+
+    for (i = 0; i < mcount; i++)
     {
-    case 1:
-    case 3:
-    case 5:
-    case 7:
-        break;
-    default:
-        fprintf(stderr, "FATAL: kernel_order must be 1, 3, 5 or 7, not %d\n",
-                kernel_order);
-        exit(1);
+        for (j = 0; j < CONV_NR; j++)
+        {
+            __m128 result = _mm256_cvtpd_ps(acc[i][j]);
+            if (masked)
+            {
+                _mm_maskstore_ps(out + i * out_stride + j * 4, store_mask[j], result);
+            }
+            else
+            {
+                _mm_storeu_ps(out + i * out_stride + j * 4, result);
+            }
+        }
     }
+}
 
-    /* allocate the matrices */
-    image = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
-                                       nchannels);
-    kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order, kernel_order);
-    output = new_empty_3d_matrix_float(nkernels, width, height);
-    control_output = new_empty_3d_matrix_float(nkernels, width, height);
+__attribute__((target("avx2,fma"))) void
+direct_row_avx2(const double *img, const double *kern, float *out,
+                long channel_stride, int row_stride, long out_stride,
+                int mcount, int height, int nchannels, int kernel_order)
+{
+    int h;
 
-    // DEBUGGING(write_out(A, a_dim1, a_dim2));
+    for (h = 0; h + CONV_NR * 4 <= height; h += CONV_NR * 4)
+    {
+        direct_block_avx2(img + h, kern, out + h, channel_stride, row_stride,
+                          out_stride, mcount, CONV_NR * 4, nchannels, kernel_order, 0);
+    }
+    if (h < height)
+    {
+        direct_block_avx2(img + h, kern, out + h, channel_stride, row_stride,
+                          out_stride, mcount, height - h, nchannels, kernel_order, 1);
+    }
+}
 
-    gettimeofday(&start_time_control, NULL);
-    /* use a simple multichannel convolution routine to produce control result */
-    multichannel_conv(image, kernels, control_output, width,
-                      height, nchannels, nkernels, kernel_order);
-    gettimeofday(&stop_time_control, NULL);
-    mul_time_control = (stop_time_control.tv_sec - start_time_control.tv_sec) * 1000000L +
-               (stop_time_control.tv_usec - start_time_control.tv_usec);
-    printf("Control conv time: %lld microseconds\n", mul_time_control);
+static const direct_row_fn direct_row_kernels[] = {direct_row_scalar, direct_row_avx2,
+                                                   direct_row_avx512vl, direct_row_avx512};
 
-    /* record starting time of student's code*/
-    gettimeofday(&start_time, NULL);
+/* the direct engine's row kernel, for front ends that schedule rows themselves */
+direct_row_fn conv_direct_row_kernel(enum conv_isa isa)
+{
+    return direct_row_kernels[isa];
+}
 
-    /* perform student's multichannel convolution */
-    student_conv(image, kernels, output, width,
-                 height, nchannels, nkernels, kernel_order);
+/* a set of cpus a plan's threads are bound to */
+struct core_set
+{
+    int ncpus;
+    int cpus[CPU_SETSIZE];
+};
 
-    /* record finishing time */
-    gettimeofday(&stop_time, NULL);
-    mul_time = (stop_time.tv_sec - start_time.tv_sec) * 1000000L +
-               (stop_time.tv_usec - start_time.tv_usec);
-    printf("Student conv time: %lld microseconds\n", mul_time);
+/* the cpus this process may run on, in increasing order */
+void online_cores(struct core_set *cores)
+{
+    cpu_set_t set;
+    int cpu;
 
-    DEBUGGING(write_out(output, nkernels, width, height));
+    cores->ncpus = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        cores->cpus[cores->ncpus++] = 0;
+        return;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set))
+        {
+            cores->cpus[cores->ncpus++] = cpu;
+        }
+    }
+}
 
-    /* now check that the student's multichannel convolution routine
-       gives the same answer as the known working version */
-    check_result(output, control_output, nkernels, width, height);
+/* NUMA nodes a plan keeps kernel copies for; higher node ids share node 0's */
+#define CONV_MAX_NODES 64
 
-    return 0;
-}
\ No newline at end of file
+/* how the online cpus map onto physical cores, shared L3 slices and NUMA nodes */
+struct cpu_topology
+{
+    int ncpus;
+    int cpu[CPU_SETSIZE];
+    int first_thread[CPU_SETSIZE]; /* lowest SMT sibling, naming the physical core */
+    int l3_domain[CPU_SETSIZE];    /* dense index of the L3 slice the cpu shares */
+    int node[CPU_SETSIZE];         /* NUMA node, below CONV_MAX_NODES */
+    int nl3_domains;
+    int nnodes; /* highest node id plus one */
+};
+
+/* the first cpu number of a sysfs cpu list such as "0-3,8-11", or
+   fallback if the file is missing */
+static int sysfs_first_cpu(int cpu, const char *file, int fallback)
+{
+    char path[128];
+    FILE *f;
+    int first;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, file);
+    f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return fallback;
+    }
+    if (fscanf(f, "%d", &first) != 1)
+    {
+        first = fallback;
+    }
+    fclose(f);
+    return first;
+}
+
+/* the NUMA node of a cpu: sysfs links node<N> into each cpu directory */
+static int sysfs_cpu_node(int cpu)
+{
+    char path[128];
+    int node;
+
+    for (node = 0; node < CONV_MAX_NODES; node++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0)
+        {
+            return node;
+        }
+    }
+    return 0;
+}
+
+/* read the topology of the online cpus from sysfs. An L3 slice is named
+   by the lowest cpu sharing it; without sysfs every cpu is its own
+   physical core and all of them share one slice and node */
+static void read_topology(struct cpu_topology *topo)
+{
+    struct core_set online;
+    int l3_first[CPU_SETSIZE];
+    int i, d;
+
+    online_cores(&online);
+    topo->ncpus = online.ncpus;
+    topo->nl3_domains = 0;
+    topo->nnodes = 1;
+    for (i = 0; i < online.ncpus; i++)
+    {
+        int cpu = online.cpus[i];
+        int l3 = sysfs_first_cpu(cpu, "cache/index3/shared_cpu_list",
+                                 sysfs_first_cpu(cpu, "topology/package_cpus_list", 0));
+
+        topo->cpu[i] = cpu;
+        topo->node[i] = sysfs_cpu_node(cpu);
+        topo->nnodes = topo->node[i] >= topo->nnodes ? topo->node[i] + 1 : topo->nnodes;
+        topo->first_thread[i] = sysfs_first_cpu(cpu, "topology/thread_siblings_list", cpu);
+        for (d = 0; d < topo->nl3_domains && l3_first[d] != l3; d++)
+        {
+        }
+        if (d == topo->nl3_domains)
+        {
+            l3_first[topo->nl3_domains++] = l3;
+        }
+        topo->l3_domain[i] = d;
+    }
+}
+
+/* the topology, read once */
+const struct cpu_topology *conv_topology(void)
+{
+    static struct cpu_topology topo;
+    static int read = 0;
+
+#pragma omp critical(conv_topology)
+    {
+        if (!read)
+        {
+            read_topology(&topo);
+            read = 1;
+        }
+    }
+    return &topo;
+}
+
+/* the topology index of a cpu, or -1 for one the topology does not know */
+static int topology_index(int cpu)
+{
+    const struct cpu_topology *topo = conv_topology();
+    int i;
+
+    for (i = 0; i < topo->ncpus; i++)
+    {
+        if (topo->cpu[i] == cpu)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* the L3 domain of a cpu, or 0 for one the topology does not know */
+int cpu_l3_domain(int cpu)
+{
+    int i = topology_index(cpu);
+    return i >= 0 ? conv_topology()->l3_domain[i] : 0;
+}
+
+/* the NUMA node of a cpu, or 0 for one the topology does not know */
+int cpu_numa_node(int cpu)
+{
+    int i = topology_index(cpu);
+    return i >= 0 ? conv_topology()->node[i] : 0;
+}
+
+/* the cpus plans run on by default: one thread per physical core, ordered
+   so that the cores of each L3 slice are contiguous. CONV_SMT=1 adds the
+   SMT siblings, after the first threads of their slice, and
+   OMP_NUM_THREADS still caps the number of cpus */
+void default_cores(struct core_set *cores)
+{
+    const struct cpu_topology *topo = conv_topology();
+    const char *smt = getenv("CONV_SMT");
+    const char *limit = getenv("OMP_NUM_THREADS");
+    int with_smt = smt != NULL && atoi(smt) != 0;
+    int d, pass, i;
+
+    cores->ncpus = 0;
+    for (d = 0; d < topo->nl3_domains; d++)
+    {
+        for (pass = 0; pass < 1 + with_smt; pass++)
+        {
+            for (i = 0; i < topo->ncpus; i++)
+            {
+                int j, primary = 1;
+                if (topo->l3_domain[i] != d)
+                {
+                    continue;
+                }
+                /* the first allowed sibling stands for the physical core */
+                for (j = 0; j < i; j++)
+                {
+                    if (topo->first_thread[j] == topo->first_thread[i])
+                    {
+                        primary = 0;
+                        break;
+                    }
+                }
+                if (primary == (pass == 0))
+                {
+                    cores->cpus[cores->ncpus++] = topo->cpu[i];
+                }
+            }
+        }
+    }
+    if (limit != NULL && atoi(limit) > 0 && atoi(limit) < cores->ncpus)
+    {
+        cores->ncpus = atoi(limit);
+    }
+}
+
+/* split the default cpus into nparts disjoint, contiguous sets sized in
+   proportion to the weights (largest remainder), each getting at least
+   one cpu. With fewer cpus than parts the sets wrap around and share.
+   The default cpus are ordered by L3 slice, so sets stay within a slice
+   where the sizes allow it */
+void conv_partition_cores(int nparts, const double *weights, struct core_set *sets)
+{
+    struct core_set online;
+    double total = 0.0, remainder[nparts];
+    int share[nparts];
+    int i, assigned = 0, next = 0;
+
+    default_cores(&online);
+    for (i = 0; i < nparts; i++)
+    {
+        total += weights != NULL ? weights[i] : 1.0;
+    }
+    for (i = 0; i < nparts; i++)
+    {
+        double exact = online.ncpus * (weights != NULL ? weights[i] : 1.0) / total;
+        share[i] = (int)exact;
+        remainder[i] = exact - share[i];
+        if (share[i] == 0)
+        {
+            share[i] = 1;
+            remainder[i] = 0.0;
+        }
+        assigned += share[i];
+    }
+    /* hand out cpus left by rounding down, largest remainder first */
+    while (assigned < online.ncpus)
+    {
+        int best = 0;
+        for (i = 1; i < nparts; i++)
+        {
+            if (remainder[i] > remainder[best])
+            {
+                best = i;
+            }
+        }
+        share[best]++;
+        remainder[best] = -1.0;
+        assigned++;
+    }
+    /* and take back any a minimum of one cpu pushed over the total */
+    while (assigned > online.ncpus && assigned > nparts)
+    {
+        int largest = 0;
+        for (i = 1; i < nparts; i++)
+        {
+            if (share[i] > share[largest])
+            {
+                largest = i;
+            }
+        }
+        share[largest]--;
+        assigned--;
+    }
+    for (i = 0; i < nparts; i++)
+    {
+        int j;
+        sets[i].ncpus = share[i];
+        for (j = 0; j < share[i]; j++)
+        {
+            sets[i].cpus[j] = online.cpus[next++ % online.ncpus];
+        }
+    }
+}
+
+
+/* bind the calling thread's OpenMP team to a core set: the team size
+   becomes the set size and thread i runs on cpu i of the set. libgomp
+   keeps the same pool threads for later regions of this caller, so
+   the engines' own parallel regions stay inside the set. Binding again
+   to the set the caller is already bound to is free */
+void bind_team_to_cores(const struct core_set *cores)
+{
+    static __thread struct core_set bound;
+
+    if (bound.ncpus == cores->ncpus &&
+        memcmp(bound.cpus, cores->cpus, cores->ncpus * sizeof(int)) == 0)
+    {
+        return;
+    }
+    omp_set_num_threads(cores->ncpus);
+#pragma omp parallel num_threads(cores->ncpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cores->cpus[omp_get_thread_num()], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    bound.ncpus = cores->ncpus;
+    memcpy(bound.cpus, cores->cpus, cores->ncpus * sizeof(int));
+}
+
+/* how a bound team's threads group into L3 domains */
+struct conv_schedule
+{
+    int nthreads;
+    int ndomains;
+    int thread_domain[CPU_SETSIZE]; /* dense domain index of each thread */
+    int thread_node[CPU_SETSIZE];   /* NUMA node of each thread */
+};
+
+/* the schedule of a team bound to a core set with bind_team_to_cores */
+void conv_schedule_build(const struct core_set *cores, struct conv_schedule *schedule)
+{
+    int domain_of[CPU_SETSIZE];
+    int i, d;
+
+    schedule->nthreads = cores->ncpus;
+    schedule->ndomains = 0;
+    for (i = 0; i < cores->ncpus; i++)
+    {
+        int l3 = cpu_l3_domain(cores->cpus[i]);
+        for (d = 0; d < schedule->ndomains && domain_of[d] != l3; d++)
+        {
+        }
+        if (d == schedule->ndomains)
+        {
+            domain_of[schedule->ndomains++] = l3;
+        }
+        schedule->thread_domain[i] = d;
+        schedule->thread_node[i] = cpu_numa_node(cores->cpus[i]);
+    }
+}
+
+/* engines take read-only data that may be replicated per NUMA node as
+   one pointer per node (the same pointer throughout when it is not);
+   a thread reads the copy on its own node */
+static const double *node_copy(const struct conv_schedule *schedule,
+                               const double *const *copies, int thread)
+{
+    return copies[schedule != NULL ? schedule->thread_node[thread] : 0];
+}
+
+/* a copy made by replicate_on_cpu */
+struct replica_job
+{
+    const void *source;
+    void *copy;
+    long bytes;
+    int cpu;
+};
+
+static void *replica_first_touch(void *arg)
+{
+    struct replica_job *job = arg;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(job->cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+    job->copy = mmap(NULL, job->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (job->copy == MAP_FAILED)
+    {
+        job->copy = NULL;
+        return NULL;
+    }
+    memcpy(job->copy, job->source, job->bytes);
+    return NULL;
+}
+
+/* copy bytes of source into fresh pages first touched by a thread on
+   cpu, so that the default first-touch policy places them on that cpu's
+   node. Returns NULL when out of memory; free the copy with munmap */
+void *replicate_on_cpu(const void *source, long bytes, int cpu)
+{
+    struct replica_job job = {source, NULL, bytes, cpu};
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, replica_first_touch, &job) != 0)
+    {
+        return NULL;
+    }
+    pthread_join(thread, NULL);
+    return job.copy;
+}
+
+/* the fraction of the pages of data that live on node, or -1 when the
+   kernel cannot tell (move_pages with no target nodes only queries) */
+double pages_on_node(const void *data, long bytes, int node)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)data / page * page;
+    long npages = ((uintptr_t)data + bytes - first + page - 1) / page;
+    void **pages = malloc(npages * sizeof(void *));
+    int *status = malloc(npages * sizeof(int));
+    long i, local = 0, known = 0;
+
+    for (i = 0; i < npages; i++)
+    {
+        pages[i] = (void *)(first + i * page);
+    }
+    if (syscall(SYS_move_pages, 0, npages, pages, NULL, status, 0) == 0)
+    {
+        for (i = 0; i < npages; i++)
+        {
+            known += status[i] >= 0;
+            local += status[i] == node;
+        }
+    }
+    free(pages);
+    free(status);
+    return known > 0 ? (double)local / known : -1.0;
+}
+
+/* the number of threads run_tasks starts for a schedule */
+static int schedule_threads(const struct conv_schedule *schedule)
+{
+    return schedule != NULL ? schedule->nthreads : omp_get_max_threads();
+}
+
+/* one unit of engine work: task of group, run by a team thread */
+typedef void (*conv_task_fn)(void *ctx, int thread, long group, long task);
+
+/* a per-domain queue, alone on its cache line */
+struct task_queue
+{
+    long next;
+    long end;
+} __attribute__((aligned(64)));
+
+/* why a call should stop early: a deadline on the now_seconds clock (0
+   for none) and a cancellation flag another thread may set (or NULL).
+   The first task to see either records the status, and every thread of
+   the team then stops taking tasks */
+struct conv_stop
+{
+    double deadline;
+    const int *cancel;
+    int status;               /* CONV_OK until a task sees a reason to stop */
+};
+
+/* the stop condition of the call the calling thread is running, or NULL */
+static __thread struct conv_stop *current_stop;
+
+static int stop_requested(struct conv_stop *stop)
+{
+    if (__atomic_load_n(&stop->status, __ATOMIC_RELAXED) != CONV_OK)
+    {
+        return 1;
+    }
+    if (stop->cancel != NULL && __atomic_load_n(stop->cancel, __ATOMIC_RELAXED) != 0)
+    {
+        __atomic_store_n(&stop->status, CONV_CANCELLED, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (stop->deadline > 0.0 && now_seconds() > stop->deadline)
+    {
+        __atomic_store_n(&stop->status, CONV_EXPIRED, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+/* run ngroups * group_size tasks on a team. Tasks of one group share
+   data, such as a block of packed kernels, so the tasks are split into
+   one contiguous group-major range per L3 domain, sized by the domain's
+   threads; a domain's threads drain their own range first, then help
+   the other domains. A NULL schedule runs on the default team as one
+   domain. Under a stop condition every thread checks it before each
+   task, so a cancelled or expired call gives its cores back within a
+   task */
+void run_tasks(const struct conv_schedule *schedule, long ngroups, long group_size,
+               conv_task_fn fn, void *ctx)
+{
+    int ndomains = schedule != NULL ? schedule->ndomains : 1;
+    int nthreads = schedule_threads(schedule);
+    long total = ngroups * group_size;
+    struct task_queue queues[ndomains];
+    struct conv_stop *stop = current_stop;
+    int threads_before = 0, d, i;
+
+    for (d = 0; d < ndomains; d++)
+    {
+        int in_domain = 0;
+        for (i = 0; i < nthreads; i++)
+        {
+            in_domain += schedule == NULL || schedule->thread_domain[i] == d;
+        }
+        queues[d].next = total * threads_before / nthreads;
+        threads_before += in_domain;
+        queues[d].end = total * threads_before / nthreads;
+    }
+
+#pragma omp parallel num_threads(nthreads)
+    {
+        int thread = omp_get_thread_num();
+        int home = schedule != NULL ? schedule->thread_domain[thread] : 0;
+        int k;
+
+        for (k = 0; k < ndomains; k++)
+        {
+            struct task_queue *queue = &queues[(home + k) % ndomains];
+            for (;;)
+            {
+                long t;
+                if (stop != NULL && stop_requested(stop))
+                {
+                    k = ndomains;
+                    break;
+                }
+                t = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+                if (t >= queue->end)
+                {
+                    break;
+                }
+                fn(ctx, thread, t / group_size, t % group_size);
+            }
+        }
+    }
+}
+
+/* arguments shared by the tasks of a direct or indirect convolution */
+struct direct_task
+{
+    const double *image;
+    const double **taps;
+    const double *const *kernels; /* one copy per NUMA node */
+    float *output;
+    long out_stride, row_stride; /* output strides between kernels and rows */
+    int width, height, nchannels, nkernels, kernel_order;
+    enum conv_isa isa;
+    const struct conv_schedule *schedule;
+};
+
+/* output row w for kernel group mb of a direct convolution */
+static void direct_task_run(void *ctx, int thread, long mb, long w)
+{
+    const struct direct_task *a = ctx;
+    const double *kernels = node_copy(a->schedule, a->kernels, thread);
+    int padded_height = a->height + a->kernel_order;
+    long channel_stride = (long)(a->width + a->kernel_order) * padded_height;
+    int block_size = a->nchannels * a->kernel_order * a->kernel_order * CONV_MR;
+    int m0 = mb * CONV_MR;
+    int mcount = a->nkernels - m0 < CONV_MR ? a->nkernels - m0 : CONV_MR;
+
+    direct_row_kernels[a->isa](a->image + w * padded_height, kernels + mb * block_size,
+                               a->output + m0 * a->out_stride + w * a->row_stride,
+                               channel_stride, padded_height, a->out_stride,
+                               mcount, a->height, a->nchannels, a->kernel_order);
+}
+
+/* run the direct convolution on an already packed image and kernels.
+   Each kernel group is a task group, its rows the tasks */
+void direct_conv_packed(const double *packed_image, const double *const *packed_kernels,
+                        const struct conv_view *output, int width, int height, int nchannels,
+                        int nkernels, int kernel_order, enum conv_isa isa,
+                        const struct conv_schedule *schedule)
+{
+    struct direct_task a = {packed_image, NULL, packed_kernels,
+                            (float *)output->data + output->offset,
+                            output->strides[0], output->strides[1],
+                            width, height, nchannels, nkernels, kernel_order, isa, schedule};
+
+    run_tasks(schedule, (nkernels + CONV_MR - 1) / CONV_MR, width, direct_task_run, &a);
+}
+
+/* arguments shared by the GEMM tasks of an im2col convolution */
+struct im2col_task
+{
+    const double *columns;
+    const double *const *kernels;
+    float *output;
+    long out_stride; /* between kernels; a kernel's W x H outputs are contiguous */
+    long ncols;
+    int depth, nkernels, col_block;
+    enum conv_isa isa;
+    const struct conv_schedule *schedule;
+};
+
+/* kernel group mb over column block pb of the im2col matrix */
+static void im2col_task_run(void *ctx, int thread, long pb, long mb)
+{
+    const struct im2col_task *a = ctx;
+    long p0 = pb * a->col_block;
+    int pcount = a->ncols - p0 < a->col_block ? (int)(a->ncols - p0) : a->col_block;
+    int m0 = mb * CONV_MR;
+    int mcount = a->nkernels - m0 < CONV_MR ? a->nkernels - m0 : CONV_MR;
+
+    const double *kernels = node_copy(a->schedule, a->kernels, thread);
+
+    direct_row_kernels[a->isa](a->columns + p0, kernels + mb * a->depth * CONV_MR,
+                               a->output + m0 * a->out_stride + p0, a->ncols, 0,
+                               a->out_stride, mcount, pcount, a->depth, 1);
+}
+
+/* GEMM over an im2col matrix: output[m][p] = sum_k kernels[m][k] * columns[k][p].
+   A column block is exactly a direct convolution with a 1x1 kernel and
+   C*K*K channels, so it runs on the same register-blocked kernels. The
+   output view's rows must be contiguous (row stride H, height stride 1) */
+void im2col_conv_packed(const double *packed_image, const double *const *packed_kernels,
+                        double *columns, const struct conv_view *output, int width, int height,
+                        int nchannels, int nkernels, int kernel_order,
+                        int col_block, enum conv_isa isa,
+                        const struct conv_schedule *schedule)
+{
+    int padded_width = width + kernel_order;
+    int padded_height = height + kernel_order;
+    long channel_stride = (long)padded_width * padded_height;
+    long ncols = (long)width * height;
+    int depth = nchannels * kernel_order * kernel_order;
+    struct im2col_task a = {columns, packed_kernels, (float *)output->data + output->offset,
+                            output->strides[0], ncols, depth, nkernels, col_block, isa,
+                            schedule};
+    int k, w;
+
+    /* unfold every (c, x, y) tap into a row of width * height columns */
+#pragma omp parallel for collapse(2) private(k)
+    for (k = 0; k < depth; k++)
+    {
+        for (w = 0; w < width; w++)
+        {
+            int c = k / (kernel_order * kernel_order);
+            int x = k / kernel_order % kernel_order;
+            int y = k % kernel_order;
+            memcpy(columns + k * ncols + (long)w * height,
+                   packed_image + c * channel_stride + (long)(w + x) * padded_height + y,
+                   height * sizeof(double));
+        }
+    }
+
+    /* a column block, which fills half of L2, is shared by more data
+       than a kernel group, so column blocks are the task groups */
+    run_tasks(schedule, (ncols + col_block - 1) / col_block, (nkernels + CONV_MR - 1) / CONV_MR,
+              im2col_task_run, &a);
+}
+
+/* build the indirection buffer of an indirect convolution: for every
+   output row w and tap (c, x, y), a pointer to the packed image row the
+   tap reads from, already offset by y. Output height h of the row then
+   reads taps[k][h], so the GEMM kernel never computes image addresses */
+const double **build_indirection(const double *packed_image, int width, int height,
+                                 int nchannels, int kernel_order)
+{
+    int padded_height = height + kernel_order;
+    long channel_stride = (long)(width + kernel_order) * padded_height;
+    int depth = nchannels * kernel_order * kernel_order;
+    const double **taps = malloc((long)width * depth * sizeof(double *));
+    int w, c, x, y;
+
+    for (w = 0; w < width; w++)
+    {
+        const double **row = taps + (long)w * depth;
+        for (c = 0; c < nchannels; c++)
+        {
+            for (x = 0; x < kernel_order; x++)
+            {
+                for (y = 0; y < kernel_order; y++)
+                {
+                    *row++ = packed_image + c * channel_stride +
+                             (long)(w + x) * padded_height + y;
+                }
+            }
+        }
+    }
+    return taps;
+}
+
+/* indirect GEMM kernels: one output row for up to CONV_MR kernels, with
+   the A operand read through 'depth' tap pointers */
+void indirect_row_scalar(const double **taps, const double *kern, float *out,
+                         long out_stride, int mcount, int height, int depth)
+{
+    int h, i, k;
+
+    for (h = 0; h < height; h++)
+    {
+        double sum[CONV_MR] = {0.0};
+        for (k = 0; k < depth; k++)
+        {
+            double a = taps[k][h];
+            for (i = 0; i < CONV_MR; i++)
+            {
+                sum[i] += a * kern[k * CONV_MR + i];
+            }
+        }
+        for (i = 0; i < mcount; i++)
+        {
+            out[i * out_stride + h] = (float)sum[i];
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512vl"))) void
+indirect_row_avx512(const double **taps, const double *kern, float *out,
+                    long out_stride, int mcount, int height, int depth)
+{
+    int h, i, j, k;
+
+    for (h = 0; h < height; h += CONV_NR * 8)
+    {
+        __m512d acc[CONV_MR][CONV_NR];
+        __mmask8 mask[CONV_NR];
+        const double *b = kern;
+
+        for (j = 0; j < CONV_NR; j++)
+        {
+            int lanes = height - h - j * 8;
+            lanes = lanes < 0 ? 0 : (lanes > 8 ? 8 : lanes);
+            mask[j] = (__mmask8)((1u << lanes) - 1);
+            for (i = 0; i < CONV_MR; i++)
+            {
+                acc[i][j] = _mm512_setzero_pd();
+            }
+        }
+        for (k = 0; k < depth; k++)
+        {
+            const double *a = taps[k] + h;
+            __m512d v[CONV_NR];
+            for (j = 0; j < CONV_NR; j++)
+            {
+                v[j] = _mm512_maskz_loadu_pd(mask[j], a + j * 8);
+            }
+            for (i = 0; i < CONV_MR; i++)
+            {
+                __m512d bi = _mm512_set1_pd(b[i]);
+                for (j = 0; j < CONV_NR; j++)
+                {
+                    acc[i][j] = _mm512_fmadd_pd(bi, v[j], acc[i][j]);
+                }
+            }
+            b += CONV_MR;
+        }
+        for (i = 0; i < mcount; i++)
+        {
+            for (j = 0; j < CONV_NR; j++)
+            {
+                _mm256_mask_storeu_ps(out + i * out_stride + h + j * 8, mask[j],
+                                      _mm512_cvtpd_ps(acc[i][j]));
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) void
+indirect_row_avx2(const double **taps, const double *kern, float *out,
+                  long out_stride, int mcount, int height, int depth)
+{
+    int h, i, j, k;
+
+    for (h = 0; h < height; h += CONV_NR * 4)
+    {
+        __m256d acc[CONV_MR][CONV_NR];
+        __m256i load_mask[CONV_NR];
+        __m128i store_mask[CONV_NR];
+        const double *b = kern;
+
+        for (j = 0; j < CONV_NR; j++)
+        {
+            int lanes = height - h - j * 4;
+            lanes = lanes < 0 ? 0 : (lanes > 4 ? 4 : lanes);
+            load_mask[j] = _mm256_loadu_si256((const __m256i *)(avx2_mask_pd + 8 - lanes));
+            store_mask[j] = _mm_loadu_si128((const __m128i *)(avx2_mask_ps + 8 - lanes));
+            for (i = 0; i < CONV_MR; i++)
+            {
+                acc[i][j] = _mm256_setzero_pd();
+            }
+        }
+        for (k = 0; k < depth; k++)
+        {
+            const double *a = taps[k] + h;
+            __m256d v[CONV_NR];
+            for (j = 0; j < CONV_NR; j++)
+            {
+                v[j] = _mm256_maskload_pd(a + j * 4, load_mask[j]);
+            }
+            for (i = 0; i < CONV_MR; i++)
+            {
+                __m256d bi = _mm256_broadcast_sd(b + i);
+                for (j = 0; j < CONV_NR; j++)
+                {
+                    acc[i][j] = _mm256_fmadd_pd(bi, v[j], acc[i][j]);
+                }
+            }
+            b += CONV_MR;
+        }
+        for (i = 0; i < mcount; i++)
+        {
+            for (j = 0; j < CONV_NR; j++)
+            {
+                _mm_maskstore_ps(out + i * out_stride + h + j * 4, store_mask[j],
+                                 _mm256_cvtpd_ps(acc[i][j]));
+            }
+        }
+    }
+}
+
+typedef void (*indirect_row_fn)(const double **, const double *, float *, long, int,
+                                int, int);
+
+/* the 256-bit AVX-512VL slot reuses the AVX2 kernel, which runs under
+   the same frequency licence */
+static const indirect_row_fn indirect_row_kernels[] = {
+    indirect_row_scalar, indirect_row_avx2, indirect_row_avx2, indirect_row_avx512};
+
+/* output row w for kernel group mb of an indirect convolution */
+static void indirect_task_run(void *ctx, int thread, long mb, long w)
+{
+    const struct direct_task *a = ctx;
+    const double *kernels = node_copy(a->schedule, a->kernels, thread);
+    int depth = a->nchannels * a->kernel_order * a->kernel_order;
+    int m0 = mb * CONV_MR;
+    int mcount = a->nkernels - m0 < CONV_MR ? a->nkernels - m0 : CONV_MR;
+
+    indirect_row_kernels[a->isa](a->taps + w * depth, kernels + mb * depth * CONV_MR,
+                                 a->output + m0 * a->out_stride + w * a->row_stride,
+                                 a->out_stride, mcount, a->height, depth);
+}
+
+/* indirect convolution over a prebuilt indirection buffer */
+void indirect_conv_packed(const double **taps, const double *const *packed_kernels,
+                          const struct conv_view *output, int width, int height,
+                          int nchannels, int nkernels, int kernel_order, enum conv_isa isa,
+                          const struct conv_schedule *schedule)
+{
+    struct direct_task a = {NULL, taps, packed_kernels, (float *)output->data + output->offset,
+                            output->strides[0], output->strides[1],
+                            width, height, nchannels, nkernels, kernel_order, isa, schedule};
+
+    run_tasks(schedule, (nkernels + CONV_MR - 1) / CONV_MR, width, indirect_task_run, &a);
+}
+
+/* arguments shared by the tasks of an implicit GEMM convolution */
+struct implicit_task
+{
+    const struct conv_view *image;
+    const double *const *kernels;
+    float *output;
+    long out_stride, row_stride;
+    double **panels; /* one per thread, allocated on first use */
+    int width, height, nchannels, nkernels, kernel_order, panel_cols, hblocks;
+    enum conv_isa isa;
+    const struct conv_schedule *schedule;
+};
+
+/* pack the panel of row block task and run every kernel group over it */
+static void implicit_task_run(void *ctx, int thread, long group, long task)
+{
+    const struct implicit_task *a = ctx;
+    const float *image = (const float *)a->image->data + a->image->offset;
+    const long *strides = a->image->strides;
+    int kernel_order = a->kernel_order, panel_cols = a->panel_cols;
+    int depth = a->nchannels * kernel_order * kernel_order;
+    int mblocks = (a->nkernels + CONV_MR - 1) / CONV_MR;
+    int w = task / a->hblocks;
+    int h0 = task % a->hblocks * panel_cols;
+    int hcount = a->height - h0 < panel_cols ? a->height - h0 : panel_cols;
+    const double *kernels = node_copy(a->schedule, a->kernels, thread);
+    double *panel = a->panels[thread];
+    int c, x, y, j, mb;
+
+    if (panel == NULL)
+    {
+        panel = a->panels[thread] = aligned_alloc(64, (long)depth * panel_cols * sizeof(double));
+    }
+    for (x = 0; x < kernel_order; x++)
+    {
+        const float *rows = image + (w + x) * strides[0] + h0 * strides[1];
+        for (y = 0; y < kernel_order; y++)
+        {
+            for (c = 0; c < a->nchannels; c++)
+            {
+                const float *src = rows + y * strides[1] + c * strides[2];
+                double *dst = panel + ((c * kernel_order + x) * kernel_order + y) *
+                                          (long)panel_cols;
+                for (j = 0; j < hcount; j++)
+                {
+                    dst[j] = src[j * strides[1]];
+                }
+            }
+        }
+    }
+
+    for (mb = 0; mb < mblocks; mb++)
+    {
+        int m0 = mb * CONV_MR;
+        int mcount = a->nkernels - m0 < CONV_MR ? a->nkernels - m0 : CONV_MR;
+        direct_row_kernels[a->isa](panel, kernels + (long)mb * depth * CONV_MR,
+                                   a->output + m0 * a->out_stride + w * a->row_stride + h0,
+                                   panel_cols, 0, a->out_stride, mcount, hcount, depth, 1);
+    }
+}
+
+/* implicit GEMM: instead of materialising im2col, pack the [C*K*K][hcount]
+   panel of one output row block straight from the image into a small
+   per-thread buffer, then run every kernel group over it while it is hot
+   in L1. Scratch memory is one panel per thread, whatever the image size.
+   Every task reads all the kernels, so they form a single group */
+void implicit_conv(const struct conv_view *image, const double *const *packed_kernels,
+                   const struct conv_view *output, int width, int height, int nchannels,
+                   int nkernels, int kernel_order, int panel_cols, enum conv_isa isa,
+                   const struct conv_schedule *schedule)
+{
+    int nthreads = schedule_threads(schedule);
+    int hblocks = (height + panel_cols - 1) / panel_cols;
+    struct implicit_task a = {image, packed_kernels, (float *)output->data + output->offset,
+                              output->strides[0], output->strides[1],
+                              calloc(nthreads, sizeof(double *)),
+                              width, height, nchannels, nkernels, kernel_order,
+                              panel_cols, hblocks, isa, schedule};
+    int i;
+
+    run_tasks(schedule, 1, (long)width * hblocks, implicit_task_run, &a);
+    for (i = 0; i < nthreads; i++)
+    {
+        free(a.panels[i]);
+    }
+    free(a.panels);
+}
+
+/* Winograd / Toom-Cook F(2x2, KxK), nested from the 1D F(2, K) transform
+   applied along both image dimensions: Y = At [(G g Gt) . (Bt d B)] A */
+#define WINO_M 2
+#define WINO_MAX_N 8
+#define WINO_TILES 16
+
+struct winograd_transform
+{
+    int r, n;                          /* kernel taps, input tile size */
+    double at[WINO_M][WINO_MAX_N];     /* output transform */
+    double g[WINO_MAX_N][WINO_MAX_N];  /* kernel transform, n x r */
+    double bt[WINO_MAX_N][WINO_MAX_N]; /* input transform, n x n */
+};
+
+/* interpolation point sets; the first variant for each kernel order is
+   the default. The 1/f_j normalisation of each point can live in G (the
+   textbook form) or be folded into At, which keeps the kernel and input
+   transforms exact for dyadic points so the only rounding happens in
+   the final output transform */
+struct winograd_variant
+{
+    const char *name;
+    int kernel_order;
+    int scale_in_output;
+    double points[WINO_MAX_N - 1]; /* n - 1 finite points; infinity is implied */
+};
+
+static const struct winograd_variant winograd_variants[] = {
+    {"F(2,3) 0,1,-1", 3, 1, {0, 1, -1}},
+    {"F(2,3) 0,1,-1 scaled G", 3, 0, {0, 1, -1}},
+    {"F(2,5) 0,1,-1,2,-2", 5, 1, {0, 1, -1, 2, -2}},
+    {"F(2,5) 0,1,-1,1/2,-1/2", 5, 1, {0, 1, -1, 0.5, -0.5}},
+    {"F(2,5) 0,1,-1,2,-2 scaled G", 5, 0, {0, 1, -1, 2, -2}},
+    {"F(2,7) 0,1,-1,2,-2,1/2,-1/2", 7, 1, {0, 1, -1, 2, -2, 0.5, -0.5}},
+    {"F(2,7) 0,1,-1,2,-2,3,-3", 7, 1, {0, 1, -1, 2, -2, 3, -3}},
+    {"F(2,7) 0,1,-1,2,-2,1/2,-1/2 scaled G", 7, 0, {0, 1, -1, 2, -2, 0.5, -0.5}},
+};
+
+#define WINO_VARIANTS (int)(sizeof(winograd_variants) / sizeof(winograd_variants[0]))
+
+/* index of the default variant for a kernel order, or -1 if none */
+int winograd_default_variant(int kernel_order)
+{
+    int v;
+
+    for (v = 0; v < WINO_VARIANTS; v++)
+    {
+        if (winograd_variants[v].kernel_order == kernel_order)
+        {
+            return v;
+        }
+    }
+    return -1;
+}
+
+/* solve the n x n system a x = b in place by Gaussian elimination */
+static void solve_linear(double a[WINO_MAX_N][WINO_MAX_N], double *b, int n)
+{
+    int i, j, k;
+
+    for (k = 0; k < n; k++)
+    {
+        int pivot = k;
+        for (i = k + 1; i < n; i++)
+        {
+            if (fabs(a[i][k]) > fabs(a[pivot][k]))
+            {
+                pivot = i;
+            }
+        }
+        for (j = 0; j < n; j++)
+        {
+            double t = a[k][j];
+            a[k][j] = a[pivot][j];
+            a[pivot][j] = t;
+        }
+        double t = b[k];
+        b[k] = b[pivot];
+        b[pivot] = t;
+        for (i = 0; i < n; i++)
+        {
+            if (i != k)
+            {
+                double factor = a[i][k] / a[k][k];
+                for (j = k; j < n; j++)
+                {
+                    a[i][j] -= factor * a[k][j];
+                }
+                b[i] -= factor * b[k];
+            }
+        }
+    }
+    for (k = 0; k < n; k++)
+    {
+        b[k] /= a[k][k];
+    }
+}
+
+/* build the Toom-Cook F(2, r) matrices for a set of interpolation points.
+   At and G follow from the points directly; Bt is the unique matrix that
+   makes At[(G g) . (Bt d)] equal the correlation of d with g, found by
+   least squares over every (output, tap) equation and snapped to the
+   dyadic grid its exact entries lie on */
+void winograd_build(struct winograd_transform *t, const struct winograd_variant *variant)
+{
+    const double *p = variant->points;
+    int r = variant->kernel_order, n = r + WINO_M - 1;
+    double f[WINO_MAX_N], e[WINO_M * WINO_MAX_N][WINO_MAX_N];
+    int i, j, k, l, q;
+
+    memset(t, 0, sizeof(*t));
+    t->r = r;
+    t->n = n;
+    for (j = 0; j < n - 1; j++)
+    {
+        f[j] = 1.0;
+        for (l = 0; l < n - 1; l++)
+        {
+            if (l != j)
+            {
+                f[j] *= p[j] - p[l];
+            }
+        }
+    }
+    f[n - 1] = 1.0;
+
+    for (i = 0; i < WINO_M; i++)
+    {
+        for (j = 0; j < n - 1; j++)
+        {
+            t->at[i][j] = pow(p[j], i) / (variant->scale_in_output ? f[j] : 1.0);
+        }
+        t->at[i][n - 1] = i == WINO_M - 1;
+    }
+    for (j = 0; j < n - 1; j++)
+    {
+        for (k = 0; k < r; k++)
+        {
+            t->g[j][k] = pow(p[j], k) / (variant->scale_in_output ? 1.0 : f[j]);
+        }
+    }
+    t->g[n - 1][r - 1] = 1.0;
+
+    /* e[(i, k)][j] = At[i][j] G[j][k]; column s of Bt solves e b = [i + k == s] */
+    for (i = 0; i < WINO_M; i++)
+    {
+        for (k = 0; k < r; k++)
+        {
+            for (j = 0; j < n; j++)
+            {
+                e[i * r + k][j] = t->at[i][j] * t->g[j][k];
+            }
+        }
+    }
+    for (int s = 0; s < n; s++)
+    {
+        double normal[WINO_MAX_N][WINO_MAX_N], rhs[WINO_MAX_N];
+        for (j = 0; j < n; j++)
+        {
+            rhs[j] = 0.0;
+            for (l = 0; l < n; l++)
+            {
+                normal[j][l] = 0.0;
+                for (q = 0; q < WINO_M * r; q++)
+                {
+                    normal[j][l] += e[q][j] * e[q][l];
+                }
+            }
+            for (i = 0; i < WINO_M; i++)
+            {
+                k = s - i;
+                if (k >= 0 && k < r)
+                {
+                    rhs[j] += e[i * r + k][j];
+                }
+            }
+        }
+        solve_linear(normal, rhs, n);
+        for (j = 0; j < n; j++)
+        {
+            t->bt[j][s] = ldexp(nearbyint(ldexp(rhs[j], 24)), -24);
+        }
+    }
+}
+
+/* transform every kernel, read back from its packed [M/MR][C][K][K][MR]
+   layout, into u[pos][M/MR][C][MR] = (G g Gt)[pos], zero-filling the
+   missing kernels of the last group like pack_kernels does */
+double *winograd_transform_kernels(const struct winograd_transform *t,
+                                   const double *packed_kernels, int nchannels,
+                                   int nkernels)
+{
+    int n = t->n, r = t->r;
+    int mblocks = (nkernels + CONV_MR - 1) / CONV_MR;
+    long block_size = (long)nchannels * r * r * CONV_MR;
+    long pos_stride = (long)mblocks * nchannels * CONV_MR;
+    double *u = calloc(n * n * pos_stride, sizeof(double));
+    int m, c, i, j, k;
+
+    for (m = 0; m < nkernels; m++)
+    {
+        for (c = 0; c < nchannels; c++)
+        {
+            const double *g = packed_kernels + m / CONV_MR * block_size +
+                              (long)c * r * r * CONV_MR + m % CONV_MR;
+            double gg[WINO_MAX_N][WINO_MAX_N];
+            for (i = 0; i < n; i++)
+            {
+                for (k = 0; k < r; k++)
+                {
+                    gg[i][k] = 0.0;
+                    for (j = 0; j < r; j++)
+                    {
+                        gg[i][k] += t->g[i][j] * g[(j * r + k) * CONV_MR];
+                    }
+                }
+            }
+            for (i = 0; i < n; i++)
+            {
+                for (j = 0; j < n; j++)
+                {
+                    double sum = 0.0;
+                    for (k = 0; k < r; k++)
+                    {
+                        sum += gg[i][k] * t->g[j][k];
+                    }
+                    u[(i * n + j) * pos_stride +
+                      ((long)(m / CONV_MR) * nchannels + c) * CONV_MR + m % CONV_MR] = sum;
+                }
+            }
+        }
+    }
+    return u;
+}
+
+/* channel reduction of the elementwise products for CONV_MR kernels and
+   WINO_TILES tiles at one tile position:
+   prod[m][tile] = sum_c u[c][m] * v[c][tile] */
+void winograd_gemm_scalar(const double *u, const double *v, double *prod,
+                          long prod_stride, int nchannels)
+{
+    double acc[CONV_MR][WINO_TILES] = {{0.0}};
+    int c, m, tile;
+
+    for (c = 0; c < nchannels; c++)
+    {
+        for (m = 0; m < CONV_MR; m++)
+        {
+            for (tile = 0; tile < WINO_TILES; tile++)
+            {
+                acc[m][tile] += u[c * CONV_MR + m] * v[c * WINO_TILES + tile];
+            }
+        }
+    }
+    for (m = 0; m < CONV_MR; m++)
+    {
+        memcpy(prod + m * prod_stride, acc[m], sizeof(acc[m]));
+    }
+}
+
+__attribute__((target("avx2,fma"))) void
+winograd_gemm_avx2(const double *u, const double *v, double *prod,
+                   long prod_stride, int nchannels)
+{
+    int c, m, j, half;
+
+    /* two passes of eight tiles keep the accumulators in registers */
+    for (half = 0; half < WINO_TILES; half += 8)
+    {
+        __m256d acc[CONV_MR][2];
+        for (m = 0; m < CONV_MR; m++)
+        {
+            acc[m][0] = acc[m][1] = _mm256_setzero_pd();
+        }
+        for (c = 0; c < nchannels; c++)
+        {
+            __m256d v0 = _mm256_loadu_pd(v + c * WINO_TILES + half);
+            __m256d v1 = _mm256_loadu_pd(v + c * WINO_TILES + half + 4);
+            for (m = 0; m < CONV_MR; m++)
+            {
+                __m256d weight = _mm256_broadcast_sd(u + c * CONV_MR + m);
+                acc[m][0] = _mm256_fmadd_pd(weight, v0, acc[m][0]);
+                acc[m][1] = _mm256_fmadd_pd(weight, v1, acc[m][1]);
+            }
+        }
+        for (m = 0; m < CONV_MR; m++)
+        {
+            for (j = 0; j < 2; j++)
+            {
+                _mm256_storeu_pd(prod + m * prod_stride + half + j * 4, acc[m][j]);
+            }
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) void
+winograd_gemm_avx512(const double *u, const double *v, double *prod,
+                     long prod_stride, int nchannels)
+{
+    __m512d acc[CONV_MR][2];
+    int c, m;
+
+    for (m = 0; m < CONV_MR; m++)
+    {
+        acc[m][0] = acc[m][1] = _mm512_setzero_pd();
+    }
+    for (c = 0; c < nchannels; c++)
+    {
+        __m512d v0 = _mm512_loadu_pd(v + c * WINO_TILES);
+        __m512d v1 = _mm512_loadu_pd(v + c * WINO_TILES + 8);
+        for (m = 0; m < CONV_MR; m++)
+        {
+            __m512d weight = _mm512_set1_pd(u[c * CONV_MR + m]);
+            acc[m][0] = _mm512_fmadd_pd(weight, v0, acc[m][0]);
+            acc[m][1] = _mm512_fmadd_pd(weight, v1, acc[m][1]);
+        }
+    }
+    for (m = 0; m < CONV_MR; m++)
+    {
+        _mm512_storeu_pd(prod + m * prod_stride, acc[m][0]);
+        _mm512_storeu_pd(prod + m * prod_stride + 8, acc[m][1]);
+    }
+}
+
+typedef void (*winograd_gemm_fn)(const double *, const double *, double *, long, int);
+
+static const winograd_gemm_fn winograd_gemm_kernels[] = {
+    winograd_gemm_scalar, winograd_gemm_avx2, winograd_gemm_avx2, winograd_gemm_avx512};
+
+/* one tile row (output rows w0, w0 + 1) for up to WINO_TILES tiles along
+   the height starting at output height h0. Both transforms are applied
+   as nested 1D transforms with the tile index innermost, so they
+   vectorise; v and prod are scratch of n*n*C*WINO_TILES and
+   CONV_MR*n*n*WINO_TILES doubles */
+__attribute__((target_clones("avx512f", "avx2", "default"))) static void
+winograd_tile_row(const struct winograd_transform *t, const double *packed_image,
+                  const double *u, const struct conv_view *output, double *v, double *prod,
+                  int w0, int h0, int ntiles, int width, int height,
+                  int nchannels, int nkernels, int kernel_order, enum conv_isa isa)
+{
+    winograd_gemm_fn gemm = winograd_gemm_kernels[isa];
+    int n = t->n;
+    int padded_height = height + kernel_order;
+    long channel_stride = (long)(width + kernel_order) * padded_height;
+    const long *out_strides = output->strides;
+    long pos_stride = (long)(nkernels + CONV_MR - 1) / CONV_MR * nchannels * CONV_MR;
+    int len = WINO_M * ntiles + n - WINO_M;
+    int c, m, m0, tile, i, j, k, l, pos;
+
+    /* input transform: v[pos][c][tile] = (Bt d B)[pos] */
+    for (c = 0; c < nchannels; c++)
+    {
+        double rows[WINO_MAX_N][WINO_MAX_N][WINO_TILES];
+
+        /* along the height: split each row into even and odd heights, so
+           the stride-2 tile starts become contiguous loads */
+        for (k = 0; k < n; k++)
+        {
+            const double *row = packed_image + c * channel_stride +
+                                (long)(w0 + k) * padded_height + h0;
+            double phase[2][WINO_TILES + WINO_MAX_N / 2] = {{0.0}};
+            for (i = 0; i < len; i++)
+            {
+                phase[i & 1][i >> 1] = row[i];
+            }
+            for (j = 0; j < n; j++)
+            {
+                for (tile = 0; tile < WINO_TILES; tile++)
+                {
+                    rows[k][j][tile] = 0.0;
+                }
+                for (l = 0; l < n; l++)
+                {
+                    double b = t->bt[j][l];
+                    const double *src = phase[l & 1] + (l >> 1);
+                    for (tile = 0; tile < WINO_TILES; tile++)
+                    {
+                        rows[k][j][tile] += b * src[tile];
+                    }
+                }
+            }
+        }
+
+        /* along the width */
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; j < n; j++)
+            {
+                double *dst = v + ((long)(i * n + j) * nchannels + c) * WINO_TILES;
+                for (tile = 0; tile < WINO_TILES; tile++)
+                {
+                    dst[tile] = 0.0;
+                }
+                for (k = 0; k < n; k++)
+                {
+                    double b = t->bt[i][k];
+                    for (tile = 0; tile < WINO_TILES; tile++)
+                    {
+                        dst[tile] += b * rows[k][j][tile];
+                    }
+                }
+            }
+        }
+    }
+
+    for (m0 = 0; m0 < nkernels; m0 += CONV_MR)
+    {
+        int mcount = nkernels - m0 < CONV_MR ? nkernels - m0 : CONV_MR;
+
+        for (pos = 0; pos < n * n; pos++)
+        {
+            gemm(u + pos * pos_stride + (long)m0 * nchannels,
+                 v + (long)pos * nchannels * WINO_TILES, prod + pos * WINO_TILES,
+                 (long)n * n * WINO_TILES, nchannels);
+        }
+
+        /* output transform: Y = At prod A, again one dimension at a time */
+        for (m = 0; m < mcount; m++)
+        {
+            const double *pm = prod + m * n * n * WINO_TILES;
+            float *out = (float *)output->data + output->offset + (m0 + m) * out_strides[0];
+            double cols[WINO_M][WINO_MAX_N][WINO_TILES];
+            double y[WINO_M][WINO_M][WINO_TILES];
+
+            for (i = 0; i < WINO_M; i++)
+            {
+                for (j = 0; j < n; j++)
+                {
+                    for (tile = 0; tile < WINO_TILES; tile++)
+                    {
+                        cols[i][j][tile] = 0.0;
+                    }
+                    for (k = 0; k < n; k++)
+                    {
+                        double a = t->at[i][k];
+                        for (tile = 0; tile < WINO_TILES; tile++)
+                        {
+                            cols[i][j][tile] += a * pm[(k * n + j) * WINO_TILES + tile];
+                        }
+                    }
+                }
+                for (j = 0; j < WINO_M; j++)
+                {
+                    for (tile = 0; tile < WINO_TILES; tile++)
+                    {
+                        y[i][j][tile] = 0.0;
+                    }
+                    for (k = 0; k < n; k++)
+                    {
+                        double a = t->at[j][k];
+                        for (tile = 0; tile < WINO_TILES; tile++)
+                        {
+                            y[i][j][tile] += a * cols[i][k][tile];
+                        }
+                    }
+                }
+            }
+
+            for (i = 0; i < WINO_M && w0 + i < width; i++)
+            {
+                float *out_row = out + (w0 + i) * out_strides[1] + h0 * out_strides[2];
+                for (tile = 0; tile < ntiles; tile++)
+                {
+                    for (j = 0; j < WINO_M && h0 + tile * WINO_M + j < height; j++)
+                    {
+                        out_row[(tile * WINO_M + j) * out_strides[2]] = (float)y[i][j][tile];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* arguments shared by the tasks of a Winograd convolution */
+struct winograd_task
+{
+    const struct winograd_transform *t;
+    const double *image;
+    const double *const *u;
+    const struct conv_view *output;
+    double **v, **prod; /* per-thread tile buffers, allocated on first use */
+    int width, height, nchannels, nkernels, kernel_order, tiles;
+    enum conv_isa isa;
+    const struct conv_schedule *schedule;
+};
+
+/* one chunk of WINO_TILES tiles along tile row r */
+static void winograd_task_run(void *ctx, int thread, long r, long chunk)
+{
+    const struct winograd_task *a = ctx;
+    int n = a->t->n;
+    int first = chunk * WINO_TILES;
+    int ntiles = a->tiles - first < WINO_TILES ? a->tiles - first : WINO_TILES;
+
+    if (a->v[thread] == NULL)
+    {
+        a->v[thread] = malloc((long)n * n * a->nchannels * WINO_TILES * sizeof(double));
+        a->prod[thread] = malloc((long)CONV_MR * n * n * WINO_TILES * sizeof(double));
+    }
+    winograd_tile_row(a->t, a->image, node_copy(a->schedule, a->u, thread), a->output,
+                      a->v[thread], a->prod[thread], r * WINO_M, first * WINO_M, ntiles,
+                      a->width, a->height, a->nchannels, a->nkernels, a->kernel_order, a->isa);
+}
+
+/* Winograd convolution on a packed image with transformed kernels.
+   The input tile of the last, partial output tile still lies inside
+   the (W+K) x (H+K) image, so edges need no extra padding. Chunks of
+   one tile row share input rows, so tile rows are the task groups.
+   Outputs are written one by one, so the output view may have any strides */
+void winograd_conv_packed(const struct winograd_transform *t, const double *packed_image,
+                          const double *const *u, const struct conv_view *output,
+                          int width, int height,
+                          int nchannels, int nkernels, int kernel_order,
+                          enum conv_isa isa, const struct conv_schedule *schedule)
+{
+    int nthreads = schedule_threads(schedule);
+    int tiles = (height + WINO_M - 1) / WINO_M;
+    struct winograd_task a = {t, packed_image, u, output,
+                              calloc(nthreads, sizeof(double *)),
+                              calloc(nthreads, sizeof(double *)),
+                              width, height, nchannels, nkernels, kernel_order, tiles, isa,
+                              schedule};
+    int i;
+
+    run_tasks(schedule, (width + WINO_M - 1) / WINO_M, (tiles + WINO_TILES - 1) / WINO_TILES,
+              winograd_task_run, &a);
+    for (i = 0; i < nthreads; i++)
+    {
+        free(a.v[i]);
+        free(a.prod[i]);
+    }
+    free(a.v);
+    free(a.prod);
+}
+
+/* convolution algorithms known to the cost model */
+enum conv_engine
+{
+    ENGINE_DIRECT,
+    ENGINE_IM2COL,
+    ENGINE_INDIRECT,
+    ENGINE_IMPLICIT,
+    ENGINE_WINOGRAD,
+    ENGINE_FFT,
+    ENGINE_COUNT
+};
+
+static const char *engine_names[] = {"direct",   "im2col",   "indirect",
+                                     "implicit", "winograd", "fft"};
+
+/* engines that have an implementation in this file; the others are only
+   predicted, so that the model can tell when they would be worth adding */
+static const int engine_implemented[] = {1, 1, 1, 1, 1, 0};
+
+/* whether an engine can run a kernel order */
+int engine_available(enum conv_engine engine, int kernel_order)
+{
+    if (engine == ENGINE_WINOGRAD)
+    {
+        return winograd_default_variant(kernel_order) >= 0;
+    }
+    return engine_implemented[engine];
+}
+
+/* fraction of peak FMA throughput each engine's inner loops reach;
+   calibrate these against the 'model' harness mode */
+static double engine_efficiency[] = {0.40, 0.30, 0.40, 0.35, 0.30, 0.25};
+
+/* measured machine parameters the cost model is built from */
+struct machine_params
+{
+    enum conv_isa isa;
+    int nthreads;
+    double fma_per_second; /* double precision lane-FMAs, all threads */
+    double bandwidth;      /* bytes per second read from memory, all threads */
+    long l1_bytes;
+    long l2_bytes;
+    long l3_bytes;
+};
+
+/* independent FMA chains, enough to cover the FMA latency */
+#define FMA_CHAINS 12
+
+__attribute__((target("avx512f"))) static double fma_loop_avx512(long iterations)
+{
+    __m512d acc[FMA_CHAINS], k = _mm512_set1_pd(0.999999), b = _mm512_set1_pd(1e-9);
+    double sum = 0.0;
+    long n;
+    int j;
+
+    for (j = 0; j < FMA_CHAINS; j++)
+    {
+        acc[j] = _mm512_set1_pd(j);
+    }
+    for (n = 0; n < iterations; n++)
+    {
+        for (j = 0; j < FMA_CHAINS; j++)
+        {
+            acc[j] = _mm512_fmadd_pd(acc[j], k, b);
+        }
+    }
+    for (j = 0; j < FMA_CHAINS; j++)
+    {
+        sum += _mm512_reduce_add_pd(acc[j]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static double fma_loop_avx2(long iterations)
+{
+    __m256d acc[FMA_CHAINS], k = _mm256_set1_pd(0.999999), b = _mm256_set1_pd(1e-9);
+    double lanes[4], sum = 0.0;
+    long n;
+    int j;
+
+    for (j = 0; j < FMA_CHAINS; j++)
+    {
+        acc[j] = _mm256_set1_pd(j);
+    }
+    for (n = 0; n < iterations; n++)
+    {
+        for (j = 0; j < FMA_CHAINS; j++)
+        {
+            acc[j] = _mm256_fmadd_pd(acc[j], k, b);
+        }
+    }
+    for (j = 0; j < FMA_CHAINS; j++)
+    {
+        _mm256_storeu_pd(lanes, acc[j]);
+        sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return sum;
+}
+
+static double fma_loop_scalar(long iterations)
+{
+    double acc[FMA_CHAINS], sum = 0.0;
+    long n;
+    int j;
+
+    for (j = 0; j < FMA_CHAINS; j++)
+    {
+        acc[j] = j;
+    }
+    for (n = 0; n < iterations; n++)
+    {
+        for (j = 0; j < FMA_CHAINS; j++)
+        {
+            acc[j] = acc[j] * 0.999999 + 1e-9;
+        }
+    }
+    for (j = 0; j < FMA_CHAINS; j++)
+    {
+        sum += acc[j];
+    }
+    return sum;
+}
+
+/* vector lanes of a double precision register */
+static const int isa_lanes[] = {1, 4, 4, 8};
+
+/* monotonic wall clock in seconds */
+double now_seconds(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* open a hardware event counter for the calling thread, user space only;
+   returns -1 where perf events are unavailable (containers, paranoid) */
+int perf_counter_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* current value of a counter opened by perf_counter_open */
+long long perf_counter_read(int fd)
+{
+    long long value = 0;
+
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+    {
+        return 0;
+    }
+    return value;
+}
+
+/* read a cache size from sysconf, falling back to a typical value */
+static long cache_size(int name, long fallback)
+{
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+/* estimate the current core frequency from a chain of dependent
+   register-to-register adds, which retire at one per cycle whatever the
+   clock is (immediate adds can be folded at rename on newer cores) */
+double probe_frequency(void)
+{
+    const long rounds = 20000;
+    long x = 0, one = 1, n;
+    double start = now_seconds();
+
+    for (n = 0; n < rounds; n++)
+    {
+        __asm__ volatile("add %1, %0\n\tadd %1, %0\n\tadd %1, %0\n\tadd %1, %0\n\t"
+                         "add %1, %0\n\tadd %1, %0\n\tadd %1, %0\n\tadd %1, %0\n\t"
+                         "add %1, %0\n\tadd %1, %0"
+                         : "+r"(x)
+                         : "r"(one));
+    }
+    return rounds * 10 / (now_seconds() - start);
+}
+
+/* sustained throughput and clock of one instruction set */
+struct isa_calibration
+{
+    enum conv_isa isa;
+    double macs_per_second;
+    double probe_hz;  /* from dependent adds right after heavy work */
+    double cycles_hz; /* from the core cycle counter, 0 if unavailable */
+};
+
+/* run the direct engine with each vector instruction set for a short
+   while on every core, interleaving frequency probes on the calling
+   thread, whose core holds whatever licence the kernels took. Fills
+   one entry per vector ISA up to 'widest' and returns the count */
+int calibrate_isas(enum conv_isa widest, double seconds, struct isa_calibration *results)
+{
+    const int width = 64, height = 61, nchannels = 16, nkernels = 16, kernel_order = 3;
+    long padded = (long)(width + kernel_order) * (height + kernel_order);
+    double macs = (double)width * height * nchannels * nkernels * kernel_order * kernel_order;
+    double *image = malloc(padded * nchannels * sizeof(double));
+    int mblocks = (nkernels + CONV_MR - 1) / CONV_MR;
+    long kernel_size = (long)mblocks * nchannels * kernel_order * kernel_order * CONV_MR;
+    double *kernels = malloc(kernel_size * sizeof(double));
+    const double *kernel_copies[1] = {kernels};
+    float *output = malloc((long)nkernels * width * height * sizeof(float));
+    struct conv_view output_view = {output, 0, {(long)width * height, height, 1, 0}};
+    int cycle_fd = perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    int isa, count = 0;
+    long i;
+
+    for (i = 0; i < padded * nchannels; i++)
+    {
+        image[i] = i % 4096;
+    }
+    for (i = 0; i < kernel_size; i++)
+    {
+        kernels[i] = i % 1024;
+    }
+    for (isa = ISA_AVX2; isa <= (int)widest; isa++)
+    {
+        double start = now_seconds(), busy = 0.0, probe = 0.0;
+        long long cycles = perf_counter_read(cycle_fd);
+        long calls = 0, probes = 0;
+
+        while (now_seconds() - start < seconds)
+        {
+            double t = now_seconds();
+            direct_conv_packed(image, kernel_copies, &output_view, width, height, nchannels,
+                               nkernels, kernel_order, isa, NULL);
+            busy += now_seconds() - t;
+            calls++;
+            if (calls % 4 == 0)
+            {
+                probe += probe_frequency();
+                probes++;
+            }
+        }
+        results[count].isa = isa;
+        results[count].macs_per_second = calls * macs / busy;
+        results[count].probe_hz = probes > 0 ? probe / probes : probe_frequency();
+        results[count].cycles_hz = cycle_fd >= 0 ? (perf_counter_read(cycle_fd) - cycles) /
+                                                       (now_seconds() - start)
+                                                 : 0.0;
+        count++;
+    }
+    if (cycle_fd >= 0)
+    {
+        close(cycle_fd);
+    }
+    free(image);
+    free(kernels);
+    free(output);
+    return count;
+}
+
+/* the instruction set the plans use: CONV_ISA if set, otherwise on cpus
+   with AVX-512 whichever of 512-bit, 256-bit AVX-512VL and AVX2 sustains
+   the best throughput in a short calibration, chosen once per process */
+enum conv_isa select_isa(void)
+{
+    static enum conv_isa selected;
+    static int calibrated = 0;
+
+#pragma omp critical(conv_select_isa)
+    if (!calibrated)
+    {
+        selected = detect_isa();
+        if (getenv("CONV_ISA") == NULL && selected == ISA_AVX512)
+        {
+            struct isa_calibration results[ISA_AVX512];
+            int count = calibrate_isas(selected, 0.03, results), i;
+            for (i = 0; i < count; i++)
+            {
+                if (results[i].macs_per_second > results[selected - ISA_AVX2].macs_per_second)
+                {
+                    selected = results[i].isa;
+                }
+            }
+        }
+        calibrated = 1;
+    }
+    return selected;
+}
+
+/* measure FMA throughput and memory bandwidth of this machine */
+void measure_machine_params(struct machine_params *params, enum conv_isa isa)
+{
+    const long iterations = 1 << 22;
+    const long nbytes = 64L << 20;
+    long n = nbytes / sizeof(double), i;
+    double *buffer = malloc(nbytes);
+    double start, elapsed, best = 1e30, sink = 0.0;
+    int r;
+
+    params->isa = isa;
+    params->nthreads = omp_get_max_threads();
+    params->l1_bytes = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32L << 10);
+    params->l2_bytes = cache_size(_SC_LEVEL2_CACHE_SIZE, 1L << 20);
+    params->l3_bytes = cache_size(_SC_LEVEL3_CACHE_SIZE, 8L << 20);
+
+    start = now_seconds();
+#pragma omp parallel reduction(+ : sink)
+    {
+        if (isa == ISA_AVX512)
+        {
+            sink += fma_loop_avx512(iterations);
+        }
+        else if (isa == ISA_AVX2 || isa == ISA_AVX512VL)
+        {
+            sink += fma_loop_avx2(iterations);
+        }
+        else
+        {
+            sink += fma_loop_scalar(iterations);
+        }
+    }
+    elapsed = now_seconds() - start;
+    params->fma_per_second = (double)iterations * FMA_CHAINS * isa_lanes[isa] *
+                             params->nthreads / elapsed;
+
+#pragma omp parallel for
+    for (i = 0; i < n; i++)
+    {
+        buffer[i] = i;
+    }
+    for (r = 0; r < 3; r++)
+    {
+        double sum = 0.0;
+        start = now_seconds();
+#pragma omp parallel for reduction(+ : sum)
+        for (i = 0; i < n; i++)
+        {
+            sum += buffer[i];
+        }
+        elapsed = now_seconds() - start;
+        best = elapsed < best ? elapsed : best;
+        sink += sum;
+    }
+    params->bandwidth = nbytes / best;
+    free(buffer);
+
+    /* keep the compiler from discarding the timed loops */
+    if (sink == 0.125)
+    {
+        printf("%f\n", sink);
+    }
+}
+
+/* machine parameters, measured once per process */
+const struct machine_params *conv_machine_params(void)
+{
+    static struct machine_params params;
+    static int measured = 0;
+
+#pragma omp critical(conv_machine_params)
+    if (!measured)
+    {
+        measure_machine_params(&params, select_isa());
+        measured = 1;
+    }
+    return &params;
+}
+
+/* predicted running time in seconds of one engine on one shape */
+double predict_conv_time(enum conv_engine engine, const struct machine_params *params,
+                         int width, int height, int nchannels, int nkernels,
+                         int kernel_order)
+{
+    double lanes = isa_lanes[params->isa];
+    double taps = (double)kernel_order * kernel_order;
+    double padded = (double)(width + kernel_order) * (height + kernel_order);
+    double packed_bytes = 8.0 * padded * nchannels;
+    double output_bytes = 4.0 * width * height * nkernels;
+    double mblocks = (nkernels + CONV_MR - 1) / CONV_MR;
+    double m_efficiency = nkernels / (mblocks * CONV_MR);
+    double peak = params->fma_per_second * engine_efficiency[engine];
+    /* packing reads the float image and writes the planar double copy */
+    double bytes = 4.0 * padded * nchannels + packed_bytes + output_bytes;
+    double fmas, compute;
+
+    switch (engine)
+    {
+    case ENGINE_DIRECT:
+    {
+        double block = CONV_NR * lanes;
+        double h_efficiency = height / (ceil(height / block) * block);
+        fmas = (double)width * height * nchannels * nkernels * taps;
+        compute = fmas / (peak * h_efficiency * m_efficiency);
+        /* every kernel group streams the whole image unless it stays in L3 */
+        bytes += packed_bytes * (packed_bytes > params->l3_bytes ? mblocks : 1);
+        break;
+    }
+    case ENGINE_IM2COL:
+    {
+        double column_bytes = 8.0 * nchannels * taps * width * height;
+        fmas = (double)width * height * nchannels * nkernels * taps;
+        compute = fmas / (peak * m_efficiency);
+        /* written once while unfolding, read once by the GEMM */
+        bytes += 2 * column_bytes;
+        break;
+    }
+    case ENGINE_INDIRECT:
+    {
+        /* the direct kernel's work, plus one tap pointer per row and tap */
+        double block = CONV_NR * lanes;
+        double h_efficiency = height / (ceil(height / block) * block);
+        fmas = (double)width * height * nchannels * nkernels * taps;
+        compute = fmas / (peak * h_efficiency * m_efficiency);
+        bytes += packed_bytes * (packed_bytes > params->l3_bytes ? mblocks : 1) +
+                 8.0 * width * nchannels * taps * mblocks;
+        break;
+    }
+    case ENGINE_IMPLICIT:
+    {
+        /* no packed image: K overlapping float rows per panel, mostly from cache */
+        fmas = (double)width * height * nchannels * nkernels * taps;
+        compute = fmas / (peak * m_efficiency);
+        bytes = 4.0 * padded * nchannels + output_bytes;
+        break;
+    }
+    case ENGINE_WINOGRAD:
+    {
+        /* F(2x2, KxK): each 2x2 output tile costs (K+1)^2 products */
+        double n = kernel_order + 1;
+        double tiles = ceil(width / 2.0) * ceil(height / 2.0);
+        double transforms = tiles * (nchannels + nkernels) * 2 * n * n * n / 2;
+        fmas = tiles * n * n * nchannels * nkernels + transforms;
+        compute = fmas / peak;
+        bytes += 8.0 * tiles * n * n * (nchannels + nkernels) * 2;
+        break;
+    }
+    case ENGINE_FFT:
+    default:
+    {
+        /* real-to-complex transforms over power-of-two padded planes */
+        double fw = pow(2, ceil(log2(width + kernel_order)));
+        double fh = pow(2, ceil(log2(height + kernel_order)));
+        double points = fw * fh;
+        double transform = 5.0 * points * log2(points) / 4;
+        fmas = (nchannels + nkernels) * transform + 2.0 * nchannels * nkernels * points;
+        compute = fmas / peak;
+        bytes += 8.0 * points * (nchannels + nkernels) * 2;
+        break;
+    }
+    }
+
+    return (compute > bytes / params->bandwidth ? compute : bytes / params->bandwidth);
+}
+
+/* content hash of tensors, the key of the output cache. An xxh3-style
+   accumulator: each of four 64-bit lanes adds the 32x32-bit product of
+   the halves of its data word xor a key word, plus the data word of the
+   neighbouring lane, and the lanes are scrambled every block of 16
+   stripes of 32 bytes. The AVX2 and scalar versions give the same
+   digest, so keys do not depend on the ISA */
+#define HASH_STRIPE 32
+#define HASH_BLOCK_STRIPES 16
+#define HASH_PRIME32 0x9E3779B1ULL
+
+struct content_hash
+{
+    uint64_t acc[4];
+    unsigned char buffer[HASH_STRIPE];
+    int buffered;
+    int stripe;               /* stripes accumulated in the current block */
+    uint64_t length;
+    enum conv_isa isa;
+};
+
+/* key words per stripe of a block, then the scramble and digest keys */
+static uint64_t hash_keys[HASH_BLOCK_STRIPES + 2][4];
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void hash_init(struct content_hash *state, enum conv_isa isa)
+{
+    static int keyed = 0;
+
+#pragma omp critical(conv_hash_keys)
+    if (!keyed)
+    {
+        uint64_t seed = 0x636F6E76ULL;
+        int s, i;
+        for (s = 0; s < HASH_BLOCK_STRIPES + 2; s++)
+        {
+            for (i = 0; i < 4; i++)
+            {
+                hash_keys[s][i] = splitmix64(&seed);
+            }
+        }
+        keyed = 1;
+    }
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = HASH_PRIME32;
+    state->acc[1] = 0xC2B2AE3D27D4EB4FULL;
+    state->acc[2] = 0x165667B19E3779F9ULL;
+    state->acc[3] = 0x85EBCA77C2B2AE63ULL;
+    state->isa = isa;
+}
+
+/* accumulate nstripes whole stripes */
+static void hash_stripes_scalar(struct content_hash *state, const unsigned char *data,
+                                long nstripes)
+{
+    long s;
+    int i;
+
+    for (s = 0; s < nstripes; s++, data += HASH_STRIPE)
+    {
+        const uint64_t *key = hash_keys[state->stripe];
+        uint64_t d[4];
+
+        memcpy(d, data, sizeof(d));
+        for (i = 0; i < 4; i++)
+        {
+            uint64_t x = d[i] ^ key[i];
+            state->acc[i] += (x & 0xFFFFFFFFULL) * (x >> 32);
+            state->acc[i ^ 1] += d[i];
+        }
+        if (++state->stripe == HASH_BLOCK_STRIPES)
+        {
+            for (i = 0; i < 4; i++)
+            {
+                state->acc[i] ^= state->acc[i] >> 47;
+                state->acc[i] ^= hash_keys[HASH_BLOCK_STRIPES][i];
+                state->acc[i] *= HASH_PRIME32;
+            }
+            state->stripe = 0;
+        }
+    }
+}
+
+__attribute__((target("avx2"))) static void
+hash_stripes_avx2(struct content_hash *state, const unsigned char *data, long nstripes)
+{
+    __m256i acc = _mm256_loadu_si256((const __m256i *)state->acc);
+    const __m256i prime = _mm256_set1_epi64x(HASH_PRIME32);
+    long s;
+
+    for (s = 0; s < nstripes; s++, data += HASH_STRIPE)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)data);
+        __m256i x = _mm256_xor_si256(d, _mm256_loadu_si256(
+                                            (const __m256i *)hash_keys[state->stripe]));
+        __m256i product = _mm256_mul_epu32(x, _mm256_srli_epi64(x, 32));
+        __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+
+        acc = _mm256_add_epi64(acc, _mm256_add_epi64(product, swapped));
+        if (++state->stripe == HASH_BLOCK_STRIPES)
+        {
+            acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+            acc = _mm256_xor_si256(acc, _mm256_loadu_si256(
+                                            (const __m256i *)hash_keys[HASH_BLOCK_STRIPES]));
+            acc = _mm256_add_epi64(_mm256_mul_epu32(acc, prime),
+                                   _mm256_slli_epi64(
+                                       _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime),
+                                       32));
+            state->stripe = 0;
+        }
+    }
+    _mm256_storeu_si256((__m256i *)state->acc, acc);
+}
+
+static void hash_stripes(struct content_hash *state, const unsigned char *data, long nstripes)
+{
+    if (state->isa >= ISA_AVX2)
+    {
+        hash_stripes_avx2(state, data, nstripes);
+    }
+    else
+    {
+        hash_stripes_scalar(state, data, nstripes);
+    }
+}
+
+static void hash_update(struct content_hash *state, const void *data, long bytes)
+{
+    const unsigned char *p = data;
+
+    state->length += bytes;
+    if (state->buffered > 0)
+    {
+        int take = HASH_STRIPE - state->buffered < bytes ? HASH_STRIPE - state->buffered
+                                                         : (int)bytes;
+        memcpy(state->buffer + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        bytes -= take;
+        if (state->buffered < HASH_STRIPE)
+        {
+            return;
+        }
+        hash_stripes(state, state->buffer, 1);
+        state->buffered = 0;
+    }
+    hash_stripes(state, p, bytes / HASH_STRIPE);
+    p += bytes / HASH_STRIPE * HASH_STRIPE;
+    memcpy(state->buffer, p, bytes % HASH_STRIPE);
+    state->buffered = bytes % HASH_STRIPE;
+}
+
+static uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t hash_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+/* two independent 64-bit digests of everything hashed */
+static void hash_digest(struct content_hash *state, uint64_t digest[2])
+{
+    const uint64_t *key = hash_keys[HASH_BLOCK_STRIPES + 1];
+    uint64_t *acc = state->acc;
+
+    if (state->buffered > 0)
+    {
+        memset(state->buffer + state->buffered, 0, HASH_STRIPE - state->buffered);
+        hash_stripes(state, state->buffer, 1);
+    }
+    digest[0] = hash_avalanche(state->length * 0x9E3779B185EBCA87ULL +
+                               hash_mix(acc[0] ^ key[0], acc[1] ^ key[1]) +
+                               hash_mix(acc[2] ^ key[2], acc[3] ^ key[3]));
+    digest[1] = hash_avalanche(~state->length * 0xC2B2AE3D27D4EB4FULL +
+                               hash_mix(acc[1] ^ key[2], acc[2] ^ key[3]) +
+                               hash_mix(acc[3] ^ key[0], acc[0] ^ key[1]));
+}
+
+/* hash the elements of a view of a [dims[0]]..[dims[ndim-1]] tensor in
+   index order, so equal contents hash equal whatever the strides. The
+   trailing dimensions that are contiguous are hashed as one run */
+static void hash_view(struct content_hash *state, const struct conv_view *view,
+                      int element_bytes, int ndim, const long *dims)
+{
+    const char *data = (const char *)view->data + view->offset * element_bytes;
+    long index[4] = {0, 0, 0, 0};
+    long run = 1;
+    int outer = ndim, i;
+
+    while (outer > 0 && view->strides[outer - 1] == run)
+    {
+        run *= dims[outer - 1];
+        outer--;
+    }
+    if (outer == ndim)
+    {
+        outer--; /* the innermost dimension is strided: runs of one element */
+    }
+    for (;;)
+    {
+        long offset = 0;
+        for (i = 0; i < outer; i++)
+        {
+            offset += index[i] * view->strides[i];
+        }
+        hash_update(state, data + offset * element_bytes, run * element_bytes);
+        for (i = outer - 1; i >= 0 && ++index[i] == dims[i]; i--)
+        {
+            index[i] = 0;
+        }
+        if (i < 0)
+        {
+            return;
+        }
+    }
+}
+
+/* a cached output [M][W][H], contiguous */
+struct cache_entry
+{
+    uint64_t key[3];          /* plan id, then the image digest */
+    long bytes;
+    int refs;                 /* one while in the cache, plus one per user; atomic */
+    struct cache_entry *prev, *next; /* most recently used first */
+    struct cache_entry *chain;       /* next in the hash bucket */
+    float output[];
+};
+
+/* a byte-capped LRU cache of plan outputs, keyed by the plan's kernels
+   and shape and by the contents of the image; may be shared by plans
+   and threads */
+struct conv_cache
+{
+    pthread_mutex_t lock;
+    long max_bytes;
+    long nbuckets;
+    struct cache_entry **buckets;
+    struct cache_entry *head, *tail;
+    struct conv_cache_stats stats;
+};
+
+/* drop a reference to an entry, such as an output returned by
+   conv_plan_execute_aliased; the last one frees it */
+void conv_cache_release(const float *output)
+{
+    struct cache_entry *entry = (struct cache_entry *)((char *)output -
+                                                       offsetof(struct cache_entry, output));
+
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(entry);
+    }
+}
+
+struct conv_cache *conv_cache_create(long max_bytes)
+{
+    struct conv_cache *cache = calloc(1, sizeof(struct conv_cache));
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->max_bytes = max_bytes;
+    cache->nbuckets = 64;
+    cache->buckets = calloc(cache->nbuckets, sizeof(struct cache_entry *));
+    return cache;
+}
+
+/* the cache of every plan, sized by CONV_CACHE_MB; NULL if that is unset or 0 */
+struct conv_cache *conv_default_cache(void)
+{
+    static struct conv_cache *cache = NULL;
+    static int created = 0;
+
+#pragma omp critical(conv_default_cache)
+    if (!created)
+    {
+        const char *mb = getenv("CONV_CACHE_MB");
+        if (mb != NULL && atof(mb) > 0.0)
+        {
+            cache = conv_cache_create((long)(atof(mb) * (1 << 20)));
+        }
+        created = 1;
+    }
+    return cache;
+}
+
+/* outputs still aliased are freed by their last conv_cache_release */
+void conv_cache_destroy(struct conv_cache *cache)
+{
+    struct cache_entry *entry = cache->head, *next;
+
+    for (; entry != NULL; entry = next)
+    {
+        next = entry->next;
+        conv_cache_release(entry->output);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+void conv_cache_get_stats(struct conv_cache *cache, struct conv_cache_stats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static long cache_bucket(const struct conv_cache *cache, const uint64_t key[3])
+{
+    return (long)((key[0] ^ key[1]) & (cache->nbuckets - 1));
+}
+
+/* the entry for a key, made most recently used; caller holds the lock */
+static struct cache_entry *cache_find(struct conv_cache *cache, const uint64_t key[3])
+{
+    struct cache_entry *entry = cache->buckets[cache_bucket(cache, key)];
+
+    while (entry != NULL && memcmp(entry->key, key, sizeof(entry->key)) != 0)
+    {
+        entry = entry->chain;
+    }
+    if (entry == NULL || entry == cache->head)
+    {
+        return entry;
+    }
+    entry->prev->next = entry->next;
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = cache->head;
+    cache->head->prev = entry;
+    cache->head = entry;
+    return entry;
+}
+
+/* unlink the least recently used entry; caller holds the lock */
+static void cache_evict(struct conv_cache *cache)
+{
+    struct cache_entry *entry = cache->tail;
+    struct cache_entry **link = &cache->buckets[cache_bucket(cache, entry->key)];
+
+    while (*link != entry)
+    {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    cache->tail = entry->prev;
+    if (cache->tail != NULL)
+    {
+        cache->tail->next = NULL;
+    }
+    else
+    {
+        cache->head = NULL;
+    }
+    cache->stats.bytes -= entry->bytes;
+    cache->stats.entries--;
+    cache->stats.evictions++;
+    conv_cache_release(entry->output);
+}
+
+/* link a new entry as most recently used, evicting to stay under the
+   cap; an output larger than the whole cache is not kept. Returns the
+   entry now cached under its key, which may be another thread's */
+static struct cache_entry *cache_insert(struct conv_cache *cache, struct cache_entry *entry)
+{
+    struct cache_entry *existing;
+    long b;
+
+    if (entry->bytes > cache->max_bytes)
+    {
+        return entry;
+    }
+    existing = cache_find(cache, entry->key);
+    if (existing != NULL)
+    {
+        return existing;
+    }
+    while (cache->stats.bytes + entry->bytes > cache->max_bytes)
+    {
+        cache_evict(cache);
+    }
+    if (cache->stats.entries >= cache->nbuckets)
+    {
+        struct cache_entry *e;
+        free(cache->buckets);
+        cache->nbuckets *= 2;
+        cache->buckets = calloc(cache->nbuckets, sizeof(struct cache_entry *));
+        for (e = cache->head; e != NULL; e = e->next)
+        {
+            b = cache_bucket(cache, e->key);
+            e->chain = cache->buckets[b];
+            cache->buckets[b] = e;
+        }
+    }
+    b = cache_bucket(cache, entry->key);
+    entry->chain = cache->buckets[b];
+    cache->buckets[b] = entry;
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+    {
+        cache->head->prev = entry;
+    }
+    else
+    {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    cache->stats.bytes += entry->bytes;
+    cache->stats.entries++;
+    cache->stats.insertions++;
+    return entry;
+}
+
+/* epoch-based reclamation. A thread running a plan announces the global
+   epoch in a slot of its own for the length of the call; an object
+   replaced meanwhile is retired with the epoch of its replacement and
+   freed once no slot announces that epoch or an earlier one. Readers
+   take no lock and write only their own slot; a slot is given back when
+   its thread exits */
+#define EPOCH_SLOTS 1024
+
+struct epoch_slot
+{
+    uint64_t epoch;           /* announced, 0 outside a call */
+    int used;
+} __attribute__((aligned(64)));
+
+static struct epoch_slot epoch_slots[EPOCH_SLOTS];
+static uint64_t global_epoch = 1;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static __thread struct epoch_slot *epoch_own;
+static __thread int epoch_depth;
+
+static void epoch_release_slot(void *slot)
+{
+    __atomic_store_n(&((struct epoch_slot *)slot)->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&((struct epoch_slot *)slot)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_make_key(void)
+{
+    pthread_key_create(&epoch_key, epoch_release_slot);
+}
+
+/* enter a read-side section; sections nest */
+static void epoch_enter(void)
+{
+    int i;
+
+    if (epoch_depth++ > 0)
+    {
+        return;
+    }
+    if (epoch_own == NULL)
+    {
+        for (i = 0; i < EPOCH_SLOTS && epoch_own == NULL; i++)
+        {
+            int unused = 0;
+            if (__atomic_compare_exchange_n(&epoch_slots[i].used, &unused, 1, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                epoch_own = &epoch_slots[i];
+            }
+        }
+        if (epoch_own == NULL)
+        {
+            fprintf(stderr, "FATAL: more than %d threads are running plans\n", EPOCH_SLOTS);
+            exit(1);
+        }
+        pthread_once(&epoch_once, epoch_make_key);
+        pthread_setspecific(epoch_key, epoch_own);
+    }
+    /* announced before anything published is read */
+    __atomic_store_n(&epoch_own->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+}
+
+/* a version of a plan's kernels: packed, in the engine's domain where
+   that differs, and the per-node copies the engine reads */
+struct kernel_set
+{
+    double *packed;           /* [M/MR][C][K][K][MR] */
+    double *winograd;         /* in the Winograd domain, for that engine */
+    long replica_bytes;
+    double *replicas[CONV_MAX_NODES];
+    const double *copies[CONV_MAX_NODES]; /* what each node's threads read */
+    uint64_t id;              /* digest of the plan's shape and these kernels */
+    int holds;                /* delta streams computing with it, which keep it */
+    uint64_t retired;         /* epoch it was replaced in */
+    struct kernel_set *next;  /* retired after it */
+};
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kernel_set *retired_sets;
+static long kernel_sets_retired, kernel_sets_freed;
+static int kernel_sets_pending;
+
+static void kernel_set_free(struct kernel_set *set)
+{
+    int node;
+
+    for (node = 0; node < CONV_MAX_NODES; node++)
+    {
+        if (set->replicas[node] != NULL)
+        {
+            munmap(set->replicas[node], set->replica_bytes);
+        }
+    }
+    free(set->packed);
+    free(set->winograd);
+    free(set);
+}
+
+/* free the retired sets no thread can still be reading; with wait 0 give
+   up at once if another thread is at it */
+static void kernel_sets_reclaim(int wait)
+{
+    struct kernel_set **link, *set;
+    uint64_t oldest = UINT64_MAX;
+    int i;
+
+    if (wait)
+    {
+        pthread_mutex_lock(&retired_lock);
+    }
+    else if (pthread_mutex_trylock(&retired_lock) != 0)
+    {
+        return;
+    }
+    for (i = 0; i < EPOCH_SLOTS; i++)
+    {
+        uint64_t epoch = __atomic_load_n(&epoch_slots[i].epoch, __ATOMIC_SEQ_CST);
+        oldest = epoch != 0 && epoch < oldest ? epoch : oldest;
+    }
+    for (link = &retired_sets; (set = *link) != NULL;)
+    {
+        if (set->retired < oldest && __atomic_load_n(&set->holds, __ATOMIC_ACQUIRE) == 0)
+        {
+            *link = set->next;
+            kernel_set_free(set);
+            kernel_sets_freed++;
+            __atomic_sub_fetch(&kernel_sets_pending, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            link = &set->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_lock);
+}
+
+/* leave a read-side section, freeing what it alone was holding back */
+static void epoch_exit(void)
+{
+    if (--epoch_depth > 0)
+    {
+        return;
+    }
+    __atomic_store_n(&epoch_own->epoch, 0, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&kernel_sets_pending, __ATOMIC_RELAXED) > 0)
+    {
+        kernel_sets_reclaim(0);
+    }
+}
+
+/* retire a set readers may still hold: the epoch moves on, so readers
+   announcing an epoch past the set's cannot have read it */
+static void kernel_set_retire(struct kernel_set *set)
+{
+    set->retired = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&retired_lock);
+    set->next = retired_sets;
+    retired_sets = set;
+    kernel_sets_retired++;
+    __atomic_add_fetch(&kernel_sets_pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&retired_lock);
+    kernel_sets_reclaim(1);
+}
+
+/* a convolution plan: the engine, blocking and packed kernels chosen
+   once for a shape, plus scratch space reused by every call */
+struct conv_plan
+{
+    int width, height, nchannels, nkernels, kernel_order;
+    enum conv_isa isa;
+    enum conv_engine engine;
+    int col_block;  /* im2col output columns per GEMM block */
+    int panel_cols; /* implicit GEMM output columns per packed panel */
+    double predicted[ENGINE_COUNT];
+    struct kernel_set *kernels; /* published; replaced by conv_plan_set_kernels */
+    double *packed_image;
+    double *columns;          /* im2col matrix */
+    const double **taps;      /* indirection buffer into packed_image */
+    int winograd_variant;     /* index into winograd_variants */
+    struct winograd_transform winograd;
+    struct core_set cores;    /* cpus to run on, default_cores unless set */
+    struct conv_schedule schedule;
+    int replicate;            /* keep a copy of the engine's kernels per NUMA node */
+    float *output_scratch;    /* for output views the engine cannot store into */
+    struct conv_cache *cache; /* outputs by image contents, or NULL */
+};
+
+/* pick the implemented engine with the lowest predicted time; CONV_ENGINE
+   overrides the choice by name */
+enum conv_engine select_engine(const double *predicted, int kernel_order)
+{
+    const char *forced = getenv("CONV_ENGINE");
+    int e, best = ENGINE_DIRECT;
+
+    for (e = 0; e < ENGINE_COUNT; e++)
+    {
+        if (forced != NULL && engine_available(e, kernel_order) &&
+            strcmp(forced, engine_names[e]) == 0)
+        {
+            return e;
+        }
+    }
+    for (e = 0; e < ENGINE_COUNT; e++)
+    {
+        /* F(2,5) and F(2,7) round differently from the reference by an
+           ulp or two, so they are only used when asked for */
+        if (e == ENGINE_WINOGRAD && kernel_order != 3)
+        {
+            continue;
+        }
+        if (engine_available(e, kernel_order) && predicted[e] < predicted[best])
+        {
+            best = e;
+        }
+    }
+    return best;
+}
+
+/* a kernel set for the plan's shape, engine and cores from packed
+   kernels, which it takes over: the engine's form of them, and for
+   every node the copy its threads read. When the plan replicates, each
+   node the plan's threads run on gets a copy first touched there; a node
+   whose copy fails keeps the shared data */
+static struct kernel_set *kernel_set_build(const struct conv_plan *plan, double *packed)
+{
+    struct kernel_set *set = calloc(1, sizeof(struct kernel_set));
+    long mblocks = (plan->nkernels + CONV_MR - 1) / CONV_MR;
+    long bytes = mblocks * plan->nchannels * plan->kernel_order * plan->kernel_order * CONV_MR *
+                 sizeof(double);
+    int shape[7] = {plan->width, plan->height, plan->nchannels, plan->nkernels,
+                    plan->kernel_order, plan->engine,
+                    plan->engine == ENGINE_WINOGRAD ? plan->winograd_variant : -1};
+    const double *source = packed;
+    struct content_hash state;
+    uint64_t digest[2];
+    int node, i;
+
+    set->packed = packed;
+    set->replica_bytes = bytes;
+    if (plan->engine == ENGINE_WINOGRAD)
+    {
+        set->winograd = winograd_transform_kernels(&plan->winograd, packed, plan->nchannels,
+                                                   plan->nkernels);
+        source = set->winograd;
+        set->replica_bytes = (long)plan->winograd.n * plan->winograd.n * mblocks *
+                             plan->nchannels * CONV_MR * sizeof(double);
+    }
+    for (node = 0; node < CONV_MAX_NODES; node++)
+    {
+        set->copies[node] = source;
+    }
+    for (i = 0; plan->replicate && i < plan->cores.ncpus; i++)
+    {
+        node = plan->schedule.thread_node[i];
+        if (set->replicas[node] == NULL)
+        {
+            set->replicas[node] = replicate_on_cpu(source, set->replica_bytes,
+                                                   plan->cores.cpus[i]);
+            if (set->replicas[node] != NULL)
+            {
+                set->copies[node] = set->replicas[node];
+            }
+        }
+    }
+
+    /* the part of a plan's cache keys that names the kernels, so plans
+       built from the same kernels, as student_conv builds on every call,
+       share cached outputs. The engine and Winograd variant are part of
+       it, as the inexact variants round differently from the rest */
+    hash_init(&state, plan->isa);
+    hash_update(&state, shape, sizeof(shape));
+    hash_update(&state, packed, bytes);
+    hash_digest(&state, digest);
+    set->id = digest[0];
+    return set;
+}
+
+/* publish a kernel set built from packed kernels (taken over), or from
+   a copy of the current set's if NULL; calls already running finish on
+   the set they started with. The set is built for the plan's current
+   engine and cores, so only a swap of kernels alone is safe while calls
+   run: the setters that change those go first, on an idle plan */
+static void conv_plan_place_kernels(struct conv_plan *plan, double *packed)
+{
+    struct kernel_set *old;
+
+    if (packed == NULL)
+    {
+        long bytes = (plan->nkernels + CONV_MR - 1) / CONV_MR * plan->nchannels *
+                     plan->kernel_order * plan->kernel_order * CONV_MR * sizeof(double);
+        packed = malloc(bytes);
+        memcpy(packed, plan->kernels->packed, bytes);
+    }
+    old = __atomic_exchange_n(&plan->kernels, kernel_set_build(plan, packed), __ATOMIC_SEQ_CST);
+    if (old != NULL)
+    {
+        kernel_set_retire(old);
+    }
+}
+
+/* the scratch space of a plan's engine. The indirection buffer points
+   into the plan's own packed image, so it is built once here and stays
+   valid for every call on this plan */
+static void conv_plan_prepare_engine(struct conv_plan *plan, enum conv_engine engine)
+{
+    long depth = (long)plan->nchannels * plan->kernel_order * plan->kernel_order;
+
+    free(plan->columns);
+    free(plan->taps);
+    plan->columns = NULL;
+    plan->taps = NULL;
+    plan->engine = engine;
+
+    /* every engine but implicit GEMM works on a planar copy of the image */
+    if (engine == ENGINE_IMPLICIT)
+    {
+        free(plan->packed_image);
+        plan->packed_image = NULL;
+    }
+    else if (plan->packed_image == NULL)
+    {
+        plan->packed_image = malloc((long)(plan->width + plan->kernel_order) *
+                                    (plan->height + plan->kernel_order) *
+                                    plan->nchannels * sizeof(double));
+    }
+
+    if (engine == ENGINE_IM2COL)
+    {
+        plan->columns = malloc(depth * plan->width * plan->height * sizeof(double));
+    }
+    else if (engine == ENGINE_INDIRECT)
+    {
+        plan->taps = build_indirection(plan->packed_image, plan->width, plan->height,
+                                       plan->nchannels, plan->kernel_order);
+    }
+    else if (engine == ENGINE_WINOGRAD)
+    {
+        winograd_build(&plan->winograd, &winograd_variants[plan->winograd_variant]);
+    }
+}
+
+/* switch a plan to another engine, replacing the engine's scratch space
+   and the form of its kernels. The scratch is freed in place, so no call
+   may be running on the plan, nor a delta stream open over it, whose
+   kernels stay in the old engine's form */
+void conv_plan_set_engine(struct conv_plan *plan, enum conv_engine engine)
+{
+    conv_plan_prepare_engine(plan, engine);
+    conv_plan_place_kernels(plan, NULL);
+}
+
+/* build a plan for one shape and a view of [M][C][K][K] kernels */
+struct conv_plan *conv_plan_create_view(int width, int height, int nchannels, int nkernels,
+                                        int kernel_order, const struct conv_view *kernels)
+{
+    struct conv_plan *plan = calloc(1, sizeof(struct conv_plan));
+    const struct machine_params *params = conv_machine_params();
+    const char *replicate = getenv("CONV_REPLICATE");
+    long depth = (long)nchannels * kernel_order * kernel_order;
+    long block = CONV_NR * isa_lanes[params->isa];
+    int e;
+
+    plan->width = width;
+    plan->height = height;
+    plan->nchannels = nchannels;
+    plan->nkernels = nkernels;
+    plan->kernel_order = kernel_order;
+    plan->isa = params->isa;
+    for (e = 0; e < ENGINE_COUNT; e++)
+    {
+        plan->predicted[e] = predict_conv_time(e, params, width, height, nchannels,
+                                               nkernels, kernel_order);
+    }
+
+    /* size im2col column blocks so that one block fills half of L2 */
+    plan->col_block = (int)(params->l2_bytes / 2 / (depth * sizeof(double)) / block * block);
+    plan->col_block = plan->col_block < block ? block : plan->col_block;
+
+    /* size implicit GEMM panels so that one panel fills half of L1 */
+    plan->panel_cols = (int)(params->l1_bytes / 2 / (depth * sizeof(double)) / block * block);
+    plan->panel_cols = plan->panel_cols < block ? block : plan->panel_cols;
+
+    plan->winograd_variant = winograd_default_variant(kernel_order);
+    default_cores(&plan->cores);
+    conv_schedule_build(&plan->cores, &plan->schedule);
+    plan->replicate = replicate != NULL ? atoi(replicate) != 0 : conv_topology()->nnodes > 1;
+    conv_plan_prepare_engine(plan, select_engine(plan->predicted, kernel_order));
+    conv_plan_place_kernels(plan, pack_kernels_view(kernels, nchannels, nkernels, kernel_order));
+    plan->cache = conv_default_cache();
+    return plan;
+}
+
+/* build a plan for one shape and set of kernels */
+struct conv_plan *conv_plan_create(int width, int height, int nchannels, int nkernels,
+                                   int kernel_order, int16_t ****kernels)
+{
+    struct conv_view view = conv_view_int16_4d(kernels, nchannels, kernel_order, kernel_order);
+
+    return conv_plan_create_view(width, height, nchannels, nkernels, kernel_order, &view);
+}
+
+/* run a plan on a view of a [W+K][H+K][C] image, writing a view of the
+   [M][W][H] output. The engines store whole output rows, so an output
+   whose heights are not adjacent (or, for im2col, whose rows are not
+   back to back) is computed into plan scratch and copied out. The caller
+   holds an epoch over the call, so the kernel set stays valid */
+static void plan_run(struct conv_plan *plan, const struct kernel_set *set,
+                     const struct conv_view *image, const struct conv_view *output)
+{
+    struct conv_view scratch = {NULL, 0, {(long)plan->width * plan->height, plan->height, 1, 0}};
+    const struct conv_view *out = output;
+    int in_place = plan->engine == ENGINE_WINOGRAD ||
+                   (output->strides[2] == 1 &&
+                    (plan->engine != ENGINE_IM2COL || output->strides[1] == plan->height));
+    int m, w, h;
+
+    if (!in_place)
+    {
+        if (plan->output_scratch == NULL)
+        {
+            plan->output_scratch = malloc((long)plan->nkernels * plan->width * plan->height *
+                                          sizeof(float));
+        }
+        scratch.data = plan->output_scratch;
+        out = &scratch;
+    }
+
+    bind_team_to_cores(&plan->cores);
+    if (plan->engine == ENGINE_IMPLICIT)
+    {
+        implicit_conv(image, set->copies, out, plan->width, plan->height,
+                      plan->nchannels, plan->nkernels, plan->kernel_order,
+                      plan->panel_cols, plan->isa, &plan->schedule);
+    }
+    else
+    {
+        pack_image_view(image, plan->packed_image, plan->width + plan->kernel_order,
+                        plan->height + plan->kernel_order, plan->nchannels);
+        if (plan->engine == ENGINE_IM2COL)
+        {
+            im2col_conv_packed(plan->packed_image, set->copies, plan->columns,
+                               out, plan->width, plan->height, plan->nchannels,
+                               plan->nkernels, plan->kernel_order, plan->col_block,
+                               plan->isa, &plan->schedule);
+        }
+        else if (plan->engine == ENGINE_WINOGRAD)
+        {
+            winograd_conv_packed(&plan->winograd, plan->packed_image, set->copies,
+                                 out, plan->width, plan->height, plan->nchannels,
+                                 plan->nkernels, plan->kernel_order, plan->isa,
+                                 &plan->schedule);
+        }
+        else if (plan->engine == ENGINE_INDIRECT)
+        {
+            indirect_conv_packed(plan->taps, set->copies, out, plan->width,
+                                 plan->height, plan->nchannels, plan->nkernels,
+                                 plan->kernel_order, plan->isa, &plan->schedule);
+        }
+        else
+        {
+            direct_conv_packed(plan->packed_image, set->copies, out,
+                               plan->width, plan->height, plan->nchannels,
+                               plan->nkernels, plan->kernel_order, plan->isa,
+                               &plan->schedule);
+        }
+    }
+
+    if (!in_place && (current_stop == NULL || current_stop->status == CONV_OK))
+    {
+        float *dst = (float *)output->data + output->offset;
+
+#pragma omp parallel for collapse(2) private(h)
+        for (m = 0; m < plan->nkernels; m++)
+        {
+            for (w = 0; w < plan->width; w++)
+            {
+                const float *src = plan->output_scratch +
+                                   ((long)m * plan->width + w) * plan->height;
+                float *row = dst + m * output->strides[0] + w * output->strides[1];
+                for (h = 0; h < plan->height; h++)
+                {
+                    row[h * output->strides[2]] = src[h];
+                }
+            }
+        }
+    }
+}
+
+/* hash the image into key, under the kernel set's id, and look it up in
+   the plan's cache; returns the entry with a reference held for the
+   caller, or NULL on a miss */
+static struct cache_entry *cache_lookup(struct conv_plan *plan, const struct kernel_set *set,
+                                        const struct conv_view *image, uint64_t key[3])
+{
+    long dims[3] = {plan->width + plan->kernel_order, plan->height + plan->kernel_order,
+                    plan->nchannels};
+    struct content_hash state;
+    struct cache_entry *entry;
+    double start = now_seconds(), seconds;
+
+    hash_init(&state, plan->isa);
+    hash_view(&state, image, sizeof(float), 3, dims);
+    hash_digest(&state, key + 1);
+    key[0] = set->id;
+    seconds = now_seconds() - start;
+
+    pthread_mutex_lock(&plan->cache->lock);
+    entry = cache_find(plan->cache, key);
+    if (entry != NULL)
+    {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    }
+    plan->cache->stats.hits += entry != NULL;
+    plan->cache->stats.misses += entry == NULL;
+    plan->cache->stats.hashed_bytes += state.length;
+    plan->cache->stats.hash_seconds += seconds;
+    pthread_mutex_unlock(&plan->cache->lock);
+    return entry;
+}
+
+/* an uncached entry for a plan's output, with the caller's reference */
+static struct cache_entry *new_cache_entry(const struct conv_plan *plan, const uint64_t key[3])
+{
+    long bytes = (long)plan->nkernels * plan->width * plan->height * sizeof(float);
+    struct cache_entry *entry = malloc(sizeof(struct cache_entry) + bytes);
+
+    memset(entry, 0, sizeof(struct cache_entry));
+    memcpy(entry->key, key, sizeof(entry->key));
+    entry->bytes = bytes;
+    entry->refs = 1;
+    return entry;
+}
+
+/* offer an entry to the cache; returns the entry cached under its key
+   (another thread's if it got there first) with a reference for the
+   caller, and drops the caller's reference to the entry offered */
+static struct cache_entry *cache_store(struct conv_cache *cache, struct cache_entry *entry)
+{
+    struct cache_entry *cached;
+
+    pthread_mutex_lock(&cache->lock);
+    cached = cache_insert(cache, entry);
+    if (cached != entry)
+    {
+        __atomic_add_fetch(&cached->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (cached != entry)
+    {
+        conv_cache_release(entry->output);
+    }
+    return cached;
+}
+
+/* copy between a contiguous [M][W][H] output and a view of one; to_view
+   picks the direction */
+static void copy_output(float *contiguous, const struct conv_view *view, int nkernels,
+                        int width, int height, int to_view)
+{
+    float *data = (float *)view->data + view->offset;
+    int m, w, h;
+
+#pragma omp parallel for collapse(2) private(h)
+    for (m = 0; m < nkernels; m++)
+    {
+        for (w = 0; w < width; w++)
+        {
+            float *row = contiguous + ((long)m * width + w) * height;
+            float *strided = data + m * view->strides[0] + w * view->strides[1];
+            for (h = 0; h < height; h++)
+            {
+                if (to_view)
+                {
+                    strided[h * view->strides[2]] = row[h];
+                }
+                else
+                {
+                    row[h] = strided[h * view->strides[2]];
+                }
+            }
+        }
+    }
+}
+
+/* run a plan on a view of a [W+K][H+K][C] image, writing a view of the
+   [M][W][H] output. With a cache, an image seen before has its output
+   copied from the cache instead of being convolved again. The whole
+   call uses the kernels published when it started */
+void conv_plan_execute_view(struct conv_plan *plan, const struct conv_view *image,
+                            const struct conv_view *output)
+{
+    const struct kernel_set *set;
+    struct cache_entry *entry;
+    uint64_t key[3];
+
+    epoch_enter();
+    set = __atomic_load_n(&plan->kernels, __ATOMIC_SEQ_CST);
+    if (plan->cache == NULL)
+    {
+        plan_run(plan, set, image, output);
+        epoch_exit();
+        return;
+    }
+    entry = cache_lookup(plan, set, image, key);
+    if (entry != NULL)
+    {
+        copy_output(entry->output, output, plan->nkernels, plan->width, plan->height, 1);
+        conv_cache_release(entry->output);
+        epoch_exit();
+        return;
+    }
+    plan_run(plan, set, image, output);
+    entry = new_cache_entry(plan, key);
+    copy_output(entry->output, output, plan->nkernels, plan->width, plan->height, 0);
+    conv_cache_release(cache_store(plan->cache, entry)->output);
+    epoch_exit();
+}
+
+/* the [M][W][H] output for an image, contiguous, without a copy on a
+   cache hit: the cache's own buffer, valid until it is passed to
+   conv_cache_release. Without a cache this computes into a new buffer */
+const float *conv_plan_execute_aliased(struct conv_plan *plan, const struct conv_view *image)
+{
+    struct cache_entry *entry = NULL;
+    struct conv_view view = {NULL, 0, {(long)plan->width * plan->height, plan->height, 1, 0}};
+    const struct kernel_set *set;
+    uint64_t key[3] = {0, 0, 0};
+
+    epoch_enter();
+    set = __atomic_load_n(&plan->kernels, __ATOMIC_SEQ_CST);
+    if (plan->cache != NULL)
+    {
+        entry = cache_lookup(plan, set, image, key);
+    }
+    if (entry == NULL)
+    {
+        entry = new_cache_entry(plan, key);
+        view.data = entry->output;
+        plan_run(plan, set, image, &view);
+        if (plan->cache != NULL)
+        {
+            entry = cache_store(plan->cache, entry);
+        }
+    }
+    epoch_exit();
+    return entry->output;
+}
+
+/* run a plan on a view of an image unless the deadline (on the
+   now_seconds clock, 0 for none) passes or *cancel (if not NULL) turns
+   nonzero first. The engines check both before every task, so a call
+   stops within a task of either and returns CONV_EXPIRED or
+   CONV_CANCELLED, with the output partly written; a call whose deadline
+   has already passed does no work. Only complete outputs are cached */
+enum conv_status conv_plan_execute_until(struct conv_plan *plan, const struct conv_view *image,
+                                         const struct conv_view *output, double deadline,
+                                         const int *cancel)
+{
+    struct conv_stop stop = {deadline, cancel, CONV_OK};
+    struct conv_stop *outer = current_stop;
+    const struct kernel_set *set;
+    struct cache_entry *entry = NULL;
+    uint64_t key[3];
+
+    if (stop_requested(&stop))
+    {
+        return stop.status;
+    }
+    epoch_enter();
+    set = __atomic_load_n(&plan->kernels, __ATOMIC_SEQ_CST);
+    if (plan->cache != NULL)
+    {
+        entry = cache_lookup(plan, set, image, key);
+    }
+    if (entry != NULL)
+    {
+        copy_output(entry->output, output, plan->nkernels, plan->width, plan->height, 1);
+        conv_cache_release(entry->output);
+        epoch_exit();
+        return CONV_OK;
+    }
+    current_stop = &stop;
+    plan_run(plan, set, image, output);
+    current_stop = outer;
+    if (plan->cache != NULL && stop.status == CONV_OK)
+    {
+        entry = new_cache_entry(plan, key);
+        copy_output(entry->output, output, plan->nkernels, plan->width, plan->height, 0);
+        conv_cache_release(cache_store(plan->cache, entry)->output);
+    }
+    epoch_exit();
+    return stop.status;
+}
+
+/* run a plan on one image */
+void conv_plan_execute(struct conv_plan *plan, float ***image, float ***output)
+{
+    struct conv_view image_view = conv_view_float3d(image, plan->height + plan->kernel_order,
+                                                    plan->nchannels);
+    struct conv_view output_view = conv_view_float3d(output, plan->width, plan->height);
+
+    conv_plan_execute_view(plan, &image_view, &output_view);
+}
+
+/* no call may be running on the plan; sets it retired are freed as the
+   calls and delta streams holding them finish */
+void conv_plan_destroy(struct conv_plan *plan)
+{
+    if (__atomic_load_n(&plan->kernels->holds, __ATOMIC_ACQUIRE) > 0)
+    {
+        kernel_set_retire(plan->kernels);
+    }
+    else
+    {
+        kernel_set_free(plan->kernels);
+    }
+    free(plan->packed_image);
+    free(plan->columns);
+    free(plan->taps);
+    free(plan->output_scratch);
+    free(plan);
+}
+
+/* the name of the engine a plan runs */
+const char *conv_plan_engine(const struct conv_plan *plan)
+{
+    return engine_names[plan->engine];
+}
+
+/* restrict a plan to a core set, e.g. one from conv_partition_cores, so
+   that concurrent plans do not each spread over every core. The schedule
+   is rebuilt in place, so no call may be running on the plan */
+void conv_plan_set_cores(struct conv_plan *plan, const struct core_set *cores)
+{
+    plan->cores = *cores;
+    conv_schedule_build(&plan->cores, &plan->schedule);
+    conv_plan_place_kernels(plan, NULL);
+}
+
+/* turn per-node kernel replicas on or off; CONV_REPLICATE sets the
+   default, otherwise plans replicate on machines with several nodes.
+   Like the other setters but conv_plan_set_kernels, it needs the plan
+   idle */
+void conv_plan_set_replication(struct conv_plan *plan, int replicate)
+{
+    plan->replicate = replicate;
+    conv_plan_place_kernels(plan, NULL);
+}
+
+/* replace a plan's kernels with a view of new [M][C][K][K] kernels of
+   the same shape, while another thread may be executing it: the new
+   kernels are packed and placed first, then published with one atomic
+   store. A call already running finishes on the old kernels, later calls
+   use the new ones, and the old ones are freed once the last call that
+   may read them returns. Delta streams keep the kernels they were
+   created with until destroyed. Executes themselves stay one at a time
+   per plan, as they share the packed image, columns and output scratch.
+   This is the only plan setter that is safe while a call runs; the engine, cores and replication setters
+   rebuild scratch and schedules in place and need the plan idle */
+void conv_plan_set_kernels(struct conv_plan *plan, const struct conv_view *kernels)
+{
+    conv_plan_place_kernels(plan, pack_kernels_view(kernels, plan->nchannels, plan->nkernels,
+                                                    plan->kernel_order));
+}
+
+/* look outputs up in a cache before computing them, and keep them
+   there; NULL turns caching off */
+void conv_plan_set_cache(struct conv_plan *plan, struct conv_cache *cache)
+{
+    plan->cache = cache;
+}
+
+/* bytes of engine scratch space a plan uses while executing */
+long conv_plan_scratch_bytes(const struct conv_plan *plan)
+{
+    long padded = (long)(plan->width + plan->kernel_order) * (plan->height + plan->kernel_order);
+    long depth = (long)plan->nchannels * plan->kernel_order * plan->kernel_order;
+
+    switch (plan->engine)
+    {
+    case ENGINE_IM2COL:
+        return (padded * plan->nchannels + depth * plan->width * plan->height) * sizeof(double);
+    case ENGINE_INDIRECT:
+        return padded * plan->nchannels * sizeof(double) +
+               plan->width * depth * sizeof(double *);
+    case ENGINE_IMPLICIT:
+        return omp_get_max_threads() * depth * plan->panel_cols * sizeof(double);
+    default:
+        return padded * plan->nchannels * sizeof(double);
+    }
+}
+
+/* a set of kernels applied to batches of images of different sizes.
+   Every image is split into spatial tiles (a run of heights of one
+   output row) and the tiles of all images form one pool, so the threads
+   stay busy however the sizes fall and no thread waits for the end of
+   an image. The pool runs image by image, each kernel group over the
+   tiles of the image, as the direct engine does for one image. When
+   the kernels are larger than half of L2 and the packed images fit
+   there, the pool instead runs a kernel group at a time over every
+   image, so each block of kernels is loaded once per batch. Tiles run
+   on the direct engine, the one whose scratch (a packed image) does
+   not depend on the shape */
+struct conv_batch
+{
+    int nchannels, nkernels, kernel_order;
+    int tile_cols;            /* output heights per tile */
+    long kernel_bytes;
+    long l2_bytes;
+    enum conv_isa isa;
+    double *packed_kernels;
+    const double *kernel_copies[CONV_MAX_NODES]; /* all the one shared copy */
+    struct core_set cores;
+    struct conv_schedule schedule;
+    double *packed_images;    /* every image of the last batch, planar */
+    long packed_capacity;     /* doubles */
+};
+
+/* arguments shared by the tiles of a ragged batch */
+struct batch_task
+{
+    const struct conv_batch *batch;
+    const struct conv_batch_image *images;
+    const long *first_tile;   /* [nimages + 1], prefix sums of tiles per image */
+    const long *packed_offset;
+    int nimages;
+    int kernels_outer;        /* groups are kernel groups, tasks tiles */
+    long mblocks;
+};
+
+/* one tile of the pool for one kernel group */
+static void batch_task_run(void *ctx, int thread, long group, long task)
+{
+    const struct batch_task *a = ctx;
+    const struct conv_batch *b = a->batch;
+    const struct conv_batch_image *image;
+    /* the tile the task belongs to; image by image, a task index
+       divided by the number of kernel groups falls in the same image */
+    long t = a->kernels_outer ? task : task / a->mblocks;
+    long mb = group;
+    int lo = 0, hi = a->nimages - 1;
+    int block_size = b->nchannels * b->kernel_order * b->kernel_order * CONV_MR;
+    long hblocks, local, channel_stride;
+    int padded_height, m0, mcount, w, h0, hcount;
+    float *output;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (a->first_tile[mid] <= t)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    if (!a->kernels_outer)
+    {
+        /* image lo's tasks are its tiles for kernel group 0, then group 1, ... */
+        long ntiles = a->first_tile[lo + 1] - a->first_tile[lo];
+        local = task - a->mblocks * a->first_tile[lo];
+        mb = local / ntiles;
+        t = a->first_tile[lo] + local % ntiles;
+    }
+    m0 = mb * CONV_MR;
+    mcount = b->nkernels - m0 < CONV_MR ? b->nkernels - m0 : CONV_MR;
+    image = &a->images[lo];
+    hblocks = (image->height + b->tile_cols - 1) / b->tile_cols;
+    local = t - a->first_tile[lo];
+    w = local / hblocks;
+    h0 = local % hblocks * b->tile_cols;
+    hcount = image->height - h0 < b->tile_cols ? image->height - h0 : b->tile_cols;
+    padded_height = image->height + b->kernel_order;
+    channel_stride = (long)(image->width + b->kernel_order) * padded_height;
+    output = (float *)image->output.data + image->output.offset;
+
+    direct_row_kernels[b->isa](b->packed_images + a->packed_offset[lo] +
+                                   (long)w * padded_height + h0,
+                               node_copy(&b->schedule, b->kernel_copies, thread) +
+                                   mb * block_size,
+                               output + m0 * image->output.strides[0] +
+                                   w * image->output.strides[1] + h0,
+                               channel_stride, padded_height, image->output.strides[0],
+                               mcount, hcount, b->nchannels, b->kernel_order);
+}
+
+/* pack a view of [M][C][K][K] kernels for ragged batches */
+struct conv_batch *conv_batch_create(int nchannels, int nkernels, int kernel_order,
+                                     const struct conv_view *kernels)
+{
+    struct conv_batch *batch = calloc(1, sizeof(struct conv_batch));
+    const struct machine_params *params = conv_machine_params();
+    long block = CONV_NR * isa_lanes[params->isa];
+    long per_col = (long)nchannels * kernel_order * sizeof(double);
+    int node;
+
+    batch->nchannels = nchannels;
+    batch->nkernels = nkernels;
+    batch->kernel_order = kernel_order;
+    batch->isa = params->isa;
+
+    /* the C * K image rows a tile reads fill half of L2 */
+    batch->tile_cols = (int)((params->l2_bytes / 2 / per_col - kernel_order) / block * block);
+    batch->tile_cols = batch->tile_cols < block ? block : batch->tile_cols;
+    batch->kernel_bytes = (long)(nkernels + CONV_MR - 1) / CONV_MR * CONV_MR * nchannels *
+                          kernel_order * kernel_order * sizeof(double);
+    batch->l2_bytes = params->l2_bytes;
+
+    batch->packed_kernels = pack_kernels_view(kernels, nchannels, nkernels, kernel_order);
+    for (node = 0; node < CONV_MAX_NODES; node++)
+    {
+        batch->kernel_copies[node] = batch->packed_kernels;
+    }
+    default_cores(&batch->cores);
+    conv_schedule_build(&batch->cores, &batch->schedule);
+    return batch;
+}
+
+/* convolve nimages images of any sizes with the batch's kernels */
+void conv_batch_execute(struct conv_batch *batch, int nimages,
+                        const struct conv_batch_image *images)
+{
+    long *first_tile = malloc((nimages + 1) * sizeof(long));
+    long *packed_offset = malloc((nimages + 1) * sizeof(long));
+    long mblocks = (batch->nkernels + CONV_MR - 1) / CONV_MR;
+    struct batch_task a = {batch, images, first_tile, packed_offset, nimages, 0, mblocks};
+    int i;
+
+    first_tile[0] = 0;
+    packed_offset[0] = 0;
+    for (i = 0; i < nimages; i++)
+    {
+        const struct conv_batch_image *image = &images[i];
+        if (image->width < 1 || image->height < 1 || image->output.strides[2] != 1)
+        {
+            fprintf(stderr, "FATAL: batch image %d is %d x %d with output height stride %ld; "
+                            "need at least 1 x 1 and stride 1\n",
+                    i, image->width, image->height, image->output.strides[2]);
+            exit(1);
+        }
+        first_tile[i + 1] = first_tile[i] + (long)image->width *
+                                                ((image->height + batch->tile_cols - 1) /
+                                                 batch->tile_cols);
+        packed_offset[i + 1] = packed_offset[i] + (long)(image->width + batch->kernel_order) *
+                                                      (image->height + batch->kernel_order) *
+                                                      batch->nchannels;
+    }
+    if (packed_offset[nimages] > batch->packed_capacity)
+    {
+        free(batch->packed_images);
+        batch->packed_capacity = packed_offset[nimages];
+        batch->packed_images = malloc(batch->packed_capacity * sizeof(double));
+    }
+
+    bind_team_to_cores(&batch->cores);
+    for (i = 0; i < nimages; i++)
+    {
+        pack_image_view(&images[i].image, batch->packed_images + packed_offset[i],
+                        images[i].width + batch->kernel_order,
+                        images[i].height + batch->kernel_order, batch->nchannels);
+    }
+    a.kernels_outer = batch->kernel_bytes > batch->l2_bytes / 2 &&
+                      packed_offset[nimages] * (long)sizeof(double) <= batch->l2_bytes / 2;
+    if (nimages > 0 && a.kernels_outer)
+    {
+        run_tasks(&batch->schedule, mblocks, first_tile[nimages], batch_task_run, &a);
+    }
+    else if (nimages > 0)
+    {
+        run_tasks(&batch->schedule, 1, mblocks * first_tile[nimages], batch_task_run, &a);
+    }
+
+    free(first_tile);
+    free(packed_offset);
+}
+
+void conv_batch_destroy(struct conv_batch *batch)
+{
+    free(batch->packed_kernels);
+    free(batch->packed_images);
+    free(batch);
+}
+
+/* temporal delta convolution of a video stream. Convolution is linear,
+   so the output for a frame is the previous output plus the
+   convolution of the difference between the frames. Changes of at most
+   the threshold are dropped and kept in the reference frame, so a slow
+   drift of an input is picked up once it adds up; the rest are kept
+   sparse, a list per input row, and scattered into the previous output.
+   A full convolution every refresh frames, and on any frame whose
+   changes are too dense for the scatter to win, bounds the drift */
+struct delta_entry
+{
+    int y, c;
+    double value;
+};
+
+/* fraction of peak FMA throughput the delta scatter reaches; calibrate
+   against the 'delta' harness mode */
+#define DELTA_SCATTER_EFFICIENCY 0.05
+
+struct conv_delta
+{
+    struct conv_plan *plan;
+    struct kernel_set *set;   /* the plan's kernels when created, held until destroyed */
+    float threshold;
+    int refresh;              /* full convolution every refresh frames, 0 for never */
+    int since_refresh;        /* frames since the last full convolution, -1 before any */
+    double max_density;       /* changed share of inputs above which a full convolution wins */
+    double *kernels;          /* [C][K][K][M], kernels innermost */
+    double *accum;            /* [W][H][M], the previous output */
+    float *reference;         /* [W+K][H+K][C], the inputs accum is the output of */
+    struct delta_entry *entries; /* [W+K][(H+K)*C], the changes of each input row */
+    int *row_count;
+    struct conv_delta_stats stats;
+};
+
+/* a delta stream over a plan, which it runs for full convolutions. It
+   keeps the kernels the plan has now, also for its full convolutions,
+   should the plan's be replaced while it runs */
+struct conv_delta *conv_delta_create(struct conv_plan *plan, float threshold, int refresh)
+{
+    struct conv_delta *delta = calloc(1, sizeof(struct conv_delta));
+    const struct machine_params *params = conv_machine_params();
+    int C = plan->nchannels, M = plan->nkernels, K = plan->kernel_order;
+    long padded = (long)(plan->width + K) * (plan->height + K);
+    int block_size = C * K * K * CONV_MR;
+    double entry_seconds = (double)M * K * K /
+                           (params->fma_per_second * DELTA_SCATTER_EFFICIENCY);
+    int m, k;
+
+    delta->plan = plan;
+    epoch_enter();
+    delta->set = __atomic_load_n(&plan->kernels, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&delta->set->holds, 1, __ATOMIC_ACQ_REL);
+    epoch_exit();
+    delta->threshold = threshold;
+    delta->refresh = refresh;
+    delta->since_refresh = -1;
+    delta->max_density = plan->predicted[plan->engine] / (padded * C * entry_seconds);
+    delta->kernels = malloc((long)C * K * K * M * sizeof(double));
+    for (m = 0; m < M; m++)
+    {
+        for (k = 0; k < C * K * K; k++)
+        {
+            delta->kernels[(long)k * M + m] =
+                delta->set->packed[(m / CONV_MR) * block_size + k * CONV_MR + m % CONV_MR];
+        }
+    }
+    delta->accum = malloc((long)plan->width * plan->height * M * sizeof(double));
+    delta->reference = malloc(padded * C * sizeof(float));
+    delta->entries = malloc(padded * C * sizeof(struct delta_entry));
+    delta->row_count = malloc((plan->width + K) * sizeof(int));
+    return delta;
+}
+
+/* convolve a frame in full and make it the reference */
+static void delta_refresh(struct conv_delta *delta, const struct conv_view *image,
+                          const struct conv_view *output)
+{
+    struct conv_plan *plan = delta->plan;
+    const float *in = (const float *)image->data + image->offset;
+    const float *out = (const float *)output->data + output->offset;
+    int W = plan->width, H = plan->height, C = plan->nchannels, M = plan->nkernels;
+    int K = plan->kernel_order;
+    int x, y, c, m, w, h;
+
+    plan_run(plan, delta->set, image, output);
+#pragma omp parallel for private(y, c)
+    for (x = 0; x < W + K; x++)
+    {
+        for (y = 0; y < H + K; y++)
+        {
+            for (c = 0; c < C; c++)
+            {
+                delta->reference[((long)x * (H + K) + y) * C + c] =
+                    in[x * image->strides[0] + y * image->strides[1] + c * image->strides[2]];
+            }
+        }
+    }
+#pragma omp parallel for private(h, m)
+    for (w = 0; w < W; w++)
+    {
+        for (m = 0; m < M; m++)
+        {
+            const float *out_row = out + m * output->strides[0] + w * output->strides[1];
+            double *a = delta->accum + (long)w * H * M + m;
+            for (h = 0; h < H; h++)
+            {
+                a[(long)h * M] = out_row[h * output->strides[2]];
+            }
+        }
+    }
+    delta->since_refresh = 1;
+}
+
+/* convolve the next frame of the stream into output */
+void conv_delta_execute(struct conv_delta *delta, const struct conv_view *image,
+                        const struct conv_view *output)
+{
+    struct conv_plan *plan = delta->plan;
+    const float *in = (const float *)image->data + image->offset;
+    float *out = (float *)output->data + output->offset;
+    int W = plan->width, H = plan->height, C = plan->nchannels, M = plan->nkernels;
+    int K = plan->kernel_order;
+    long row_size = (long)(H + K) * C, nonzeros = 0;
+    int x, y, c, m, w, h, i, j, e;
+
+    delta->stats.frames++;
+    bind_team_to_cores(&plan->cores);
+    if (delta->since_refresh < 0 || (delta->refresh > 0 && delta->since_refresh >= delta->refresh))
+    {
+        delta->stats.refreshes++;
+        delta_refresh(delta, image, output);
+        return;
+    }
+
+    /* the changes of each input row, applied to the reference as found */
+#pragma omp parallel for private(y, c) reduction(+ : nonzeros)
+    for (x = 0; x < W + K; x++)
+    {
+        struct delta_entry *row = delta->entries + x * row_size;
+        float *reference = delta->reference + x * row_size;
+        int count = 0;
+
+        for (y = 0; y < H + K; y++)
+        {
+            const float *pixel = in + x * image->strides[0] + y * image->strides[1];
+            for (c = 0; c < C; c++)
+            {
+                float value = pixel[c * image->strides[2]];
+                float change = value - reference[y * C + c];
+                if (fabsf(change) > delta->threshold)
+                {
+                    row[count].y = y;
+                    row[count].c = c;
+                    row[count].value = change;
+                    count++;
+                    reference[y * C + c] = value;
+                }
+            }
+        }
+        delta->row_count[x] = count;
+        nonzeros += count;
+    }
+    delta->stats.last_density = (double)nonzeros / ((W + K) * row_size);
+    delta->stats.changed += nonzeros;
+    if (delta->stats.last_density > delta->max_density)
+    {
+        delta->stats.dense_frames++;
+        delta_refresh(delta, image, output);
+        return;
+    }
+    delta->stats.nonzeros += nonzeros;
+    delta->since_refresh++;
+
+    /* each thread owns output rows, gathering the changes of the K input
+       rows under them, so no two threads add into the same outputs */
+#pragma omp parallel for schedule(dynamic) private(i, e, j, h, m)
+    for (w = 0; w < W; w++)
+    {
+        for (i = 0; i < K; i++)
+        {
+            const struct delta_entry *row = delta->entries + (w + i) * row_size;
+            for (e = 0; e < delta->row_count[w + i]; e++)
+            {
+                const double value = row[e].value;
+                int j0 = row[e].y - H + 1 > 0 ? row[e].y - H + 1 : 0;
+                int j1 = row[e].y + 1 < K ? row[e].y + 1 : K;
+                for (j = j0; j < j1; j++)
+                {
+                    const double *restrict k =
+                        delta->kernels + ((long)(row[e].c * K + i) * K + j) * M;
+                    double *restrict a = delta->accum + ((long)w * H + row[e].y - j) * M;
+#pragma omp simd
+                    for (m = 0; m < M; m++)
+                    {
+                        a[m] += value * k[m];
+                    }
+                }
+            }
+        }
+        /* the row's outputs, transposed from [H][M] */
+        for (m = 0; m < M; m++)
+        {
+            float *out_row = out + m * output->strides[0] + w * output->strides[1];
+            const double *a = delta->accum + (long)w * H * M + m;
+            for (h = 0; h < H; h++)
+            {
+                out_row[h * output->strides[2]] = a[(long)h * M];
+            }
+        }
+    }
+}
+
+void conv_delta_get_stats(const struct conv_delta *delta, struct conv_delta_stats *stats)
+{
+    *stats = delta->stats;
+}
+
+void conv_delta_destroy(struct conv_delta *delta)
+{
+    if (__atomic_sub_fetch(&delta->set->holds, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        kernel_sets_reclaim(1);
+    }
+    free(delta->kernels);
+    free(delta->accum);
+    free(delta->reference);
+    free(delta->entries);
+    free(delta->row_count);
+    free(delta);
+}
+
+/* one convolution spread over worker processes, as a stand-in for one
+   spread over machines. The coordinator splits the output into
+   rectangular blocks and ships each block's input, with its halo of the
+   K extra rows and columns the harness layout pads an image with, to a
+   worker over a Unix or loopback TCP socket, then scatters the results
+   into the output. Blocks go to whichever worker has room, and every
+   worker has CLUSTER_WINDOW blocks in flight, so the next block is
+   already in its socket while it computes the current one. Workers are
+   separate programs (a forked copy of an OpenMP program cannot run
+   OpenMP itself): the program is run again with --conv-worker, and a
+   program linking conv-harness.c calls conv_cluster_worker_main first
+   thing in its main */
+#define CLUSTER_WINDOW 2
+#define CLUSTER_BLOCKS_PER_WORKER 4
+#define CLUSTER_MAX_SHAPES 4
+
+enum wire_type
+{
+    WIRE_KERNELS,
+    WIRE_BLOCK,
+    WIRE_RESULT,
+    WIRE_QUIT
+};
+
+/* every message is a header and bytes of payload: kernels [M][C][K][K]
+   int16, a block's image [w+K][h+K][C] float or its output [M][w][h] float */
+struct wire_header
+{
+    int32_t type;
+    int32_t id;               /* block index */
+    int32_t width, height;    /* block outputs */
+    int32_t nchannels, nkernels, kernel_order;
+    int32_t unused;
+    double seconds;           /* results: worker compute time */
+    int64_t bytes;
+};
+
+/* the coordinator's end of one worker's connection */
+struct cluster_link
+{
+    int fd;
+    pid_t pid;                /* of a worker, not necessarily this link's over TCP */
+    int in_flight;            /* blocks sent and not yet returned */
+    char *out;                /* queued messages, sent from out_sent on */
+    long out_size, out_capacity, out_sent;
+    struct wire_header header; /* of the message being received */
+    char *in;
+    long in_capacity, in_received; /* header and payload bytes so far */
+    double compute_seconds;
+};
+
+struct conv_cluster
+{
+    int nworkers;
+    enum conv_transport transport;
+    struct cluster_link *links;
+    int16_t *kernels;         /* as last shipped to the workers */
+    long kernel_bytes;
+};
+
+static void write_full(int fd, const void *data, long bytes)
+{
+    const char *p = data;
+
+    while (bytes > 0)
+    {
+        ssize_t n = write(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            fprintf(stderr, "FATAL: cluster write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += n;
+        bytes -= n;
+    }
+}
+
+/* returns 0 at end of file before any byte */
+static int read_full(int fd, void *data, long bytes)
+{
+    char *p = data;
+    long got = 0;
+
+    while (got < bytes)
+    {
+        ssize_t n = read(fd, p + got, bytes - got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == 0 && got == 0)
+        {
+            return 0;
+        }
+        if (n <= 0)
+        {
+            fprintf(stderr, "FATAL: cluster read failed: %s\n",
+                    n == 0 ? "connection closed" : strerror(errno));
+            exit(1);
+        }
+        got += n;
+    }
+    return 1;
+}
+
+/* serve blocks until told to quit; each block shape gets its own plan */
+static void cluster_worker(int fd)
+{
+    struct wire_header header;
+    int16_t *kernels = NULL;
+    float *image = NULL, *output = NULL;
+    long image_capacity = 0, output_capacity = 0;
+    struct conv_plan *plans[CLUSTER_MAX_SHAPES] = {NULL};
+    int nplans = 0, i;
+
+    while (read_full(fd, &header, sizeof(header)) && header.type != WIRE_QUIT)
+    {
+        int C = header.nchannels, M = header.nkernels, K = header.kernel_order;
+
+        if (header.type == WIRE_KERNELS)
+        {
+            free(kernels);
+            kernels = malloc(header.bytes);
+            read_full(fd, kernels, header.bytes);
+            for (i = 0; i < nplans; i++)
+            {
+                conv_plan_destroy(plans[i]);
+            }
+            nplans = 0;
+        }
+        else if (header.type == WIRE_BLOCK)
+        {
+            struct conv_view image_view = {NULL, 0,
+                                           {(long)(header.height + K) * C, C, 1, 0}};
+            struct conv_view output_view = {NULL, 0,
+                                            {(long)header.width * header.height,
+                                             header.height, 1, 0}};
+            struct wire_header result = header;
+            struct conv_plan *plan = NULL;
+            double start;
+
+            if (header.bytes > image_capacity)
+            {
+                free(image);
+                image_capacity = header.bytes;
+                image = malloc(image_capacity);
+            }
+            read_full(fd, image, header.bytes);
+            result.type = WIRE_RESULT;
+            result.bytes = (long)M * header.width * header.height * sizeof(float);
+            if (result.bytes > output_capacity)
+            {
+                free(output);
+                output_capacity = result.bytes;
+                output = malloc(output_capacity);
+            }
+
+            start = now_seconds();
+            for (i = 0; i < nplans && plan == NULL; i++)
+            {
+                if (plans[i]->width == header.width && plans[i]->height == header.height)
+                {
+                    plan = plans[i];
+                }
+            }
+            if (plan == NULL)
+            {
+                struct conv_view kernel_view = {kernels, 0, {(long)C * K * K, K * K, K, 1}};
+                if (nplans == CLUSTER_MAX_SHAPES)
+                {
+                    conv_plan_destroy(plans[--nplans]);
+                }
+                plan = conv_plan_create_view(header.width, header.height, C, M, K,
+                                             &kernel_view);
+                conv_plan_set_cache(plan, NULL);
+                plans[nplans++] = plan;
+            }
+            image_view.data = image;
+            output_view.data = output;
+            conv_plan_execute_view(plan, &image_view, &output_view);
+            result.seconds = now_seconds() - start;
+
+            write_full(fd, &result, sizeof(result));
+            write_full(fd, output, result.bytes);
+        }
+    }
+    for (i = 0; i < nplans; i++)
+    {
+        conv_plan_destroy(plans[i]);
+    }
+    free(kernels);
+    free(image);
+    free(output);
+}
+
+/* run as a worker if the arguments say so:
+   --conv-worker unix <fd> <threads> or --conv-worker tcp <port> <threads>.
+   Returns -1 for any other arguments, else the worker's exit status */
+int conv_cluster_worker_main(int argc, char **argv)
+{
+    int fd;
+
+    if (argc < 5 || strcmp(argv[1], "--conv-worker") != 0)
+    {
+        return -1;
+    }
+    omp_set_num_threads(atoi(argv[4]) > 0 ? atoi(argv[4]) : 1);
+    if (strcmp(argv[2], "tcp") == 0)
+    {
+        struct sockaddr_in address;
+        int one = 1;
+
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(atoi(argv[3]));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            fprintf(stderr, "FATAL: worker cannot connect to port %s: %s\n", argv[3],
+                    strerror(errno));
+            return 1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    else
+    {
+        fd = atoi(argv[3]);
+    }
+    cluster_worker(fd);
+    close(fd);
+    return 0;
+}
+
+/* start nworkers worker processes running program (the running one if
+   NULL), connected over Unix socket pairs or loopback TCP */
+struct conv_cluster *conv_cluster_create(int nworkers, enum conv_transport transport,
+                                         const char *program)
+{
+    struct conv_cluster *cluster = calloc(1, sizeof(struct conv_cluster));
+    struct core_set cores;
+    char threads[16], endpoint[16];
+    int listener = -1, i;
+
+    cluster->nworkers = nworkers;
+    cluster->transport = transport;
+    cluster->links = calloc(nworkers, sizeof(struct cluster_link));
+    program = program != NULL ? program : "/proc/self/exe";
+    default_cores(&cores);
+    snprintf(threads, sizeof(threads), "%d", cores.ncpus / nworkers > 0
+                                                 ? cores.ncpus / nworkers : 1);
+
+    if (transport == CONV_TCP)
+    {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+            listen(listener, nworkers) < 0 ||
+            getsockname(listener, (struct sockaddr *)&address, &length) < 0)
+        {
+            fprintf(stderr, "FATAL: cannot listen on loopback: %s\n", strerror(errno));
+            exit(1);
+        }
+        snprintf(endpoint, sizeof(endpoint), "%d", ntohs(address.sin_port));
+    }
+
+    for (i = 0; i < nworkers; i++)
+    {
+        struct cluster_link *link = &cluster->links[i];
+        int pair[2] = {-1, -1};
+        char *argv[6] = {(char *)program, "--conv-worker",
+                         transport == CONV_TCP ? "tcp" : "unix", endpoint, threads, NULL};
+
+        if (transport == CONV_UNIX)
+        {
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+            {
+                fprintf(stderr, "FATAL: socketpair failed: %s\n", strerror(errno));
+                exit(1);
+            }
+            snprintf(endpoint, sizeof(endpoint), "%d", pair[1]);
+            link->fd = pair[0];
+        }
+        link->pid = fork();
+        if (link->pid == 0)
+        {
+            if (pair[1] >= 0)
+            {
+                fcntl(pair[1], F_SETFD, 0);
+            }
+            execv(program, argv);
+            _exit(127);
+        }
+        if (link->pid < 0)
+        {
+            fprintf(stderr, "FATAL: cannot start worker: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (pair[1] >= 0)
+        {
+            close(pair[1]);
+        }
+    }
+
+    if (transport == CONV_TCP)
+    {
+        for (i = 0; i < nworkers; i++)
+        {
+            struct pollfd ready = {listener, POLLIN, 0};
+            int one = 1;
+
+            if (poll(&ready, 1, 10000) <= 0 ||
+                (cluster->links[i].fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0)
+            {
+                fprintf(stderr, "FATAL: worker %d did not connect\n", i);
+                exit(1);
+            }
+            setsockopt(cluster->links[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        close(listener);
+    }
+    return cluster;
+}
+
+/* append a message to a link's queue: the header, then payload bytes
+   written by the caller at the returned pointer */
+static char *link_queue(struct cluster_link *link, const struct wire_header *header)
+{
+    long need = link->out_size + sizeof(*header) + header->bytes;
+    char *payload;
+
+    if (need > link->out_capacity)
+    {
+        link->out_capacity = need * 2;
+        link->out = realloc(link->out, link->out_capacity);
+    }
+    memcpy(link->out + link->out_size, header, sizeof(*header));
+    payload = link->out + link->out_size + sizeof(*header);
+    link->out_size = need;
+    return payload;
+}
+
+/* one output block: origin and size */
+struct cluster_block
+{
+    int w0, h0, width, height;
+};
+
+/* queue block id on a link, gathering its image with the halo */
+static void link_queue_block(struct cluster_link *link, const struct conv_view *image,
+                             const struct cluster_block *block, int id, int nchannels,
+                             int nkernels, int kernel_order)
+{
+    int padded_width = block->width + kernel_order, padded_height = block->height + kernel_order;
+    struct wire_header header = {WIRE_BLOCK, id, block->width, block->height, nchannels,
+                                 nkernels, kernel_order, 0, 0.0,
+                                 (long)padded_width * padded_height * nchannels * sizeof(float)};
+    float *payload = (float *)link_queue(link, &header);
+    const float *data = (const float *)image->data + image->offset;
+    int x, y, c;
+
+    for (x = 0; x < padded_width; x++)
+    {
+        for (y = 0; y < padded_height; y++)
+        {
+            const float *pixel = data + (block->w0 + x) * image->strides[0] +
+                                 (block->h0 + y) * image->strides[1];
+            for (c = 0; c < nchannels; c++)
+            {
+                *payload++ = pixel[c * image->strides[2]];
+            }
+        }
+    }
+    link->in_flight++;
+}
+
+/* convolve over the cluster; the image, kernels and output are views
+   as for conv_plan_execute_view and conv_plan_create_view */
+void conv_cluster_execute(struct conv_cluster *cluster, const struct conv_view *image,
+                          const struct conv_view *kernels, const struct conv_view *output,
+                          int width, int height, int nchannels, int nkernels, int kernel_order,
+                          struct conv_cluster_stats *stats)
+{
+    int target = cluster->nworkers * CLUSTER_BLOCKS_PER_WORKER;
+    int across = (int)(sqrt((double)target * width / height) + 0.5), down;
+    int block_width, block_height, nblocks, next = 0, received = 0, i, m, x, y, c;
+    struct pollfd fds[cluster->nworkers];
+    struct cluster_block *blocks;
+    const int16_t *kernel_data = (const int16_t *)kernels->data + kernels->offset;
+    int16_t *gathered, *p;
+    long kernel_bytes;
+    double start = now_seconds(), comm = 0.0, mark;
+
+    memset(stats, 0, sizeof(*stats));
+    across = across < 1 ? 1 : across > width ? width : across;
+    down = (target + across - 1) / across;
+    down = down > height ? height : down;
+    block_width = (width + across - 1) / across;
+    block_height = (height + down - 1) / down;
+    across = (width + block_width - 1) / block_width;
+    down = (height + block_height - 1) / block_height;
+    nblocks = across * down;
+    blocks = malloc(nblocks * sizeof(struct cluster_block));
+    for (i = 0; i < nblocks; i++)
+    {
+        blocks[i].w0 = i / down * block_width;
+        blocks[i].h0 = i % down * block_height;
+        blocks[i].width = width - blocks[i].w0 < block_width ? width - blocks[i].w0
+                                                               : block_width;
+        blocks[i].height = height - blocks[i].h0 < block_height ? height - blocks[i].h0
+                                                                  : block_height;
+    }
+    stats->nblocks = nblocks;
+    stats->block_width = block_width;
+    stats->block_height = block_height;
+
+    /* the kernels, if they changed since the last call, then a window
+       of blocks, for every worker */
+    mark = now_seconds();
+    kernel_bytes = (long)nkernels * nchannels * kernel_order * kernel_order * sizeof(int16_t);
+    gathered = malloc(kernel_bytes);
+    for (m = 0, p = gathered; m < nkernels; m++)
+    {
+        for (c = 0; c < nchannels; c++)
+        {
+            for (x = 0; x < kernel_order; x++)
+            {
+                for (y = 0; y < kernel_order; y++)
+                {
+                    *p++ = kernel_data[m * kernels->strides[0] + c * kernels->strides[1] +
+                                       x * kernels->strides[2] + y * kernels->strides[3]];
+                }
+            }
+        }
+    }
+    if (kernel_bytes != cluster->kernel_bytes || memcmp(gathered, cluster->kernels, kernel_bytes))
+    {
+        struct wire_header header = {WIRE_KERNELS, 0, 0, 0, nchannels, nkernels, kernel_order,
+                                     0, 0.0, kernel_bytes};
+        for (i = 0; i < cluster->nworkers; i++)
+        {
+            memcpy(link_queue(&cluster->links[i], &header), gathered, kernel_bytes);
+        }
+        free(cluster->kernels);
+        cluster->kernels = gathered;
+        cluster->kernel_bytes = kernel_bytes;
+    }
+    else
+    {
+        free(gathered);
+    }
+    for (i = 0; i < cluster->nworkers; i++)
+    {
+        cluster->links[i].compute_seconds = 0.0;
+        fcntl(cluster->links[i].fd, F_SETFL, fcntl(cluster->links[i].fd, F_GETFL) | O_NONBLOCK);
+    }
+    for (i = 0; next < nblocks && i < cluster->nworkers * CLUSTER_WINDOW; i++, next++)
+    {
+        link_queue_block(&cluster->links[i % cluster->nworkers], image, &blocks[next], next,
+                         nchannels, nkernels, kernel_order);
+    }
+    comm += now_seconds() - mark;
+
+    while (received < nblocks)
+    {
+        for (i = 0; i < cluster->nworkers; i++)
+        {
+            fds[i].fd = cluster->links[i].fd;
+            fds[i].events = POLLIN | (cluster->links[i].out_sent < cluster->links[i].out_size
+                                          ? POLLOUT : 0);
+        }
+        if (poll(fds, cluster->nworkers, -1) < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "FATAL: cluster poll failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        mark = now_seconds();
+        for (i = 0; i < cluster->nworkers; i++)
+        {
+            struct cluster_link *link = &cluster->links[i];
+
+            if (fds[i].revents & POLLOUT)
+            {
+                ssize_t n = send(link->fd, link->out + link->out_sent,
+                                 link->out_size - link->out_sent, MSG_NOSIGNAL);
+                if (n < 0 && errno != EAGAIN && errno != EINTR)
+                {
+                    fprintf(stderr, "FATAL: send to worker %d failed: %s\n", i,
+                            strerror(errno));
+                    exit(1);
+                }
+                if (n > 0)
+                {
+                    link->out_sent += n;
+                    stats->bytes_sent += n;
+                }
+                if (link->out_sent == link->out_size)
+                {
+                    link->out_sent = link->out_size = 0;
+                }
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                long header_bytes = sizeof(link->header);
+                long want = link->in_received < header_bytes
+                                ? header_bytes - link->in_received
+                                : header_bytes + link->header.bytes - link->in_received;
+                char *into = link->in_received < header_bytes
+                                 ? (char *)&link->header + link->in_received
+                                 : link->in + link->in_received - header_bytes;
+                ssize_t n = recv(link->fd, into, want, 0);
+
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+                {
+                    fprintf(stderr, "FATAL: worker %d is gone: %s\n", i,
+                            n == 0 ? "connection closed" : strerror(errno));
+                    exit(1);
+                }
+                if (n > 0)
+                {
+                    link->in_received += n;
+                    stats->bytes_received += n;
+                }
+                if (n > 0 && link->in_received == header_bytes &&
+                    link->header.bytes > link->in_capacity)
+                {
+                    free(link->in);
+                    link->in_capacity = link->header.bytes;
+                    link->in = malloc(link->in_capacity);
+                }
+                if (link->in_received >= header_bytes &&
+                    link->in_received == header_bytes + link->header.bytes)
+                {
+                    const struct cluster_block *block = &blocks[link->header.id];
+                    const float *result = (const float *)link->in;
+                    float *data = (float *)output->data + output->offset;
+
+                    for (m = 0; m < nkernels; m++)
+                    {
+                        for (x = 0; x < block->width; x++)
+                        {
+                            float *row = data + m * output->strides[0] +
+                                         (block->w0 + x) * output->strides[1] +
+                                         block->h0 * output->strides[2];
+                            for (y = 0; y < block->height; y++)
+                            {
+                                row[y * output->strides[2]] = *result++;
+                            }
+                        }
+                    }
+                    link->compute_seconds += link->header.seconds;
+                    link->in_received = 0;
+                    link->in_flight--;
+                    received++;
+                    if (next < nblocks)
+                    {
+                        link_queue_block(link, image, &blocks[next], next, nchannels, nkernels,
+                                         kernel_order);
+                        next++;
+                    }
+                }
+            }
+        }
+        comm += now_seconds() - mark;
+    }
+
+    for (i = 0; i < cluster->nworkers; i++)
+    {
+        struct cluster_link *link = &cluster->links[i];
+        fcntl(link->fd, F_SETFL, fcntl(link->fd, F_GETFL) & ~O_NONBLOCK);
+        stats->compute_seconds += link->compute_seconds;
+        if (link->compute_seconds > stats->max_worker_seconds)
+        {
+            stats->max_worker_seconds = link->compute_seconds;
+        }
+    }
+    stats->comm_seconds = comm;
+    stats->wall_seconds = now_seconds() - start;
+    free(blocks);
+}
+
+void conv_cluster_destroy(struct conv_cluster *cluster)
+{
+    struct wire_header quit = {WIRE_QUIT};
+    int i;
+
+    /* every worker is told to quit before any is waited for */
+    for (i = 0; i < cluster->nworkers; i++)
+    {
+        write_full(cluster->links[i].fd, &quit, sizeof(quit));
+        close(cluster->links[i].fd);
+        free(cluster->links[i].out);
+        free(cluster->links[i].in);
+    }
+    for (i = 0; i < cluster->nworkers; i++)
+    {
+        waitpid(cluster->links[i].pid, NULL, 0);
+    }
+    free(cluster->links);
+    free(cluster->kernels);
+    free(cluster);
+}
+
+/* frames of a raw image file, [W+K][H+K][C] floats each, read ahead of
+   the convolution so the disk and the cores are busy at once. Reads go
+   through io_uring, set up with raw system calls, or through a pool of
+   threads calling pread where io_uring is not available. Under
+   O_DIRECT the page cache is skipped and a read must cover whole
+   aligned blocks, so every read spans the blocks around its frame and
+   the frame is handed out from inside the buffer */
+#define READER_ALIGN 4096
+#define READER_MAX_THREADS 8
+
+enum reader_state
+{
+    SLOT_FREE,
+    SLOT_QUEUED,              /* waiting for a pool thread */
+    SLOT_READING,
+    SLOT_READY
+};
+
+/* one frame's read: its buffer and the file range it covers */
+struct reader_slot
+{
+    char *buffer;
+    long frame;
+    long start, length;       /* aligned under O_DIRECT */
+    long done;                /* bytes read so far */
+    int state;
+};
+
+/* the rings shared with the kernel, mapped as io_uring_setup describes */
+struct uring
+{
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_bytes, cq_ring_bytes, sqes_bytes;
+    unsigned to_submit;
+};
+
+struct conv_reader
+{
+    int fd;
+    long frame_bytes, nframes;
+    int depth;
+    struct reader_slot *slots;
+    long next_read;           /* next frame to queue a read for */
+    long next_frame;          /* next frame to hand out */
+    struct uring ring;
+    pthread_t threads[READER_MAX_THREADS];
+    int nthreads, stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t queued, ready;
+    double opened;
+    struct conv_reader_stats stats;
+};
+
+/* a ring of at least entries slots, or -1 if the kernel has no io_uring */
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+    ring->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sq_ring_bytes = ring->cq_ring_bytes = ring->sq_ring_bytes > ring->cq_ring_bytes
+                                                        ? ring->sq_ring_bytes
+                                                        : ring->cq_ring_bytes;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_bytes, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+                        ? ring->sq_ring
+                        : mmap(NULL, ring->cq_ring_bytes, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_bytes);
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_bytes);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_bytes);
+    close(ring->fd);
+}
+
+/* queue the read of the rest of slot index; io_uring_enter submits it */
+static void uring_queue_read(struct conv_reader *reader, int index)
+{
+    struct reader_slot *slot = &reader->slots[index];
+    unsigned tail = *reader->ring.sq_tail, entry = tail & *reader->ring.sq_mask;
+    struct io_uring_sqe *sqe = &reader->ring.sqes[entry];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reader->fd;
+    sqe->off = slot->start + slot->done;
+    sqe->addr = (uint64_t)(uintptr_t)(slot->buffer + slot->done);
+    sqe->len = slot->length - slot->done;
+    sqe->user_data = index;
+    reader->ring.sq_array[entry] = entry;
+    __atomic_store_n(reader->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    reader->ring.to_submit++;
+}
+
+/* submit what is queued and, if wait, block for at least one completion */
+static void uring_enter(struct conv_reader *reader, int wait)
+{
+    int submitted;
+
+    do
+    {
+        submitted = syscall(__NR_io_uring_enter, reader->ring.fd, reader->ring.to_submit,
+                            wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted < 0)
+    {
+        fprintf(stderr, "FATAL: io_uring_enter failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    reader->ring.to_submit -= submitted;
+}
+
+/* account the completions the kernel has posted, requeueing short reads */
+static void uring_reap(struct conv_reader *reader)
+{
+    unsigned head = *reader->ring.cq_head;
+    unsigned tail = __atomic_load_n(reader->ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &reader->ring.cqes[head & *reader->ring.cq_mask];
+        struct reader_slot *slot = &reader->slots[cqe->user_data];
+
+        if (cqe->res < 0)
+        {
+            fprintf(stderr, "FATAL: read of frame %ld failed: %s\n", slot->frame,
+                    strerror(-cqe->res));
+            exit(1);
+        }
+        slot->done += cqe->res;
+        if (cqe->res > 0 && slot->done < slot->length)
+        {
+            uring_queue_read(reader, (int)cqe->user_data);
+        }
+        else
+        {
+            slot->state = SLOT_READY;
+        }
+    }
+    __atomic_store_n(reader->ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* a pool thread: read queued slots until the reader closes */
+static void *reader_thread(void *arg)
+{
+    struct conv_reader *reader = arg;
+    int i;
+
+    pthread_mutex_lock(&reader->lock);
+    while (!reader->stopping)
+    {
+        struct reader_slot *slot = NULL;
+
+        /* the queued frame that is needed first */
+        for (i = 0; i < reader->depth; i++)
+        {
+            if (reader->slots[i].state == SLOT_QUEUED &&
+                (slot == NULL || reader->slots[i].frame < slot->frame))
+            {
+                slot = &reader->slots[i];
+            }
+        }
+        if (slot == NULL)
+        {
+            pthread_cond_wait(&reader->queued, &reader->lock);
+            continue;
+        }
+        slot->state = SLOT_READING;
+        pthread_mutex_unlock(&reader->lock);
+
+        while (slot->done < slot->length)
+        {
+            ssize_t n = pread(reader->fd, slot->buffer + slot->done, slot->length - slot->done,
+                              slot->start + slot->done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                fprintf(stderr, "FATAL: read of frame %ld failed: %s\n", slot->frame,
+                        strerror(errno));
+                exit(1);
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            slot->done += n;
+        }
+
+        pthread_mutex_lock(&reader->lock);
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&reader->ready);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+
+/* start reads into every free slot, in frame order */
+static void reader_fill(struct conv_reader *reader)
+{
+    int queued = 0;
+
+    while (reader->next_read < reader->nframes &&
+           reader->slots[reader->next_read % reader->depth].state == SLOT_FREE)
+    {
+        int index = reader->next_read % reader->depth;
+        struct reader_slot *slot = &reader->slots[index];
+        long offset = reader->next_read * reader->frame_bytes;
+
+        slot->frame = reader->next_read++;
+        slot->start = reader->stats.direct ? offset / READER_ALIGN * READER_ALIGN : offset;
+        slot->length = reader->stats.direct
+                           ? (offset + reader->frame_bytes + READER_ALIGN - 1) / READER_ALIGN *
+                                     READER_ALIGN - slot->start
+                           : reader->frame_bytes;
+        slot->done = 0;
+        if (reader->stats.uring)
+        {
+            slot->state = SLOT_READING;
+            uring_queue_read(reader, index);
+        }
+        else
+        {
+            slot->state = SLOT_QUEUED;
+        }
+        queued++;
+    }
+    if (queued > 0 && reader->stats.uring)
+    {
+        uring_enter(reader, 0);
+    }
+    else if (queued > 0)
+    {
+        pthread_cond_broadcast(&reader->queued);
+    }
+}
+
+/* read the file at path as frames of frame_bytes, keeping depth reads
+   in flight */
+struct conv_reader *conv_reader_open(const char *path, long frame_bytes, int depth, int flags)
+{
+    struct conv_reader *reader = calloc(1, sizeof(struct conv_reader));
+    long buffer_bytes = (frame_bytes + 2 * READER_ALIGN - 1) / READER_ALIGN * READER_ALIGN;
+    struct stat info;
+    int i;
+
+    reader->opened = now_seconds();
+    reader->frame_bytes = frame_bytes;
+    reader->depth = depth > 0 ? depth : 1;
+    reader->fd = -1;
+    if (flags & CONV_READ_DIRECT)
+    {
+        /* tmpfs and some others refuse O_DIRECT: read through the cache */
+        reader->fd = open(path, O_RDONLY | O_DIRECT);
+        reader->stats.direct = reader->fd >= 0;
+    }
+    if (reader->fd < 0)
+    {
+        reader->fd = open(path, O_RDONLY);
+    }
+    if (reader->fd < 0 || fstat(reader->fd, &info) < 0)
+    {
+        fprintf(stderr, "FATAL: cannot read %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    reader->nframes = info.st_size / frame_bytes;
+
+    reader->slots = calloc(reader->depth, sizeof(struct reader_slot));
+    for (i = 0; i < reader->depth; i++)
+    {
+        if (posix_memalign((void **)&reader->slots[i].buffer, READER_ALIGN, buffer_bytes) != 0)
+        {
+            fprintf(stderr, "FATAL: cannot allocate %d read buffers of %ld bytes\n",
+                    reader->depth, buffer_bytes);
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->queued, NULL);
+    pthread_cond_init(&reader->ready, NULL);
+
+    reader->stats.uring = !(flags & CONV_READ_THREADS) && uring_setup(&reader->ring,
+                                                                      reader->depth) == 0;
+    if (!reader->stats.uring)
+    {
+        reader->nthreads = reader->depth < READER_MAX_THREADS ? reader->depth
+                                                              : READER_MAX_THREADS;
+        for (i = 0; i < reader->nthreads; i++)
+        {
+            pthread_create(&reader->threads[i], NULL, reader_thread, reader);
+        }
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    reader_fill(reader);
+    pthread_mutex_unlock(&reader->lock);
+    return reader;
+}
+
+/* the next frame, NULL after the last; it stays valid until the next call */
+const float *conv_reader_next(struct conv_reader *reader)
+{
+    struct reader_slot *slot;
+    double start = now_seconds();
+
+    pthread_mutex_lock(&reader->lock);
+    if (reader->next_frame > 0)
+    {
+        reader->slots[(reader->next_frame - 1) % reader->depth].state = SLOT_FREE;
+        reader_fill(reader);
+    }
+    if (reader->next_frame >= reader->nframes)
+    {
+        pthread_mutex_unlock(&reader->lock);
+        reader->stats.seconds = now_seconds() - reader->opened;
+        return NULL;
+    }
+    slot = &reader->slots[reader->next_frame % reader->depth];
+    while (slot->state != SLOT_READY)
+    {
+        if (reader->stats.uring)
+        {
+            uring_reap(reader);
+            if (slot->state != SLOT_READY)
+            {
+                uring_enter(reader, 1);
+            }
+        }
+        else
+        {
+            pthread_cond_wait(&reader->ready, &reader->lock);
+        }
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    if (slot->start + slot->done < (reader->next_frame + 1) * reader->frame_bytes)
+    {
+        fprintf(stderr, "FATAL: frame %ld is cut short\n", reader->next_frame);
+        exit(1);
+    }
+    reader->stats.frames++;
+    reader->stats.bytes += slot->done;
+    reader->stats.wait_seconds += now_seconds() - start;
+    reader->stats.seconds = now_seconds() - reader->opened;
+    return (const float *)(slot->buffer + (reader->next_frame++ * reader->frame_bytes -
+                                           slot->start));
+}
+
+long conv_reader_frames(const struct conv_reader *reader)
+{
+    return reader->nframes;
+}
+
+void conv_reader_get_stats(const struct conv_reader *reader, struct conv_reader_stats *stats)
+{
+    *stats = reader->stats;
+}
+
+void conv_reader_close(struct conv_reader *reader)
+{
+    int i;
+
+    pthread_mutex_lock(&reader->lock);
+    reader->stopping = 1;
+    pthread_cond_broadcast(&reader->queued);
+    pthread_mutex_unlock(&reader->lock);
+    for (i = 0; i < reader->nthreads; i++)
+    {
+        pthread_join(reader->threads[i], NULL);
+    }
+    if (reader->stats.uring)
+    {
+        /* the kernel may still be writing into buffers of skipped frames */
+        for (i = 0; i < reader->depth; i++)
+        {
+            while (reader->slots[i].state == SLOT_READING)
+            {
+                uring_reap(reader);
+                if (reader->slots[i].state == SLOT_READING)
+                {
+                    uring_enter(reader, 1);
+                }
+            }
+        }
+        uring_teardown(&reader->ring);
+    }
+    for (i = 0; i < reader->depth; i++)
+    {
+        free(reader->slots[i].buffer);
+    }
+    free(reader->slots);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->queued);
+    pthread_cond_destroy(&reader->ready);
+    close(reader->fd);
+    free(reader);
+}
+
+/* a chunked, compressed file of a 3D float tensor: the tensor is cut
+   into chunks of whole rows of its first dimension, each compressed on
+   its own, and an index of where every chunk lies lets a band of rows
+   be loaded without reading the rest. The codec is an LZ77 of the LZ4
+   block kind, run either on the floats as they are, which suits runs of
+   zeros, or after a byte shuffle, so that the exponent bytes and the
+   often zero low mantissa bytes each make runs of their own; every chunk
+   keeps whichever is smaller. Chunks are compressed and decompressed in
+   parallel */
+#define TENSOR_MAGIC "CONVTZ01"
+#define TENSOR_CHUNK_BYTES 65536
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+struct tensor_file_header
+{
+    char magic[8];
+    int32_t dims[3];
+    int32_t chunk_rows;
+    int64_t nchunks;
+};
+
+enum tensor_codec
+{
+    CODEC_STORED,
+    CODEC_LZ,
+    CODEC_SHUFFLE_LZ
+};
+
+struct tensor_chunk
+{
+    int64_t offset;
+    int32_t bytes;
+    int32_t codec;
+};
+
+struct conv_tensor_file
+{
+    int fd;
+    int dims[3];
+    int chunk_rows;
+    long nchunks;
+    struct tensor_chunk *index;
+};
+
+static void write_full_at(int fd, const void *data, long bytes, long offset)
+{
+    const char *p = data;
+
+    while (bytes > 0)
+    {
+        ssize_t n = pwrite(fd, p, bytes, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            fprintf(stderr, "FATAL: tensor file write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += n;
+        bytes -= n;
+        offset += n;
+    }
+}
+
+/* the most bytes lz_compress can write for n input bytes */
+static long lz_bound(long n)
+{
+    return n + n / 255 + 16;
+}
+
+/* the length of a literal run or match, continued in bytes of 255 after
+   a nibble of 15 */
+static uint8_t *lz_put_length(uint8_t *out, long length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+/* emit literals anchor .. anchor+nliterals, then a match of length at
+   offset back (a length of 0: literals only, the end of the block) */
+static uint8_t *lz_put_sequence(uint8_t *out, const uint8_t *anchor, long nliterals,
+                                long offset, long length)
+{
+    uint8_t *token = out++;
+    long match = length > 0 ? length - LZ_MIN_MATCH : 0;
+
+    *token = (uint8_t)((nliterals < 15 ? nliterals : 15) << 4 | (match < 15 ? match : 15));
+    if (nliterals >= 15)
+    {
+        out = lz_put_length(out, nliterals - 15);
+    }
+    memcpy(out, anchor, nliterals);
+    out += nliterals;
+    if (length > 0)
+    {
+        *out++ = (uint8_t)offset;
+        *out++ = (uint8_t)(offset >> 8);
+        if (match >= 15)
+        {
+            out = lz_put_length(out, match - 15);
+        }
+    }
+    return out;
+}
+
+/* compress n bytes into out, which holds lz_bound(n); returns the size */
+static long lz_compress(const uint8_t *in, long n, uint8_t *out)
+{
+    int32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = in, *anchor = in, *end = in + n;
+    uint8_t *op = out;
+
+    memset(table, 0xff, sizeof(table));
+    while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH)
+    {
+        uint32_t sequence, previous;
+        uint32_t hash;
+        const uint8_t *ref;
+        long length;
+
+        memcpy(&sequence, ip, 4);
+        hash = sequence * 2654435761u >> (32 - LZ_HASH_BITS);
+        ref = table[hash] >= 0 ? in + table[hash] : NULL;
+        table[hash] = (int32_t)(ip - in);
+        if (ref != NULL)
+        {
+            memcpy(&previous, ref, 4);
+        }
+        if (ref == NULL || ip - ref > LZ_MAX_OFFSET || previous != sequence)
+        {
+            /* skip faster through data that does not repeat */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        for (length = LZ_MIN_MATCH; ip + length < end && ref[length] == ip[length]; length++)
+        {
+        }
+        op = lz_put_sequence(op, anchor, ip - anchor, ip - ref, length);
+        ip += length;
+        anchor = ip;
+    }
+    op = lz_put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - out;
+}
+
+/* decompress n bytes of in into exactly raw bytes of out */
+static void lz_decompress(const uint8_t *in, long n, uint8_t *out, long raw)
+{
+    const uint8_t *ip = in, *in_end = in + n;
+    uint8_t *op = out, *out_end = out + raw;
+
+    while (ip < in_end)
+    {
+        int token = *ip++;
+        long nliterals = token >> 4, length = token & 15, offset;
+
+        if (nliterals == 15)
+        {
+            for (; ip < in_end && *ip == 255; ip++)
+            {
+                nliterals += 255;
+            }
+            nliterals += ip < in_end ? *ip++ : 0;
+        }
+        if (nliterals > in_end - ip || nliterals > out_end - op)
+        {
+            break;
+        }
+        memcpy(op, ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+        if (ip == in_end)
+        {
+            break;
+        }
+
+        offset = in_end - ip >= 2 ? ip[0] | ip[1] << 8 : 0;
+        ip += 2;
+        if (length == 15)
+        {
+            for (; ip < in_end && *ip == 255; ip++)
+            {
+                length += 255;
+            }
+            length += ip < in_end ? *ip++ : 0;
+        }
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - out || length > out_end - op)
+        {
+            break;
+        }
+        if (offset >= length)
+        {
+            memcpy(op, op - offset, length);
+            op += length;
+        }
+        else
+        {
+            /* the match overlaps what it writes: a repeating pattern */
+            for (; length > 0; length--, op++)
+            {
+                *op = op[-offset];
+            }
+        }
+    }
+    if (ip != in_end || op != out_end)
+    {
+        fprintf(stderr, "FATAL: corrupt compressed chunk\n");
+        exit(1);
+    }
+}
+
+/* bytes of every float together: byte b of element i goes to b*n+i */
+static void shuffle_floats(const float *in, long n, uint8_t *out)
+{
+    const uint8_t *bytes = (const uint8_t *)in;
+    long i;
+    int b;
+
+    for (i = 0; i < n; i++)
+    {
+        for (b = 0; b < 4; b++)
+        {
+            out[b * n + i] = bytes[i * 4 + b];
+        }
+    }
+}
+
+static void unshuffle_floats(const uint8_t *in, long n, float *out)
+{
+    uint8_t *bytes = (uint8_t *)out;
+    long i;
+    int b;
+
+    for (i = 0; i < n; i++)
+    {
+        for (b = 0; b < 4; b++)
+        {
+            bytes[i * 4 + b] = in[b * n + i];
+        }
+    }
+}
+
+/* write the dim0 x dim1 x dim2 tensor of a view to path in chunks of
+   chunk_rows rows (0: about TENSOR_CHUNK_BYTES each); returns the file size */
+long conv_tensor_save(const char *path, const struct conv_view *tensor, int dim0, int dim1,
+                      int dim2, int chunk_rows)
+{
+    long row_elements = (long)dim1 * dim2;
+    struct tensor_file_header header;
+    struct tensor_chunk *index;
+    int batch = 2 * omp_get_max_threads();
+    uint8_t **compressed = malloc(batch * sizeof(uint8_t *));
+    long *sizes = malloc(batch * sizeof(long));
+    int *codecs = malloc(batch * sizeof(int));
+    long offset, c0;
+    int fd, i;
+
+    if (chunk_rows <= 0)
+    {
+        chunk_rows = TENSOR_CHUNK_BYTES / (row_elements * (long)sizeof(float));
+        chunk_rows = chunk_rows < 1 ? 1 : chunk_rows > dim0 ? dim0 : chunk_rows;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TENSOR_MAGIC, 8);
+    header.dims[0] = dim0;
+    header.dims[1] = dim1;
+    header.dims[2] = dim2;
+    header.chunk_rows = chunk_rows;
+    header.nchunks = (dim0 + chunk_rows - 1) / chunk_rows;
+    index = calloc(header.nchunks, sizeof(struct tensor_chunk));
+    for (i = 0; i < batch; i++)
+    {
+        compressed[i] = malloc(lz_bound(chunk_rows * row_elements * (long)sizeof(float)));
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "FATAL: cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    offset = sizeof(header) + header.nchunks * sizeof(struct tensor_chunk);
+    for (c0 = 0; c0 < header.nchunks; c0 += batch)
+    {
+        int count = header.nchunks - c0 < batch ? (int)(header.nchunks - c0) : batch;
+
+#pragma omp parallel for schedule(dynamic)
+        for (i = 0; i < count; i++)
+        {
+            long row0 = (c0 + i) * chunk_rows;
+            long rows = dim0 - row0 < chunk_rows ? dim0 - row0 : chunk_rows;
+            long n = rows * row_elements, j;
+            float *gathered = malloc(n * sizeof(float));
+            uint8_t *shuffled = malloc(n * sizeof(float));
+            uint8_t *plain = malloc(lz_bound(n * sizeof(float)));
+            long plain_bytes;
+            const float *data = (const float *)tensor->data + tensor->offset;
+            int x, y, z;
+
+            for (x = 0, j = 0; x < rows; x++)
+            {
+                for (y = 0; y < dim1; y++)
+                {
+                    for (z = 0; z < dim2; z++)
+                    {
+                        gathered[j++] = data[(row0 + x) * tensor->strides[0] +
+                                             y * tensor->strides[1] + z * tensor->strides[2]];
+                    }
+                }
+            }
+            shuffle_floats(gathered, n, shuffled);
+            sizes[i] = lz_compress(shuffled, n * sizeof(float), compressed[i]);
+            codecs[i] = CODEC_SHUFFLE_LZ;
+            plain_bytes = lz_compress((const uint8_t *)gathered, n * sizeof(float), plain);
+            if (plain_bytes < sizes[i])
+            {
+                memcpy(compressed[i], plain, plain_bytes);
+                sizes[i] = plain_bytes;
+                codecs[i] = CODEC_LZ;
+            }
+            if (sizes[i] >= n * (long)sizeof(float))
+            {
+                memcpy(compressed[i], gathered, n * sizeof(float));
+                sizes[i] = n * sizeof(float);
+                codecs[i] = CODEC_STORED;
+            }
+            free(gathered);
+            free(shuffled);
+            free(plain);
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            write_full_at(fd, compressed[i], sizes[i], offset);
+            index[c0 + i].offset = offset;
+            index[c0 + i].bytes = (int32_t)sizes[i];
+            index[c0 + i].codec = codecs[i];
+            offset += sizes[i];
+        }
+    }
+    write_full_at(fd, &header, sizeof(header), 0);
+    write_full_at(fd, index, header.nchunks * sizeof(struct tensor_chunk), sizeof(header));
+    close(fd);
+
+    for (i = 0; i < batch; i++)
+    {
+        free(compressed[i]);
+    }
+    free(compressed);
+    free(sizes);
+    free(codecs);
+    free(index);
+    return offset;
+}
+
+struct conv_tensor_file *conv_tensor_open(const char *path)
+{
+    struct conv_tensor_file *file = calloc(1, sizeof(struct conv_tensor_file));
+    struct tensor_file_header header;
+
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+    {
+        fprintf(stderr, "FATAL: cannot read %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (pread(file->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, TENSOR_MAGIC, 8) != 0 || header.chunk_rows < 1 ||
+        header.nchunks != (header.dims[0] + header.chunk_rows - 1) / header.chunk_rows)
+    {
+        fprintf(stderr, "FATAL: %s is not a tensor file\n", path);
+        exit(1);
+    }
+    memcpy(file->dims, header.dims, sizeof(file->dims));
+    file->chunk_rows = header.chunk_rows;
+    file->nchunks = header.nchunks;
+    file->index = malloc(file->nchunks * sizeof(struct tensor_chunk));
+    if (pread(file->fd, file->index, file->nchunks * sizeof(struct tensor_chunk),
+              sizeof(header)) != (ssize_t)(file->nchunks * sizeof(struct tensor_chunk)))
+    {
+        fprintf(stderr, "FATAL: the chunk index of %s is cut short\n", path);
+        exit(1);
+    }
+    return file;
+}
+
+void conv_tensor_dims(const struct conv_tensor_file *file, int dims[3])
+{
+    memcpy(dims, file->dims, sizeof(file->dims));
+}
+
+/* rows row0 .. row0+nrows-1 into a view of [nrows][dim1][dim2], reading
+   and decompressing only the chunks they are in, in parallel */
+void conv_tensor_load_rows(struct conv_tensor_file *file, int row0, int nrows,
+                           const struct conv_view *dest)
+{
+    long row_elements = (long)file->dims[1] * file->dims[2];
+    long first = row0 / file->chunk_rows, last = (row0 + nrows - 1) / file->chunk_rows;
+    long c;
+
+#pragma omp parallel for schedule(dynamic)
+    for (c = first; c <= last; c++)
+    {
+        long chunk_row0 = c * file->chunk_rows;
+        long rows = file->dims[0] - chunk_row0 < file->chunk_rows ? file->dims[0] - chunk_row0
+                                                                  : file->chunk_rows;
+        long n = rows * row_elements, j;
+        long bytes = file->index[c].bytes;
+        uint8_t *compressed = malloc(bytes);
+        uint8_t *shuffled = malloc(n * sizeof(float));
+        float *chunk = malloc(n * sizeof(float));
+        float *data = (float *)dest->data + dest->offset;
+        long x0 = row0 > chunk_row0 ? row0 - chunk_row0 : 0;
+        long x1 = row0 + nrows < chunk_row0 + rows ? row0 + nrows - chunk_row0 : rows;
+        long x;
+        int y, z;
+
+        if (pread(file->fd, compressed, bytes, file->index[c].offset) != bytes)
+        {
+            fprintf(stderr, "FATAL: chunk %ld of a tensor file is cut short\n", c);
+            exit(1);
+        }
+        if (file->index[c].codec == CODEC_STORED && bytes == n * (long)sizeof(float))
+        {
+            memcpy(chunk, compressed, bytes);
+        }
+        else if (file->index[c].codec == CODEC_LZ)
+        {
+            lz_decompress(compressed, bytes, (uint8_t *)chunk, n * sizeof(float));
+        }
+        else if (file->index[c].codec == CODEC_SHUFFLE_LZ)
+        {
+            lz_decompress(compressed, bytes, shuffled, n * sizeof(float));
+            unshuffle_floats(shuffled, n, chunk);
+        }
+        else
+        {
+            fprintf(stderr, "FATAL: chunk %ld of a tensor file has an unknown codec\n", c);
+            exit(1);
+        }
+        for (x = x0; x < x1; x++)
+        {
+            float *row = data + (chunk_row0 + x - row0) * dest->strides[0];
+            for (y = 0, j = x * row_elements; y < file->dims[1]; y++)
+            {
+                for (z = 0; z < file->dims[2]; z++)
+                {
+                    row[y * dest->strides[1] + z * dest->strides[2]] = chunk[j++];
+                }
+            }
+        }
+        free(compressed);
+        free(shuffled);
+        free(chunk);
+    }
+}
+
+/* convolve the [W+K][H+K][C] image of a tensor file, a band of output
+   rows at a time: each band's image rows, halo included, are loaded
+   over the previous band's, so the image is never whole in memory. The
+   chunk a halo falls in is decompressed for both bands, which bands of
+   at least 8 chunks keep cheap */
+void conv_tensor_execute(struct conv_tensor_file *file, const struct conv_view *kernels,
+                         int nkernels, int kernel_order, const struct conv_view *output)
+{
+    int width = file->dims[0] - kernel_order, height = file->dims[1] - kernel_order;
+    int nchannels = file->dims[2];
+    int band_rows = file->chunk_rows * (2 * omp_get_max_threads() > 8
+                                            ? 2 * omp_get_max_threads() : 8);
+    long row_elements = (long)file->dims[1] * nchannels;
+    float *band = malloc((band_rows + kernel_order) * row_elements * sizeof(float));
+    struct conv_view band_view = {band, 0, {row_elements, nchannels, 1, 0}};
+    struct conv_plan *plans[2] = {NULL, NULL};
+    int w0;
+
+    band_rows = band_rows < width ? band_rows : width;
+    for (w0 = 0; w0 < width; w0 += band_rows)
+    {
+        int rows = width - w0 < band_rows ? width - w0 : band_rows;
+        int which = rows != band_rows;
+        struct conv_view band_output = conv_view_slice(*output, 1, w0);
+
+        if (plans[which] == NULL)
+        {
+            plans[which] = conv_plan_create_view(rows, height, nchannels, nkernels,
+                                                 kernel_order, kernels);
+            conv_plan_set_cache(plans[which], NULL);
+        }
+        conv_tensor_load_rows(file, w0, rows + kernel_order, &band_view);
+        conv_plan_execute_view(plans[which], &band_view, &band_output);
+    }
+    if (plans[0] != NULL)
+    {
+        conv_plan_destroy(plans[0]);
+    }
+    if (plans[1] != NULL)
+    {
+        conv_plan_destroy(plans[1]);
+    }
+    free(band);
+}
+
+void conv_tensor_close(struct conv_tensor_file *file)
+{
+    close(file->fd);
+    free(file->index);
+    free(file);
+}
+
+/* a network of convolutions, each layer reading any earlier tensor:
+   tensor 0 is the network's input, tensor i+1 the output of layer i.
+   Every activation lives in one arena. A tensor is live from the layer
+   that writes it to the last layer that reads it (to the end, if none
+   does), and tensors whose lifetimes do not meet may share bytes. The
+   offsets are placed greedily, largest tensor first, each at the lowest
+   offset clear of the tensors already placed that it is live with.
+   Activations are [C][X][Y], as plans write their outputs, and the
+   next layer reads one through a strided image view, so no layer copies
+   its input or output.
+
+   Layers are also grouped into waves: a layer's wave is one more than
+   that of the layer writing its input, so the layers of a wave are
+   independent branches. Under CONV_NET_INTER or CONV_NET_AUTO the net
+   runs wave by wave, and the layers of a wave may run concurrently,
+   each on its own worker thread and share of the cores instead of one
+   after another on all of them; lifetimes are then counted in waves, so
+   tensors of concurrent layers never share bytes */
+#define NET_ALIGN 64
+
+/* starting and joining a team for one layer, and waking the workers of
+   a wave; the cost model predicts compute and memory time only */
+#define NET_TEAM_SECONDS 10e-6
+#define NET_DISPATCH_SECONDS 20e-6
+
+/* AUTO runs a layer concurrently only if it uses less than this share of
+   the cores it would be given alone */
+#define NET_SCALING_EFFICIENCY 0.75
+
+struct net_layer
+{
+    int input;                /* tensor read */
+    int width, height, nchannels, nkernels, kernel_order;
+    struct conv_plan *plan;
+    int wave;
+    int slot;                 /* worker running it, -1 for the caller on all cores */
+    int ncores;
+    double predicted;         /* seconds on its ncores */
+    double seconds;           /* measured, over calls */
+    long calls;
+};
+
+struct net_tensor
+{
+    int channels, rows, cols;
+    long bytes, offset;       /* in the arena */
+    int first, last;          /* layers (waves, if concurrent) it is live over */
+};
+
+struct conv_net
+{
+    int nlayers, capacity;
+    struct net_layer *layers;
+    struct net_tensor *tensors;
+    char *arena;              /* NULL until planned for the current layers */
+    struct conv_net_stats stats;
+    enum conv_net_parallelism parallelism;
+    int nwaves;
+
+    /* workers for the concurrent layers of a wave, woken by generation */
+    int nworkers, nstarted;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    long generation;
+    int job_wave, pending, stopping;
+    const struct conv_view *job_image;
+};
+
+struct conv_net *conv_net_create(int padded_width, int padded_height, int nchannels)
+{
+    struct conv_net *net = calloc(1, sizeof(struct conv_net));
+
+    net->capacity = 8;
+    net->layers = malloc(net->capacity * sizeof(struct net_layer));
+    net->tensors = calloc(net->capacity + 1, sizeof(struct net_tensor));
+    net->tensors[0].channels = nchannels;
+    net->tensors[0].rows = padded_width;
+    net->tensors[0].cols = padded_height;
+    net->parallelism = CONV_NET_INTRA;
+    pthread_mutex_init(&net->lock, NULL);
+    pthread_cond_init(&net->start, NULL);
+    pthread_cond_init(&net->done, NULL);
+    return net;
+}
+
+/* a layer of nkernels kernels of kernel_order reading tensor input as its
+   [W+K][H+K][C] image; returns the tensor of its [M][W][H] output */
+int conv_net_add(struct conv_net *net, int input, int nkernels, int kernel_order,
+                 const struct conv_view *kernels)
+{
+    struct net_layer *layer;
+    struct net_tensor *in, *out;
+
+    if (input < 0 || input > net->nlayers)
+    {
+        fprintf(stderr, "FATAL: layer %d cannot read tensor %d\n", net->nlayers, input);
+        exit(1);
+    }
+    in = &net->tensors[input];
+    if (in->rows <= kernel_order || in->cols <= kernel_order)
+    {
+        fprintf(stderr, "FATAL: a %d x %d tensor is too small for kernels of order %d\n",
+                in->rows, in->cols, kernel_order);
+        exit(1);
+    }
+    if (net->nlayers == net->capacity)
+    {
+        net->capacity *= 2;
+        net->layers = realloc(net->layers, net->capacity * sizeof(struct net_layer));
+        net->tensors = realloc(net->tensors, (net->capacity + 1) * sizeof(struct net_tensor));
+    }
+    layer = &net->layers[net->nlayers];
+    in = &net->tensors[input];
+    out = &net->tensors[net->nlayers + 1];
+    memset(layer, 0, sizeof(*layer));
+    layer->input = input;
+    layer->width = in->rows - kernel_order;
+    layer->height = in->cols - kernel_order;
+    layer->nchannels = in->channels;
+    layer->nkernels = nkernels;
+    layer->kernel_order = kernel_order;
+    layer->plan = conv_plan_create_view(layer->width, layer->height, layer->nchannels,
+                                        nkernels, kernel_order, kernels);
+    memset(out, 0, sizeof(*out));
+    out->channels = nkernels;
+    out->rows = layer->width;
+    out->cols = layer->height;
+    out->bytes = ((long)nkernels * layer->width * layer->height * sizeof(float) + NET_ALIGN - 1) /
+                 NET_ALIGN * NET_ALIGN;
+    free(net->arena);
+    net->arena = NULL;
+    return ++net->nlayers;
+}
+
+/* how the layers of a wave share the cores; replans the net and clears
+   the profile */
+void conv_net_set_parallelism(struct conv_net *net, enum conv_net_parallelism parallelism)
+{
+    net->parallelism = parallelism;
+    free(net->arena);
+    net->arena = NULL;
+}
+
+/* predicted seconds of a layer on ncores. The cost model's time is for
+   the whole team; spread over the row tasks of the direct engine (the
+   other engines split about as finely), a layer with few tasks per core
+   stops scaling, and every layer pays for starting its team */
+static double predict_layer_seconds(const struct net_layer *layer, int ncores)
+{
+    const struct machine_params *params = conv_machine_params();
+    double tasks = (double)((layer->nkernels + CONV_MR - 1) / CONV_MR) * layer->width;
+    double task_seconds = layer->plan->predicted[layer->plan->engine] * params->nthreads / tasks;
+
+    return ceil(tasks / ncores) * task_seconds + (ncores > 1 ? NET_TEAM_SECONDS : 0.0);
+}
+
+/* layer indices sorted by predicted time on one core, longest first */
+static int compare_layer_work(const void *a, const void *b, void *arg)
+{
+    const struct net_layer *layers = arg;
+    double x = predict_layer_seconds(&layers[*(const int *)a], 1);
+    double y = predict_layer_seconds(&layers[*(const int *)b], 1);
+
+    return x < y ? 1 : x > y ? -1 : *(const int *)a - *(const int *)b;
+}
+
+/* choose, wave by wave, which layers run on the caller's team over all
+   cores and which run concurrently, handed longest first to the least
+   loaded of up to one worker per core, and restrict every plan to its
+   cores. AUTO keeps a wave's concurrent layers only if the cost model
+   predicts the wave sooner that way; the worker count needed is
+   returned */
+static int net_schedule(struct conv_net *net)
+{
+    struct core_set all, *sets = malloc(net->nlayers * sizeof(struct core_set));
+    int *members = malloc(net->nlayers * sizeof(int));
+    double *load = malloc(net->nlayers * sizeof(double));
+    int nworkers = 0, w, l, i, s;
+
+    default_cores(&all);
+    net->stats.predicted_seconds = 0.0;
+    for (w = 0; w < net->nwaves; w++)
+    {
+        double serial = 0.0, mixed = 0.0, longest = 0.0, busy = 0.0;
+        int nmembers = 0, nslots;
+
+        for (l = 0; l < net->nlayers; l++)
+        {
+            struct net_layer *layer = &net->layers[l];
+            double alone;
+
+            if (layer->wave != w)
+            {
+                continue;
+            }
+            layer->slot = -1;
+            layer->ncores = all.ncpus;
+            layer->predicted = predict_layer_seconds(layer, all.ncpus);
+            serial += layer->predicted;
+            alone = predict_layer_seconds(layer, 1);
+            if (net->parallelism == CONV_NET_INTER ||
+                (net->parallelism == CONV_NET_AUTO &&
+                 alone < NET_SCALING_EFFICIENCY * all.ncpus * layer->predicted))
+            {
+                members[nmembers++] = l;
+            }
+            else
+            {
+                mixed += layer->predicted;
+            }
+        }
+        nslots = nmembers < all.ncpus ? nmembers : all.ncpus;
+        if (net->parallelism == CONV_NET_INTER && nmembers > 1 && nslots < 2)
+        {
+            /* forced onto fewer cores than workers, the sets share cpus */
+            nslots = 2;
+        }
+        if (nmembers < 2 || nslots < 2)
+        {
+            net->stats.predicted_seconds += serial;
+            continue;
+        }
+
+        conv_partition_cores(nslots, NULL, sets);
+        qsort_r(members, nmembers, sizeof(int), compare_layer_work, net->layers);
+        for (s = 0; s < nslots; s++)
+        {
+            load[s] = 0.0;
+        }
+        for (i = 0; i < nmembers; i++)
+        {
+            struct net_layer *layer = &net->layers[members[i]];
+            int best = 0;
+
+            for (s = 1; s < nslots; s++)
+            {
+                best = load[s] < load[best] ? s : best;
+            }
+            layer->slot = best;
+            layer->ncores = sets[best].ncpus;
+            layer->predicted = predict_layer_seconds(layer, sets[best].ncpus);
+            load[best] += layer->predicted;
+            longest = load[best] > longest ? load[best] : longest;
+            busy += layer->predicted * sets[best].ncpus / all.ncpus;
+        }
+        /* workers sharing cpus take at least the wave's core-seconds */
+        mixed += (busy > longest ? busy : longest) + NET_DISPATCH_SECONDS;
+
+        if (net->parallelism == CONV_NET_AUTO && mixed >= serial)
+        {
+            for (i = 0; i < nmembers; i++)
+            {
+                struct net_layer *layer = &net->layers[members[i]];
+                layer->slot = -1;
+                layer->ncores = all.ncpus;
+                layer->predicted = predict_layer_seconds(layer, all.ncpus);
+            }
+            net->stats.predicted_seconds += serial;
+            continue;
+        }
+        for (i = 0; i < nmembers; i++)
+        {
+            struct net_layer *layer = &net->layers[members[i]];
+            conv_plan_set_cores(layer->plan, &sets[layer->slot]);
+        }
+        net->stats.predicted_seconds += mixed;
+        nworkers = nslots > nworkers ? nslots : nworkers;
+    }
+    for (l = 0; l < net->nlayers; l++)
+    {
+        if (net->layers[l].slot < 0)
+        {
+            conv_plan_set_cores(net->layers[l].plan, &all);
+        }
+    }
+    free(sets);
+    free(members);
+    free(load);
+    return nworkers;
+}
+
+/* tensors indices sorted by size, largest first */
+static int compare_tensor_bytes(const void *a, const void *b, void *arg)
+{
+    const struct net_tensor *tensors = arg;
+    long x = tensors[*(const int *)a].bytes, y = tensors[*(const int *)b].bytes;
+
+    return x < y ? 1 : x > y ? -1 : *(const int *)a - *(const int *)b;
+}
+
+static void *net_worker_run(void *arg);
+
+/* waves, the schedule, lifetimes, offsets and the arena for the layers
+   added so far */
+static void net_plan(struct conv_net *net)
+{
+    int ntensors = net->nlayers + 1, i, j, k, l, nworkers;
+    int *order = malloc(ntensors * sizeof(int)), *placed = malloc(ntensors * sizeof(int));
+    int concurrent = net->parallelism != CONV_NET_INTRA, nsteps;
+    long live;
+
+    memset(&net->stats, 0, sizeof(net->stats));
+    net->nwaves = 0;
+    for (l = 0; l < net->nlayers; l++)
+    {
+        struct net_layer *layer = &net->layers[l];
+
+        layer->wave = layer->input > 0 ? net->layers[layer->input - 1].wave + 1 : 0;
+        net->nwaves = layer->wave + 1 > net->nwaves ? layer->wave + 1 : net->nwaves;
+        layer->seconds = 0.0;
+        layer->calls = 0;
+    }
+    nworkers = net_schedule(net);
+
+    /* a step is a layer, or a wave if the layers of a wave may overlap */
+    nsteps = concurrent ? net->nwaves : net->nlayers;
+    for (i = 1; i < ntensors; i++)
+    {
+        net->tensors[i].first = concurrent ? net->layers[i - 1].wave : i - 1;
+        net->tensors[i].last = -1;
+        for (l = i; l < net->nlayers; l++)
+        {
+            int step = concurrent ? net->layers[l].wave : l;
+            if (net->layers[l].input == i && step > net->tensors[i].last)
+            {
+                net->tensors[i].last = step;
+            }
+        }
+        /* an output no layer reads stays live to the end */
+        net->tensors[i].last = net->tensors[i].last >= 0 ? net->tensors[i].last : nsteps - 1;
+        net->stats.naive_bytes += net->tensors[i].bytes;
+    }
+    for (l = 0; l < nsteps; l++)
+    {
+        for (live = 0, i = 1; i < ntensors; i++)
+        {
+            live += net->tensors[i].first <= l && l <= net->tensors[i].last
+                        ? net->tensors[i].bytes : 0;
+        }
+        net->stats.live_bytes = live > net->stats.live_bytes ? live : net->stats.live_bytes;
+    }
+    for (l = 0; l < net->nlayers; l++)
+    {
+        net->stats.scratch_bytes += conv_plan_scratch_bytes(net->layers[l].plan);
+    }
+
+    for (i = 0; i < ntensors - 1; i++)
+    {
+        order[i] = i + 1;
+    }
+    qsort_r(order, ntensors - 1, sizeof(int), compare_tensor_bytes, net->tensors);
+    for (i = 0; i < ntensors - 1; i++)
+    {
+        struct net_tensor *t = &net->tensors[order[i]];
+        int nplaced = 0;
+        long offset = 0;
+
+        /* the tensors placed so far that are live with this one, by offset */
+        for (j = 0; j < i; j++)
+        {
+            struct net_tensor *u = &net->tensors[order[j]];
+            if (u->first <= t->last && t->first <= u->last)
+            {
+                for (k = nplaced++; k > 0 && net->tensors[placed[k - 1]].offset > u->offset; k--)
+                {
+                    placed[k] = placed[k - 1];
+                }
+                placed[k] = order[j];
+            }
+        }
+        for (k = 0; k < nplaced; k++)
+        {
+            struct net_tensor *u = &net->tensors[placed[k]];
+            if (offset + t->bytes <= u->offset)
+            {
+                break;
+            }
+            offset = u->offset + u->bytes > offset ? u->offset + u->bytes : offset;
+        }
+        t->offset = offset;
+        if (offset + t->bytes > net->stats.planned_bytes)
+        {
+            net->stats.planned_bytes = offset + t->bytes;
+        }
+    }
+    if (posix_memalign((void **)&net->arena, NET_ALIGN,
+                       net->stats.planned_bytes > 0 ? net->stats.planned_bytes : NET_ALIGN) != 0)
+    {
+        fprintf(stderr, "FATAL: cannot allocate a %ld byte activation arena\n",
+                net->stats.planned_bytes);
+        exit(1);
+    }
+
+    /* workers are only ever added; idle ones wait on the next generation */
+    if (nworkers > net->nworkers)
+    {
+        net->workers = realloc(net->workers, nworkers * sizeof(pthread_t));
+        for (i = net->nworkers; i < nworkers; i++)
+        {
+            if (pthread_create(&net->workers[i], NULL, net_worker_run, net) != 0)
+            {
+                fprintf(stderr, "FATAL: cannot start network worker %d\n", i);
+                exit(1);
+            }
+        }
+        /* wait for them to read the generation they start from */
+        pthread_mutex_lock(&net->lock);
+        net->nworkers = nworkers;
+        while (net->nstarted < nworkers)
+        {
+            pthread_cond_wait(&net->done, &net->lock);
+        }
+        pthread_mutex_unlock(&net->lock);
+    }
+    free(order);
+    free(placed);
+}
+
+/* a tensor of the arena as a [C][X][Y] view */
+struct conv_view conv_net_tensor(const struct conv_net *net, int tensor)
+{
+    const struct net_tensor *t = &net->tensors[tensor];
+    struct conv_view view = {net->arena, t->offset / (long)sizeof(float),
+                             {(long)t->rows * t->cols, t->cols, 1, 0}};
+    return view;
+}
+
+/* run layer l, reading image as tensor 0, and time it */
+static void net_run_layer(struct conv_net *net, int l, const struct conv_view *image)
+{
+    struct net_layer *layer = &net->layers[l];
+    struct conv_view output = conv_net_tensor(net, l + 1);
+    struct conv_view input = *image;
+    double start = now_seconds();
+
+    if (layer->input > 0)
+    {
+        /* read the [C][X][Y] tensor as an [X][Y][C] image */
+        input = conv_net_tensor(net, layer->input);
+        input.strides[2] = input.strides[0];
+        input.strides[0] = input.strides[1];
+        input.strides[1] = 1;
+    }
+    conv_plan_execute_view(layer->plan, &input, &output);
+    layer->seconds += now_seconds() - start;
+    layer->calls++;
+}
+
+/* a worker: for every generation, run its slot's layers of the wave.
+   Each worker's OpenMP team is its own, bound by the plans to the
+   worker's share of the cores */
+static void *net_worker_run(void *arg)
+{
+    struct conv_net *net = arg;
+    long seen;
+    int slot, l;
+
+    pthread_mutex_lock(&net->lock);
+    slot = net->nstarted++;
+    seen = net->generation;
+    pthread_cond_broadcast(&net->done);
+    for (;;)
+    {
+        int wave;
+        const struct conv_view *image;
+
+        while (net->generation == seen && !net->stopping)
+        {
+            pthread_cond_wait(&net->start, &net->lock);
+        }
+        if (net->stopping)
+        {
+            break;
+        }
+        seen = net->generation;
+        wave = net->job_wave;
+        image = net->job_image;
+        pthread_mutex_unlock(&net->lock);
+
+        for (l = 0; l < net->nlayers; l++)
+        {
+            if (net->layers[l].wave == wave && net->layers[l].slot == slot)
+            {
+                net_run_layer(net, l, image);
+            }
+        }
+
+        pthread_mutex_lock(&net->lock);
+        if (--net->pending == 0)
+        {
+            pthread_cond_signal(&net->done);
+        }
+    }
+    pthread_mutex_unlock(&net->lock);
+    return NULL;
+}
+
+/* run every layer on image, a [X][Y][C] view of tensor 0. A tensor's
+   contents are valid after the call only if it is live to the end */
+void conv_net_execute(struct conv_net *net, const struct conv_view *image)
+{
+    int w, l;
+
+    if (net->arena == NULL)
+    {
+        net_plan(net);
+    }
+    if (net->parallelism == CONV_NET_INTRA)
+    {
+        for (l = 0; l < net->nlayers; l++)
+        {
+            net_run_layer(net, l, image);
+        }
+        return;
+    }
+    for (w = 0; w < net->nwaves; w++)
+    {
+        int concurrent = 0;
+
+        /* a wave's layers on all cores first, then its concurrent ones */
+        for (l = 0; l < net->nlayers; l++)
+        {
+            if (net->layers[l].wave == w && net->layers[l].slot < 0)
+            {
+                net_run_layer(net, l, image);
+            }
+            concurrent |= net->layers[l].wave == w && net->layers[l].slot >= 0;
+        }
+        if (!concurrent)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&net->lock);
+        net->job_wave = w;
+        net->job_image = image;
+        net->pending = net->nworkers;
+        net->generation++;
+        pthread_cond_broadcast(&net->start);
+        while (net->pending > 0)
+        {
+            pthread_cond_wait(&net->done, &net->lock);
+        }
+        pthread_mutex_unlock(&net->lock);
+    }
+}
+
+void conv_net_get_stats(struct conv_net *net, struct conv_net_stats *stats)
+{
+    if (net->arena == NULL)
+    {
+        net_plan(net);
+    }
+    *stats = net->stats;
+}
+
+/* where and how fast layer ran, as scheduled for the current parallelism */
+void conv_net_get_profile(struct conv_net *net, int layer, struct conv_net_profile *profile)
+{
+    const struct net_layer *l;
+
+    if (net->arena == NULL)
+    {
+        net_plan(net);
+    }
+    l = &net->layers[layer];
+    profile->wave = l->wave;
+    profile->worker = l->slot;
+    profile->ncores = l->ncores;
+    profile->predicted_seconds = l->predicted;
+    profile->seconds = l->calls > 0 ? l->seconds / l->calls : 0.0;
+    profile->calls = l->calls;
+    profile->engine = engine_names[l->plan->engine];
+}
+
+void conv_net_destroy(struct conv_net *net)
+{
+    int l;
+
+    pthread_mutex_lock(&net->lock);
+    net->stopping = 1;
+    pthread_cond_broadcast(&net->start);
+    pthread_mutex_unlock(&net->lock);
+    for (l = 0; l < net->nworkers; l++)
+    {
+        pthread_join(net->workers[l], NULL);
+    }
+    pthread_mutex_destroy(&net->lock);
+    pthread_cond_destroy(&net->start);
+    pthread_cond_destroy(&net->done);
+    for (l = 0; l < net->nlayers; l++)
+    {
+        conv_plan_destroy(net->layers[l].plan);
+    }
+    free(net->workers);
+    free(net->layers);
+    free(net->tensors);
+    free(net->arena);
+    free(net);
+}
+
+/* the fast version of matmul written by the student */
+void student_conv(float ***image, int16_t ****kernels, float ***output,
+                  int width, int height, int nchannels, int nkernels,
+                  int kernel_order)
+{
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                              kernel_order, kernels);
+
+    conv_plan_execute(plan, image, output);
+    conv_plan_destroy(plan);
+}
+
+/* time a single student_conv call, in seconds */
+double time_student_conv(float ***image, int16_t ****kernels, float ***output,
+                         int width, int height, int nchannels, int nkernels,
+                         int kernel_order)
+{
+    double start = now_seconds();
+
+    student_conv(image, kernels, output, width, height, nchannels, nkernels,
+                 kernel_order);
+    return now_seconds() - start;
+}
+
+/* sweep the heights and channel counts just above the requested shape,
+   covering every remainder modulo the vector width, and report the time
+   per multiply-accumulate so that cliffs at odd shapes stand out */
+void run_tail_sweep(int width, int height, int nchannels, int nkernels,
+                    int kernel_order)
+{
+    const int repeats = 10;
+    int dh, dc, r;
+    double best_ns[CONV_NR * 8][4];
+    double average = 0.0;
+
+    printf("Tail sweep (%s): W=%d K=%d M=%d\n", isa_names[detect_isa()],
+           width, kernel_order, nkernels);
+    printf("%8s %8s %14s %12s\n", "height", "channels", "ns per MAC", "SAD");
+    for (dc = 0; dc < 4; dc++)
+    {
+        for (dh = 0; dh < CONV_NR * 8; dh++)
+        {
+            int h = height + dh, c = nchannels + dc;
+            float ***image = gen_random_3d_matrix_float(width + kernel_order,
+                                                        h + kernel_order, c);
+            int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, c, kernel_order,
+                                                             kernel_order);
+            float ***output = new_empty_3d_matrix_float(nkernels, width, h);
+            float ***control = new_empty_3d_matrix_float(nkernels, width, h);
+            double macs = (double)width * h * c * nkernels * kernel_order * kernel_order;
+            double best = 1e30;
+
+            for (r = 0; r < repeats; r++)
+            {
+                double t = time_student_conv(image, kernels, output, width, h, c,
+                                             nkernels, kernel_order);
+                best = t < best ? t : best;
+            }
+            multichannel_conv(image, kernels, control, width, h, c, nkernels,
+                              kernel_order);
+            best_ns[dh][dc] = best * 1e9 / macs;
+            printf("%8d %8d %14.4f %12f\n", h, c, best_ns[dh][dc],
+                   sum_abs_diff(output, control, nkernels, width, h));
+            free_3d_matrix_float(image);
+            free_4d_matrix_int16(kernels);
+            free_3d_matrix_float(output);
+            free_3d_matrix_float(control);
+        }
+    }
+
+    /* flag any shape more than 50% slower than the sweep average */
+    for (dc = 0; dc < 4; dc++)
+    {
+        for (dh = 0; dh < CONV_NR * 8; dh++)
+        {
+            average += best_ns[dh][dc] / (4 * CONV_NR * 8);
+        }
+    }
+    for (dc = 0; dc < 4; dc++)
+    {
+        for (dh = 0; dh < CONV_NR * 8; dh++)
+        {
+            if (best_ns[dh][dc] > 1.5 * average)
+            {
+                printf("CLIFF: height %d, channels %d is %.2fx the sweep average\n",
+                       height + dh, nchannels + dc, best_ns[dh][dc] / average);
+            }
+        }
+    }
+}
+
+/* print the measured machine parameters, then the predicted and measured
+   time of every engine on one shape, for calibrating engine_efficiency */
+void run_cost_model_report(int width, int height, int nchannels, int nkernels,
+                           int kernel_order)
+{
+    const struct machine_params *params = conv_machine_params();
+    float ***image = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
+                                                nchannels);
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    float ***control = new_empty_3d_matrix_float(nkernels, width, height);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                              kernel_order, kernels);
+    enum conv_engine selected = plan->engine;
+    int e, r;
+
+    printf("Machine: %s, %d threads, %.2f GFMA/s, %.2f GB/s, L1 %ldK L2 %ldK L3 %ldK\n",
+           isa_names[params->isa], params->nthreads, params->fma_per_second * 1e-9,
+           params->bandwidth * 1e-9, params->l1_bytes >> 10, params->l2_bytes >> 10,
+           params->l3_bytes >> 10);
+    multichannel_conv(image, kernels, control, width, height, nchannels, nkernels,
+                      kernel_order);
+
+    printf("%10s %14s %14s %8s %12s\n", "engine", "predicted us", "measured us",
+           "ratio", "SAD");
+    for (e = 0; e < ENGINE_COUNT; e++)
+    {
+        double best = 1e30;
+
+        if (!engine_available(e, kernel_order))
+        {
+            printf("%10s %14.1f %14s %8s %12s\n", engine_names[e],
+                   plan->predicted[e] * 1e6, "-", "-", "-");
+            continue;
+        }
+        conv_plan_set_engine(plan, e);
+        for (r = 0; r < 5; r++)
+        {
+            double start = now_seconds(), elapsed;
+            conv_plan_execute(plan, image, output);
+            elapsed = now_seconds() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        printf("%10s %14.1f %14.1f %8.2f %12f\n", engine_names[e],
+               plan->predicted[e] * 1e6, best * 1e6, best / plan->predicted[e],
+               sum_abs_diff(output, control, nkernels, width, height));
+    }
+    printf("Selected engine: %s\n", engine_names[selected]);
+
+    conv_plan_destroy(plan);
+    free_3d_matrix_float(image);
+    free_4d_matrix_int16(kernels);
+    free_3d_matrix_float(output);
+    free_3d_matrix_float(control);
+}
+
+/* compare scratch memory, peak resident memory and throughput of the
+   engines on one shape. Each engine runs in its own child process so
+   that the peak resident size of one does not hide that of the next */
+void run_memory_report(int width, int height, int nchannels, int nkernels,
+                       int kernel_order)
+{
+    const enum conv_engine engines[] = {ENGINE_DIRECT, ENGINE_IM2COL, ENGINE_IMPLICIT};
+    double macs = (double)width * height * nchannels * nkernels * kernel_order * kernel_order;
+    unsigned e;
+
+    printf("%10s %14s %14s %12s %10s\n", "engine", "scratch MB", "peak RSS MB",
+           "time us", "GMAC/s");
+    fflush(stdout);
+    for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+    {
+        struct rusage usage;
+        double result[2] = {0.0, 0.0}; /* scratch bytes, best time */
+        int status, fds[2];
+        pid_t child;
+
+        if (pipe(fds) != 0)
+        {
+            perror("pipe");
+            exit(1);
+        }
+        child = fork();
+        if (child == 0)
+        {
+            float ***image = gen_random_3d_matrix_float(width + kernel_order,
+                                                        height + kernel_order, nchannels);
+            int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels,
+                                                             kernel_order, kernel_order);
+            float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+            struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                                      kernel_order, kernels);
+            int r;
+
+            conv_plan_set_engine(plan, engines[e]);
+            result[1] = 1e30;
+            for (r = 0; r < 3; r++)
+            {
+                double start = now_seconds(), elapsed;
+                conv_plan_execute(plan, image, output);
+                elapsed = now_seconds() - start;
+                result[1] = elapsed < result[1] ? elapsed : result[1];
+            }
+            result[0] = conv_plan_scratch_bytes(plan);
+            if (write(fds[1], result, sizeof(result)) != sizeof(result))
+            {
+                _exit(1);
+            }
+            _exit(0);
+        }
+        close(fds[1]);
+        if (read(fds[0], result, sizeof(result)) != sizeof(result))
+        {
+            fprintf(stderr, "FATAL: %s run failed\n", engine_names[engines[e]]);
+            exit(1);
+        }
+        close(fds[0]);
+        wait4(child, &status, 0, &usage);
+        printf("%10s %14.2f %14.2f %12.1f %10.2f\n", engine_names[engines[e]],
+               result[0] / 1048576.0, usage.ru_maxrss / 1024.0, result[1] * 1e6,
+               macs / result[1] * 1e-9);
+    }
+}
+
+/* error and speed of every Winograd variant against multichannel_conv,
+   with the direct engine's time on the same shape for reference */
+void run_winograd_report(int width, int height, int nchannels, int nkernels)
+{
+    int v, r;
+
+    printf("%-40s %12s %12s %12s %12s %8s\n", "variant", "SAD", "max error",
+           "direct us", "winograd us", "speedup");
+    for (v = 0; v < WINO_VARIANTS; v++)
+    {
+        int kernel_order = winograd_variants[v].kernel_order;
+        float ***image = gen_random_3d_matrix_float(width + kernel_order,
+                                                    height + kernel_order, nchannels);
+        int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                         kernel_order);
+        float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+        float ***control = new_empty_3d_matrix_float(nkernels, width, height);
+        struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                                  kernel_order, kernels);
+        double best[2] = {1e30, 1e30}, max_error = 0.0;
+        long i, count = (long)nkernels * width * height;
+        int pass;
+
+        multichannel_conv(image, kernels, control, width, height, nchannels, nkernels,
+                          kernel_order);
+        plan->winograd_variant = v;
+        for (pass = 0; pass < 2; pass++)
+        {
+            conv_plan_set_engine(plan, pass == 0 ? ENGINE_DIRECT : ENGINE_WINOGRAD);
+            for (r = 0; r < 5; r++)
+            {
+                double start = now_seconds(), elapsed;
+                conv_plan_execute(plan, image, output);
+                elapsed = now_seconds() - start;
+                best[pass] = elapsed < best[pass] ? elapsed : best[pass];
+            }
+        }
+        for (i = 0; i < count; i++)
+        {
+            double error = fabs((**output)[i] - (**control)[i]);
+            max_error = error > max_error ? error : max_error;
+        }
+        printf("%-40s %12.1f %12.1f %12.1f %12.1f %8.2f\n", winograd_variants[v].name,
+               sum_abs_diff(output, control, nkernels, width, height), max_error,
+               best[0] * 1e6, best[1] * 1e6, best[0] / best[1]);
+
+        conv_plan_destroy(plan);
+        free_3d_matrix_float(image);
+        free_4d_matrix_int16(kernels);
+        free_3d_matrix_float(output);
+        free_3d_matrix_float(control);
+    }
+}
+
+/* the inner kernels measured by the 'micro' mode */
+enum micro_kernel
+{
+    MICRO_DIRECT,
+    MICRO_INDIRECT,
+    MICRO_GEMM,
+    MICRO_WINOGRAD,
+    MICRO_COUNT
+};
+
+static const char *micro_names[] = {"direct", "indirect", "gemm", "winograd"};
+
+/* run every engine's inner kernel in a tight loop on L1-resident data and
+   report cycles per FMA and the fraction of the theoretical peak of
+   CONV_FMA_PORTS (default 2) vector FMAs per cycle. Cycles come from the
+   core cycle counter where perf events are available, otherwise from the
+   time stamp counter, which ticks at the nominal frequency */
+void run_micro_report(void)
+{
+    const int height = CONV_NR * 8 * 2, nchannels = 2;
+    const char *ports_env = getenv("CONV_FMA_PORTS");
+    double ports = ports_env != NULL ? atof(ports_env) : 2.0;
+    enum conv_isa best_isa = detect_isa();
+    int cycle_fd = perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    /* large enough for the C*K*K rows of the K=7 GEMM panel */
+    long image_size = (long)nchannels * 7 * 7 * (height + 8);
+    double *image = malloc(image_size * sizeof(double));
+    double *kern = malloc(7 * 7 * 8 * 8 * CONV_MR * sizeof(double));
+    float *out = malloc(CONV_MR * height * sizeof(float));
+    double prod[CONV_MR * WINO_TILES];
+    const double *taps[8 * 7 * 7];
+    char order[4];
+    int isa, engine, kernel_order, i;
+
+    for (i = 0; i < image_size; i++)
+    {
+        image[i] = i % 17;
+    }
+    for (i = 0; i < 7 * 7 * 8 * 8 * CONV_MR; i++)
+    {
+        kern[i] = i % 5;
+    }
+    printf("Micro-kernels on L1-resident data, cycles from %s, peak %.0f FMA ports\n",
+           cycle_fd >= 0 ? "core cycle counter" : "TSC", ports);
+    printf("%10s %8s %3s %14s %12s %10s\n", "kernel", "isa", "K", "cycles/FMA",
+           "FMAs/cycle", "% peak");
+
+    for (engine = 0; engine < MICRO_COUNT; engine++)
+    {
+        for (isa = ISA_SCALAR; isa <= (int)best_isa; isa++)
+        {
+            for (kernel_order = 1; kernel_order <= 7; kernel_order += 2)
+            {
+                int depth = nchannels * kernel_order * kernel_order;
+                long channel_stride = (long)kernel_order * (height + kernel_order);
+                long iterations = 20000000L / (depth * height * CONV_MR) + 1;
+                double fmas = (double)iterations * depth * height * CONV_MR;
+                unsigned long long tsc;
+                long long cycles;
+                double cycles_taken;
+                long n;
+
+                if (engine == MICRO_WINOGRAD)
+                {
+                    /* one tile position: the reduction runs over depth channels */
+                    if (kernel_order != 1)
+                    {
+                        continue;
+                    }
+                    depth = 64;
+                    iterations = 20000000L / (depth * WINO_TILES * CONV_MR) + 1;
+                    fmas = (double)iterations * depth * WINO_TILES * CONV_MR;
+                }
+                for (i = 0; i < depth; i++)
+                {
+                    int c = i / (kernel_order * kernel_order);
+                    int x = i / kernel_order % kernel_order;
+                    taps[i] = image + c * channel_stride + x * (height + kernel_order) +
+                              i % kernel_order;
+                }
+
+                cycles = perf_counter_read(cycle_fd);
+                tsc = __rdtsc();
+                for (n = 0; n < iterations; n++)
+                {
+                    switch (engine)
+                    {
+                    case MICRO_DIRECT:
+                        direct_row_kernels[isa](image, kern, out, channel_stride,
+                                                height + kernel_order, height, CONV_MR,
+                                                height, nchannels, kernel_order);
+                        break;
+                    case MICRO_INDIRECT:
+                        indirect_row_kernels[isa](taps, kern, out, height, CONV_MR,
+                                                  height, depth);
+                        break;
+                    case MICRO_GEMM:
+                        direct_row_kernels[isa](image, kern, out, height, 0, height,
+                                                CONV_MR, height, depth, 1);
+                        break;
+                    default:
+                        winograd_gemm_kernels[isa](kern, image, prod, WINO_TILES, depth);
+                        break;
+                    }
+                    /* keep the calls from being merged */
+                    __asm__ volatile("" ::: "memory");
+                }
+                tsc = __rdtsc() - tsc;
+                cycles = perf_counter_read(cycle_fd) - cycles;
+                cycles_taken = cycle_fd >= 0 ? (double)cycles : (double)tsc;
+
+                snprintf(order, sizeof(order), "%d", kernel_order);
+                printf("%10s %8s %3s %14.4f %12.2f %10.1f\n", micro_names[engine],
+                       isa_names[isa], engine == MICRO_WINOGRAD ? "-" : order,
+                       cycles_taken / fmas, fmas / cycles_taken,
+                       100.0 * fmas / cycles_taken / (ports * isa_lanes[isa]));
+            }
+        }
+    }
+    if (cycle_fd >= 0)
+    {
+        close(cycle_fd);
+    }
+    free(image);
+    free(kern);
+    free(out);
+}
+
+/* one independent convolution stream of the 'tenants' mode */
+struct tenant_stream
+{
+    struct conv_plan *plan;
+    float ***image;
+    float ***output;
+    double duration;
+    long calls;
+    double elapsed;
+};
+
+static void *tenant_stream_run(void *arg)
+{
+    struct tenant_stream *stream = arg;
+    double start = now_seconds();
+
+    do
+    {
+        conv_plan_execute(stream->plan, stream->image, stream->output);
+        stream->calls++;
+        stream->elapsed = now_seconds() - start;
+    } while (stream->elapsed < stream->duration);
+    return NULL;
+}
+
+/* run nstreams convolutions of the same shape concurrently, first with
+   every plan using all cores through OpenMP, then with the cores split
+   between the plans by weight, and report per-stream and aggregate
+   throughput of both */
+void run_tenants_report(int width, int height, int nchannels, int nkernels,
+                        int kernel_order, int nstreams, const double *weights)
+{
+    struct tenant_stream streams[nstreams];
+    struct core_set *sets = malloc(nstreams * sizeof(struct core_set));
+    double macs = (double)width * height * nchannels * nkernels * kernel_order * kernel_order;
+    int pass, i;
+
+    conv_partition_cores(nstreams, weights, sets);
+    for (i = 0; i < nstreams; i++)
+    {
+        int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                         kernel_order);
+        streams[i].plan = conv_plan_create(width, height, nchannels, nkernels,
+                                           kernel_order, kernels);
+        streams[i].image = gen_random_3d_matrix_float(width + kernel_order,
+                                                      height + kernel_order, nchannels);
+        streams[i].output = new_empty_3d_matrix_float(nkernels, width, height);
+        streams[i].duration = 2.0;
+        free_4d_matrix_int16(kernels);
+    }
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        pthread_t threads[nstreams];
+        double aggregate = 0.0;
+
+        printf("%s:\n", pass == 0 ? "Shared (every plan uses all cores)"
+                                  : "Partitioned (disjoint core sets)");
+        printf("%8s %8s %8s %12s %10s\n", "stream", "weight", "cores", "convs/s", "GMAC/s");
+        for (i = 0; i < nstreams; i++)
+        {
+            if (pass == 1)
+            {
+                conv_plan_set_cores(streams[i].plan, &sets[i]);
+            }
+            streams[i].calls = 0;
+            pthread_create(&threads[i], NULL, tenant_stream_run, &streams[i]);
+        }
+        for (i = 0; i < nstreams; i++)
+        {
+            double rate;
+
+            pthread_join(threads[i], NULL);
+            rate = streams[i].calls / streams[i].elapsed;
+            aggregate += rate * macs;
+            printf("%8d %8.2f %8d %12.2f %10.2f\n", i, weights != NULL ? weights[i] : 1.0,
+                   pass == 0 ? omp_get_num_procs() : sets[i].ncpus, rate, rate * macs * 1e-9);
+        }
+        printf("%8s %8s %8s %12s %10.2f\n", "total", "", "", "", aggregate * 1e-9);
+    }
+
+    for (i = 0; i < nstreams; i++)
+    {
+        conv_plan_destroy(streams[i].plan);
+        free_3d_matrix_float(streams[i].image);
+        free_3d_matrix_float(streams[i].output);
+    }
+    free(sets);
+}
+
+/* calibrate every vector instruction set and show its sustained
+   throughput next to the clock measured while it ran */
+void run_isa_report(void)
+{
+    struct isa_calibration results[ISA_AVX512];
+    int count = calibrate_isas(detect_isa(), 0.5, results), i;
+
+    printf("%10s %10s %12s %14s\n", "isa", "GMAC/s", "probe GHz", "counter GHz");
+    for (i = 0; i < count; i++)
+    {
+        char counter[32] = "-";
+        if (results[i].cycles_hz > 0.0)
+        {
+            snprintf(counter, sizeof(counter), "%.3f", results[i].cycles_hz * 1e-9);
+        }
+        printf("%10s %10.2f %12.3f %14s\n", isa_names[results[i].isa],
+               results[i].macs_per_second * 1e-9, results[i].probe_hz * 1e-9, counter);
+    }
+    printf("Selected: %s\n", isa_names[select_isa()]);
+}
+
+/* show how the cpus map onto physical cores and L3 domains, and time a
+   plan on the default one-thread-per-core set against every online cpu */
+void run_topology_report(int width, int height, int nchannels, int nkernels,
+                         int kernel_order)
+{
+    const struct cpu_topology *topo = conv_topology();
+    float ***image = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
+                                                nchannels);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    struct conv_plan *plan;
+    struct core_set sets[2];
+    const char *labels[2] = {"default", "online"};
+    int i, s;
+
+    printf("%6s %6s %6s\n", "cpu", "core", "L3");
+    for (i = 0; i < topo->ncpus; i++)
+    {
+        printf("%6d %6d %6d\n", topo->cpu[i], topo->first_thread[i], topo->l3_domain[i]);
+    }
+
+    default_cores(&sets[0]);
+    online_cores(&sets[1]);
+    plan = conv_plan_create(width, height, nchannels, nkernels, kernel_order, kernels);
+    printf("%8s %6s %8s %12s\n", "cores", "cpus", "domains", "us per conv");
+    for (s = 0; s < 2; s++)
+    {
+        double start;
+        int runs = 0;
+
+        conv_plan_set_cores(plan, &sets[s]);
+        conv_plan_execute(plan, image, output);
+        start = now_seconds();
+        while (now_seconds() - start < 0.5 || runs < 3)
+        {
+            conv_plan_execute(plan, image, output);
+            runs++;
+        }
+        printf("%8s %6d %8d %12.1f\n", labels[s], sets[s].ncpus, plan->schedule.ndomains,
+               (now_seconds() - start) / runs * 1e6);
+    }
+    conv_plan_destroy(plan);
+    free_3d_matrix_float(image);
+    free_3d_matrix_float(output);
+    free_4d_matrix_int16(kernels);
+}
+
+/* compare a plan reading one shared copy of its kernels with one reading
+   per-node replicas: the share of kernel pages on the reading thread's
+   node (from move_pages) and, where perf events are available, the
+   team's loads that missed to another node */
+void run_numa_report(int width, int height, int nchannels, int nkernels,
+                     int kernel_order)
+{
+    const uint64_t node_misses = PERF_COUNT_HW_CACHE_NODE |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    float ***image = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
+                                                nchannels);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                              kernel_order, kernels);
+    int nthreads = plan->cores.ncpus;
+    int fds[nthreads];
+    int replicate;
+
+    printf("NUMA nodes: %d, threads: %d, engine: %s, kernel bytes: %ld\n",
+           conv_topology()->nnodes, nthreads, engine_names[plan->engine],
+           plan->kernels->replica_bytes);
+    printf("%10s %14s %18s %12s\n", "kernels", "local pages %", "remote loads/conv",
+           "us per conv");
+    for (replicate = 0; replicate <= 1; replicate++)
+    {
+        double local = 0.0, start;
+        long long remote = 0;
+        char local_text[32] = "-", remote_text[32] = "-";
+        int i, known = 0, counted = 0, runs = 0;
+
+        conv_plan_set_replication(plan, replicate);
+        conv_plan_execute(plan, image, output);
+        for (i = 0; i < nthreads; i++)
+        {
+            int node = plan->schedule.thread_node[i];
+            double share = pages_on_node(plan->kernels->copies[node], plan->kernels->replica_bytes,
+                                          node);
+            if (share >= 0.0)
+            {
+                local += share;
+                known++;
+            }
+        }
+
+        /* one counter per team thread; the bound team is reused by every run */
+#pragma omp parallel num_threads(nthreads)
+        fds[omp_get_thread_num()] = perf_counter_open(PERF_TYPE_HW_CACHE, node_misses);
+        for (i = 0; i < nthreads; i++)
+        {
+            remote -= perf_counter_read(fds[i]);
+        }
+        start = now_seconds();
+        while (now_seconds() - start < 0.5 || runs < 3)
+        {
+            conv_plan_execute(plan, image, output);
+            runs++;
+        }
+        for (i = 0; i < nthreads; i++)
+        {
+            remote += perf_counter_read(fds[i]);
+            counted += fds[i] >= 0;
+            if (fds[i] >= 0)
+            {
+                close(fds[i]);
+            }
+        }
+
+        if (known > 0)
+        {
+            snprintf(local_text, sizeof(local_text), "%.1f", 100.0 * local / known);
+        }
+        if (counted > 0)
+        {
+            snprintf(remote_text, sizeof(remote_text), "%.0f", (double)remote / runs);
+        }
+        printf("%10s %14s %18s %12.1f\n", replicate ? "per-node" : "shared", local_text,
+               remote_text, (now_seconds() - start) / runs * 1e6);
+    }
+    conv_plan_destroy(plan);
+    free_3d_matrix_float(image);
+    free_3d_matrix_float(output);
+    free_4d_matrix_int16(kernels);
+}
+
+/* run every engine on views into larger tensors (a crop of the image
+   and a subset of its channels, a sub-batch of the kernels, and a slice
+   of a larger output, with adjacent or every other height) and compare
+   with multichannel_conv on copies */
+void run_views_report(int width, int height, int nchannels, int nkernels,
+                      int kernel_order)
+{
+    const int x0 = 2, y0 = 3, c0 = 1, m0 = 3;
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    float ***big_image = gen_random_3d_matrix_float(padded_width + x0 + 1,
+                                                    padded_height + y0 + 2, nchannels + c0 + 1);
+    int16_t ****big_kernels = gen_random_4d_matrix_int16(nkernels + m0, nchannels + c0 + 1,
+                                                         kernel_order, kernel_order);
+    float ***big_output = new_empty_3d_matrix_float(nkernels + 2, width + 3, 2 * height + 5);
+    float ***image = new_empty_3d_matrix_float(padded_width, padded_height, nchannels);
+    int16_t ****kernels = new_empty_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                    kernel_order);
+    float ***control = new_empty_3d_matrix_float(nkernels, width, height);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    struct conv_view image_view = conv_view_float3d(big_image, padded_height + y0 + 2,
+                                                    nchannels + c0 + 1);
+    struct conv_view kernel_view = conv_view_int16_4d(big_kernels, nchannels + c0 + 1,
+                                                      kernel_order, kernel_order);
+    struct conv_view output_view = conv_view_float3d(big_output, width + 3, 2 * height + 5);
+    struct conv_plan *plan;
+    int m, c, w, h, x, y, e, step;
+
+    image_view = conv_view_slice(conv_view_slice(conv_view_slice(image_view, 0, x0), 1, y0),
+                                 2, c0);
+    kernel_view = conv_view_slice(conv_view_slice(kernel_view, 0, m0), 1, c0);
+    output_view = conv_view_slice(conv_view_slice(conv_view_slice(output_view, 0, 1), 1, 2),
+                                  2, 1);
+
+    for (w = 0; w < padded_width; w++)
+    {
+        for (h = 0; h < padded_height; h++)
+        {
+            for (c = 0; c < nchannels; c++)
+            {
+                image[w][h][c] = big_image[w + x0][h + y0][c + c0];
+            }
+        }
+    }
+    for (m = 0; m < nkernels; m++)
+    {
+        for (c = 0; c < nchannels; c++)
+        {
+            for (x = 0; x < kernel_order; x++)
+            {
+                for (y = 0; y < kernel_order; y++)
+                {
+                    kernels[m][c][x][y] = big_kernels[m + m0][c + c0][x][y];
+                }
+            }
+        }
+    }
+    multichannel_conv(image, kernels, control, width, height, nchannels, nkernels,
+                      kernel_order);
+
+    plan = conv_plan_create_view(width, height, nchannels, nkernels, kernel_order,
+                                 &kernel_view);
+    printf("%10s %10s %14s\n", "engine", "heights", "SAD");
+    for (e = 0; e < ENGINE_COUNT; e++)
+    {
+        if (!engine_available(e, kernel_order))
+        {
+            continue;
+        }
+        conv_plan_set_engine(plan, e);
+        for (step = 1; step <= 2; step++)
+        {
+            struct conv_view out = output_view;
+
+            out.strides[2] = step;
+            conv_plan_execute_view(plan, &image_view, &out);
+            for (m = 0; m < nkernels; m++)
+            {
+                for (w = 0; w < width; w++)
+                {
+                    for (h = 0; h < height; h++)
+                    {
+                        output[m][w][h] = big_output[m + 1][w + 2][1 + h * step];
+                    }
+                }
+            }
+            printf("%10s %10s %14f\n", engine_names[e], step == 1 ? "adjacent" : "strided",
+                   sum_abs_diff(output, control, nkernels, width, height));
+        }
+    }
+
+    conv_plan_destroy(plan);
+    free_3d_matrix_float(big_image);
+    free_3d_matrix_float(big_output);
+    free_3d_matrix_float(image);
+    free_3d_matrix_float(control);
+    free_3d_matrix_float(output);
+    free_4d_matrix_int16(big_kernels);
+    free_4d_matrix_int16(kernels);
+}
+
+/* a batch of nimages images with output sizes drawn from half to one
+   and a half times width x height, convolved one student_conv per
+   image, with one cached plan per image, and as one ragged batch */
+void run_ragged_report(int width, int height, int nchannels, int nkernels,
+                       int kernel_order, int nimages)
+{
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    struct conv_view kernel_view = conv_view_int16_4d(kernels, nchannels, kernel_order,
+                                                      kernel_order);
+    float ***images[nimages], ***outputs[nimages], ***controls[nimages];
+    struct conv_plan *plans[nimages];
+    struct conv_batch_image batch_images[nimages];
+    struct conv_batch *batch;
+    const char *labels[3] = {"student_conv", "cached plans", "ragged batch"};
+    double macs = 0.0, baseline = 0.0;
+    int i, method;
+
+    for (i = 0; i < nimages; i++)
+    {
+        int w = width / 2 + rand() % (width + 1);
+        int h = height / 2 + rand() % (height + 1);
+
+        w = w < 1 ? 1 : w;
+        h = h < 1 ? 1 : h;
+        images[i] = gen_random_3d_matrix_float(w + kernel_order, h + kernel_order, nchannels);
+        outputs[i] = new_empty_3d_matrix_float(nkernels, w, h);
+        controls[i] = new_empty_3d_matrix_float(nkernels, w, h);
+        multichannel_conv(images[i], kernels, controls[i], w, h, nchannels, nkernels,
+                          kernel_order);
+        plans[i] = conv_plan_create(w, h, nchannels, nkernels, kernel_order, kernels);
+        batch_images[i].width = w;
+        batch_images[i].height = h;
+        batch_images[i].image = conv_view_float3d(images[i], h + kernel_order, nchannels);
+        batch_images[i].output = conv_view_float3d(outputs[i], w, h);
+        macs += (double)w * h * nchannels * nkernels * kernel_order * kernel_order;
+    }
+    batch = conv_batch_create(nchannels, nkernels, kernel_order, &kernel_view);
+
+    printf("%d images, %d output heights per batch tile\n", nimages, batch->tile_cols);
+    printf("%14s %14s %12s %10s %10s %12s\n", "method", "ms per batch", "images/s",
+           "GMAC/s", "speedup", "SAD");
+    for (method = 0; method < 3; method++)
+    {
+        double start, seconds, sad = 0.0;
+        int runs = 0;
+
+        for (i = 0; i < nimages; i++)
+        {
+            memset(**outputs[i], 0, (long)nkernels * batch_images[i].width *
+                                        batch_images[i].height * sizeof(float));
+        }
+        start = now_seconds();
+        while (now_seconds() - start < 0.5 || runs < 3)
+        {
+            if (method == 2)
+            {
+                conv_batch_execute(batch, nimages, batch_images);
+            }
+            for (i = 0; i < nimages && method < 2; i++)
+            {
+                if (method == 0)
+                {
+                    student_conv(images[i], kernels, outputs[i], batch_images[i].width,
+                                 batch_images[i].height, nchannels, nkernels, kernel_order);
+                }
+                else
+                {
+                    conv_plan_execute(plans[i], images[i], outputs[i]);
+                }
+            }
+            runs++;
+        }
+        seconds = (now_seconds() - start) / runs;
+        baseline = method == 0 ? seconds : baseline;
+        for (i = 0; i < nimages; i++)
+        {
+            sad += sum_abs_diff(outputs[i], controls[i], nkernels, batch_images[i].width,
+                                batch_images[i].height);
+        }
+        printf("%14s %14.3f %12.1f %10.2f %10.2f %12f\n", labels[method], seconds * 1e3,
+               nimages / seconds, macs / seconds * 1e-9, baseline / seconds, sad);
+    }
+
+    conv_batch_destroy(batch);
+    for (i = 0; i < nimages; i++)
+    {
+        conv_plan_destroy(plans[i]);
+        free_3d_matrix_float(images[i]);
+        free_3d_matrix_float(outputs[i]);
+        free_3d_matrix_float(controls[i]);
+    }
+    free_4d_matrix_int16(kernels);
+}
+
+/* a stream of nframes images drawn from ndistinct frames, run by one
+   plan with no cache, with a cache that holds a quarter of the distinct
+   outputs and with one that holds them all, copying or aliasing outputs */
+void run_cache_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                      int nframes, int ndistinct)
+{
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    float ***frames[ndistinct], ***controls[ndistinct];
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    struct conv_view output_view = conv_view_float3d(output, width, height);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                              kernel_order, kernels);
+    long output_bytes = (long)nkernels * width * height * sizeof(float);
+    long capacities[4] = {0, output_bytes * ((ndistinct + 3) / 4), output_bytes * ndistinct,
+                          output_bytes * ndistinct};
+    const char *labels[4] = {"none", "1/4 of frames", "all frames", "all, aliased"};
+    int sequence[nframes];
+    uint64_t digests[2][2];
+    double baseline = 0.0;
+    int i, c, isa;
+
+    for (i = 0; i < ndistinct; i++)
+    {
+        frames[i] = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
+                                               nchannels);
+        controls[i] = new_empty_3d_matrix_float(nkernels, width, height);
+        multichannel_conv(frames[i], kernels, controls[i], width, height, nchannels,
+                          nkernels, kernel_order);
+    }
+    for (i = 0; i < nframes; i++)
+    {
+        sequence[i] = rand() % ndistinct;
+    }
+
+    /* the digest must not depend on the instruction set; the AVX2 stripes
+       only run where the host has them */
+    for (isa = 0; isa < (detect_isa() >= ISA_AVX2 ? 2 : 1); isa++)
+    {
+        struct content_hash state;
+        hash_init(&state, isa == 0 ? ISA_SCALAR : ISA_AVX2);
+        hash_update(&state, **frames[0], 13);
+        hash_update(&state, **frames[0] + 13, (long)(width + kernel_order) *
+                                                  (height + kernel_order) * nchannels * 4 - 52);
+        hash_digest(&state, digests[isa]);
+    }
+    printf("%d frames, %d distinct, %.2f MB per output, scalar and AVX2 digests %s\n",
+           nframes, ndistinct, output_bytes / (double)(1 << 20),
+           detect_isa() < ISA_AVX2 ? "n/a"
+           : memcmp(digests[0], digests[1], sizeof(digests[0])) == 0 ? "match" : "DIFFER");
+    printf("%14s %10s %12s %8s %8s %10s %10s %12s\n", "cache", "MB", "us per frame",
+           "speedup", "hit %", "evictions", "hash GB/s", "SAD");
+    for (c = 0; c < 4; c++)
+    {
+        struct conv_cache *cache = c > 0 ? conv_cache_create(capacities[c]) : NULL;
+        struct conv_cache_stats stats = {0};
+        double start, seconds, sad = 0.0;
+
+        conv_plan_set_cache(plan, cache);
+        start = now_seconds();
+        for (i = 0; i < nframes; i++)
+        {
+            struct conv_view image = conv_view_float3d(frames[sequence[i]],
+                                                       height + kernel_order, nchannels);
+            if (c == 3)
+            {
+                conv_cache_release(conv_plan_execute_aliased(plan, &image));
+            }
+            else
+            {
+                conv_plan_execute_view(plan, &image, &output_view);
+            }
+        }
+        seconds = (now_seconds() - start) / nframes;
+        baseline = c == 0 ? seconds : baseline;
+
+        /* check each distinct frame once more through the same path */
+        for (i = 0; i < ndistinct; i++)
+        {
+            struct conv_view image = conv_view_float3d(frames[i], height + kernel_order,
+                                                       nchannels);
+            if (c == 3)
+            {
+                const float *aliased = conv_plan_execute_aliased(plan, &image);
+                memcpy(**output, aliased, output_bytes);
+                conv_cache_release(aliased);
+            }
+            else
+            {
+                conv_plan_execute_view(plan, &image, &output_view);
+            }
+            sad += sum_abs_diff(output, controls[i], nkernels, width, height);
+        }
+        if (cache != NULL)
+        {
+            conv_cache_get_stats(cache, &stats);
+            conv_cache_destroy(cache);
+        }
+        printf("%14s %10.2f %12.1f %8.2f %8.1f %10ld %10.2f %12f\n", labels[c],
+               capacities[c] / (double)(1 << 20), seconds * 1e6, baseline / seconds,
+               stats.hits + stats.misses > 0 ? 100.0 * stats.hits / (stats.hits + stats.misses)
+                                             : 0.0,
+               stats.evictions,
+               stats.hash_seconds > 0.0 ? stats.hashed_bytes / stats.hash_seconds * 1e-9 : 0.0,
+               sad);
+    }
+    conv_plan_destroy(plan);
+    for (i = 0; i < ndistinct; i++)
+    {
+        free_3d_matrix_float(frames[i]);
+        free_3d_matrix_float(controls[i]);
+    }
+    free_3d_matrix_float(output);
+    free_4d_matrix_int16(kernels);
+}
+
+/* video streams of nframes frames: a static random background with a
+   textured object covering a given share of the image and moving two
+   pixels a frame, plus optional sensor noise. Each is run with a full
+   convolution per frame and as a delta stream refreshed every refresh
+   frames; the error is the largest difference from the full
+   convolution, relative to the largest output */
+void run_delta_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                      int nframes, int refresh)
+{
+    static const struct
+    {
+        double motion;
+        int noise;
+        float threshold;
+    } scenarios[] = {{0.0, 0, 0.0f},  {0.01, 0, 0.0f}, {0.05, 0, 0.0f}, {0.2, 0, 0.0f},
+                     {0.5, 0, 0.0f},  {0.05, 2, 0.0f}, {0.05, 2, 4.0f}};
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    long inputs = (long)padded_width * padded_height * nchannels;
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                              kernel_order, kernels);
+    float ***background = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+    float ***texture = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+    float ***frames[nframes];
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    float ***control = new_empty_3d_matrix_float(nkernels, width, height);
+    struct conv_view output_view = conv_view_float3d(output, width, height);
+    struct conv_view control_view = conv_view_float3d(control, width, height);
+    int s, t, x, y, c;
+    long i;
+
+    conv_plan_set_cache(plan, NULL);
+    for (t = 0; t < nframes; t++)
+    {
+        frames[t] = new_empty_3d_matrix_float(padded_width, padded_height, nchannels);
+    }
+    printf("%d frames, refresh every %d, engine %s\n", nframes, refresh,
+           engine_names[plan->engine]);
+    printf("%8s %6s %10s %10s %10s %10s %8s %10s %10s\n", "motion %", "noise", "threshold",
+           "changed %", "full us", "delta us", "speedup", "full convs", "max error");
+    for (s = 0; s < (int)(sizeof(scenarios) / sizeof(scenarios[0])); s++)
+    {
+        int object_width = (int)(padded_width * sqrt(scenarios[s].motion) + 0.5);
+        int object_height = (int)(padded_height * sqrt(scenarios[s].motion) + 0.5);
+        struct conv_delta *delta;
+        struct conv_delta_stats stats;
+        double start, full_seconds, delta_seconds, error = 0.0, largest = 0.0;
+        char changed[16] = "-";
+
+        for (t = 0; t < nframes; t++)
+        {
+            int x0 = padded_width > object_width ? 2 * t % (padded_width - object_width) : 0;
+            int y0 = padded_height > object_height
+                         ? 2 * t % (padded_height - object_height) : 0;
+            for (x = 0; x < padded_width; x++)
+            {
+                for (y = 0; y < padded_height; y++)
+                {
+                    int inside = x >= x0 && x < x0 + object_width && y >= y0 &&
+                                 y < y0 + object_height;
+                    for (c = 0; c < nchannels; c++)
+                    {
+                        float value = inside ? texture[x - x0][y - y0][c] : background[x][y][c];
+                        if (scenarios[s].noise > 0)
+                        {
+                            value += rand() % (2 * scenarios[s].noise + 1) - scenarios[s].noise;
+                        }
+                        frames[t][x][y][c] = value;
+                    }
+                }
+            }
+        }
+
+        start = now_seconds();
+        for (t = 0; t < nframes; t++)
+        {
+            struct conv_view image = conv_view_float3d(frames[t], padded_height, nchannels);
+            conv_plan_execute_view(plan, &image, &output_view);
+        }
+        full_seconds = (now_seconds() - start) / nframes;
+
+        delta = conv_delta_create(plan, scenarios[s].threshold, refresh);
+        start = now_seconds();
+        for (t = 0; t < nframes; t++)
+        {
+            struct conv_view image = conv_view_float3d(frames[t], padded_height, nchannels);
+            conv_delta_execute(delta, &image, &output_view);
+        }
+        delta_seconds = (now_seconds() - start) / nframes;
+        conv_delta_get_stats(delta, &stats);
+        conv_delta_destroy(delta);
+
+        /* again, checking every frame against a full convolution */
+        delta = conv_delta_create(plan, scenarios[s].threshold, refresh);
+        for (t = 0; t < nframes; t++)
+        {
+            struct conv_view image = conv_view_float3d(frames[t], padded_height, nchannels);
+            conv_delta_execute(delta, &image, &output_view);
+            conv_plan_execute_view(plan, &image, &control_view);
+            for (i = 0; i < (long)nkernels * width * height; i++)
+            {
+                double difference = fabs((double)(**output)[i] - (**control)[i]);
+                error = difference > error ? difference : error;
+                largest = fabs((**control)[i]) > largest ? fabs((**control)[i]) : largest;
+            }
+        }
+        conv_delta_destroy(delta);
+
+        /* of every frame compared with its reference, dense ones too */
+        if (stats.frames > stats.refreshes)
+        {
+            snprintf(changed, sizeof(changed), "%.2f",
+                     100.0 * stats.changed / ((stats.frames - stats.refreshes) * (double)inputs));
+        }
+        printf("%8.1f %6d %10.1f %10s %10.1f %10.1f %8.2f %10ld %10.2e\n",
+               scenarios[s].motion * 100.0, scenarios[s].noise, scenarios[s].threshold,
+               changed, full_seconds * 1e6, delta_seconds * 1e6, full_seconds / delta_seconds,
+               stats.refreshes + stats.dense_frames, error / (largest > 0.0 ? largest : 1.0));
+    }
+
+    /* the last scenario's frames through an exact delta stream, refreshed
+       every 3 frames, while its plan's kernels are swapped halfway: every
+       frame must still be bit for bit the original kernels' output */
+    {
+        int16_t ****swapped = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                         kernel_order);
+        struct conv_view swapped_view = conv_view_int16_4d(swapped, nchannels, kernel_order,
+                                                           kernel_order);
+        struct conv_plan *original = conv_plan_create(width, height, nchannels, nkernels,
+                                                      kernel_order, kernels);
+        struct conv_delta *delta = conv_delta_create(plan, 0.0f, 3);
+        long bytes = (long)nkernels * width * height * sizeof(float);
+        int mismatched = 0;
+
+        conv_plan_set_cache(original, NULL);
+        for (t = 0; t < nframes; t++)
+        {
+            struct conv_view image = conv_view_float3d(frames[t], padded_height, nchannels);
+            if (t == nframes / 2)
+            {
+                conv_plan_set_kernels(plan, &swapped_view);
+            }
+            conv_delta_execute(delta, &image, &output_view);
+            conv_plan_execute_view(original, &image, &control_view);
+            mismatched += memcmp(**output, **control, bytes) != 0;
+        }
+        printf("kernels swapped at frame %d of a delta stream: %d of %d frames differ from "
+               "the kernels it was created with\n", nframes / 2, mismatched, nframes);
+        conv_delta_destroy(delta);
+        conv_plan_destroy(original);
+        free_4d_matrix_int16(swapped);
+    }
+
+    conv_plan_destroy(plan);
+    for (t = 0; t < nframes; t++)
+    {
+        free_3d_matrix_float(frames[t]);
+    }
+    free_3d_matrix_float(background);
+    free_3d_matrix_float(texture);
+    free_3d_matrix_float(output);
+    free_3d_matrix_float(control);
+    free_4d_matrix_int16(kernels);
+}
+
+/* one convolution over 1, 2, 4 ... nworkers worker processes on each
+   transport, against the same convolution in this process */
+void run_cluster_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                        int nworkers, int transports)
+{
+    static const char *transport_names[] = {"unix", "tcp"};
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    float ***image = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    float ***control = new_empty_3d_matrix_float(nkernels, width, height);
+    struct conv_view image_view = conv_view_float3d(image, padded_height, nchannels);
+    struct conv_view kernel_view = conv_view_int16_4d(kernels, nchannels, kernel_order,
+                                                      kernel_order);
+    struct conv_view output_view = conv_view_float3d(output, width, height);
+    struct conv_view control_view = conv_view_float3d(control, width, height);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels, kernel_order,
+                                              kernels);
+    double start, local_seconds;
+    long input_bytes = (long)padded_width * padded_height * nchannels * sizeof(float);
+    int t, n, runs;
+
+    conv_plan_set_cache(plan, NULL);
+    conv_plan_execute_view(plan, &image_view, &control_view);
+    start = now_seconds();
+    for (runs = 0; runs < 3 || now_seconds() - start < 0.5; runs++)
+    {
+        conv_plan_execute_view(plan, &image_view, &control_view);
+    }
+    local_seconds = (now_seconds() - start) / runs;
+
+    printf("one process (%s): %.2f ms; worker compute and comm are per convolution\n",
+           engine_names[plan->engine], local_seconds * 1e3);
+    printf("%9s %7s %8s %9s %8s %10s %10s %10s %8s %9s %10s\n", "transport", "workers",
+           "blocks", "wall ms", "speedup", "compute ms", "slowest ms", "comm ms", "halo %",
+           "MB moved", "SAD");
+    for (t = 0; t < 2; t++)
+    {
+        if (!(transports & (1 << t)))
+        {
+            continue;
+        }
+        for (n = 1; n <= nworkers; n = n * 2 <= nworkers || n == nworkers ? n * 2 : nworkers)
+        {
+            struct conv_cluster *cluster = conv_cluster_create(n, (enum conv_transport)t, NULL);
+            struct conv_cluster_stats stats, total;
+            char blocks[24];
+
+            /* the first call builds the workers' plans */
+            conv_cluster_execute(cluster, &image_view, &kernel_view, &output_view, width, height,
+                                 nchannels, nkernels, kernel_order, &stats);
+            memset(&total, 0, sizeof(total));
+            start = now_seconds();
+            for (runs = 0; runs < 3 || now_seconds() - start < 0.5; runs++)
+            {
+                conv_cluster_execute(cluster, &image_view, &kernel_view, &output_view, width,
+                                     height, nchannels, nkernels, kernel_order, &stats);
+                total.wall_seconds += stats.wall_seconds;
+                total.compute_seconds += stats.compute_seconds;
+                total.max_worker_seconds += stats.max_worker_seconds;
+                total.comm_seconds += stats.comm_seconds;
+                total.bytes_sent += stats.bytes_sent;
+                total.bytes_received += stats.bytes_received;
+            }
+            conv_cluster_destroy(cluster);
+
+            snprintf(blocks, sizeof(blocks), "%dx%dx%d", stats.nblocks, stats.block_width,
+                     stats.block_height);
+            printf("%9s %7d %8s %9.2f %8.2f %10.2f %10.2f %10.2f %8.1f %9.2f %10f\n",
+                   transport_names[t], n, blocks, total.wall_seconds / runs * 1e3,
+                   local_seconds / (total.wall_seconds / runs),
+                   total.compute_seconds / runs * 1e3, total.max_worker_seconds / runs * 1e3,
+                   total.comm_seconds / runs * 1e3,
+                   100.0 * ((double)stats.nblocks * (stats.block_width + kernel_order) *
+                                (stats.block_height + kernel_order) * nchannels *
+                                sizeof(float) / input_bytes - 1.0),
+                   (total.bytes_sent + total.bytes_received) / (double)runs / (1 << 20),
+                   sum_abs_diff(output, control, nkernels, width, height));
+            if (n == nworkers)
+            {
+                break;
+            }
+        }
+    }
+
+    conv_plan_destroy(plan);
+    free_3d_matrix_float(image);
+    free_3d_matrix_float(output);
+    free_3d_matrix_float(control);
+    free_4d_matrix_int16(kernels);
+}
+
+/* drop a file's pages from the page cache, so the next pass reads the disk */
+static void drop_page_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd >= 0)
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/* write nframes images to a file, then read them back through each
+   reader back end, alone and feeding a plan */
+void run_stream_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                       int nframes, int depth)
+{
+    static const struct
+    {
+        const char *name;
+        int flags;
+        int ahead;                /* read ahead, else one read at a time */
+    } readers[] = {{"pread, no read-ahead", CONV_READ_THREADS, 0},
+                   {"pread pool", CONV_READ_THREADS, 1},
+                   {"pread pool", CONV_READ_THREADS | CONV_READ_DIRECT, 1},
+                   {"io_uring", 0, 1},
+                   {"io_uring", CONV_READ_DIRECT, 1}};
+    enum { NDISTINCT = 4 };
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    long frame_elements = (long)padded_width * padded_height * nchannels;
+    long frame_bytes = frame_elements * sizeof(float);
+    float ***frames[NDISTINCT];
+    double sums[NDISTINCT];
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels, kernel_order,
+                                              kernels);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    struct conv_view output_view = conv_view_float3d(output, width, height);
+    char path[] = "conv-stream-XXXXXX";
+    double start, compute_seconds;
+    int fd, r, t;
+    long i;
+
+    conv_plan_set_cache(plan, NULL);
+    for (t = 0; t < NDISTINCT; t++)
+    {
+        frames[t] = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+        for (sums[t] = 0.0, i = 0; i < frame_elements; i++)
+        {
+            sums[t] += (**frames[t])[i];
+        }
+    }
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "FATAL: cannot create a file in the current directory: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    for (t = 0; t < nframes; t++)
+    {
+        write_full(fd, **frames[t % NDISTINCT], frame_bytes);
+    }
+    close(fd);
+
+    start = now_seconds();
+    for (t = 0; t < NDISTINCT; t++)
+    {
+        struct conv_view image = conv_view_float3d(frames[t], padded_height, nchannels);
+        conv_plan_execute_view(plan, &image, &output_view);
+    }
+    compute_seconds = (now_seconds() - start) / NDISTINCT;
+    printf("%d frames of %.2f MB in %s, %d reads in flight\n", nframes,
+           frame_bytes / (double)(1 << 20), path, depth);
+    printf("compute (%s) alone: %.2f ms per frame, consuming %.0f MB/s\n",
+           engine_names[plan->engine], compute_seconds * 1e3,
+           frame_bytes / compute_seconds / (1 << 20));
+    printf("%22s %7s %12s %12s %10s %12s %8s\n", "reader", "direct", "read MB/s", "stream fps",
+           "wait %", "stream MB/s", "bad");
+    for (r = 0; r < (int)(sizeof(readers) / sizeof(readers[0])); r++)
+    {
+        struct conv_reader *reader;
+        struct conv_reader_stats read_stats, stream_stats;
+        const float *frame;
+        int bad = 0;
+
+        /* the disk alone, checking every frame */
+        drop_page_cache(path);
+        reader = conv_reader_open(path, frame_bytes, readers[r].ahead ? depth : 1,
+                                  readers[r].flags);
+        for (t = 0; (frame = conv_reader_next(reader)) != NULL; t++)
+        {
+            double sum = 0.0;
+            for (i = 0; i < frame_elements; i++)
+            {
+                sum += frame[i];
+            }
+            bad += sum != sums[t % NDISTINCT];
+        }
+        conv_reader_get_stats(reader, &read_stats);
+        conv_reader_close(reader);
+
+        /* the disk feeding the plan */
+        drop_page_cache(path);
+        reader = conv_reader_open(path, frame_bytes, readers[r].ahead ? depth : 1,
+                                  readers[r].flags);
+        while ((frame = conv_reader_next(reader)) != NULL)
+        {
+            struct conv_view image = {(void *)frame, 0,
+                                      {(long)padded_height * nchannels, nchannels, 1, 0}};
+            conv_plan_execute_view(plan, &image, &output_view);
+        }
+        conv_reader_get_stats(reader, &stream_stats);
+        conv_reader_close(reader);
+
+        printf("%22s %7s %12.0f %12.1f %10.1f %12.0f %8d\n",
+               readers[r].flags & CONV_READ_THREADS || !stream_stats.uring ? readers[r].name
+                                                                           : "io_uring",
+               stream_stats.direct ? "yes" : "no",
+               read_stats.bytes / read_stats.seconds / (1 << 20),
+               stream_stats.frames / stream_stats.seconds,
+               100.0 * stream_stats.wait_seconds / stream_stats.seconds,
+               stream_stats.bytes / stream_stats.seconds / (1 << 20), bad);
+    }
+
+    unlink(path);
+    conv_plan_destroy(plan);
+    for (t = 0; t < NDISTINCT; t++)
+    {
+        free_3d_matrix_float(frames[t]);
+    }
+    free_3d_matrix_float(output);
+    free_4d_matrix_int16(kernels);
+}
+
+/* images of three kinds saved as tensor files: compression ratio and
+   speed, band loads at random rows, and convolution straight from the
+   file against reading a raw file first */
+void run_tensorfile_report(int width, int height, int nchannels, int nkernels,
+                           int kernel_order)
+{
+    static const char *kinds[] = {"random", "relu", "smooth"};
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    long elements = (long)padded_width * padded_height * nchannels;
+    long raw_bytes = elements * sizeof(float);
+    float ***image = new_empty_3d_matrix_float(padded_width, padded_height, nchannels);
+    float ***loaded = new_empty_3d_matrix_float(padded_width, padded_height, nchannels);
+    float ***random_image = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    float ***control = new_empty_3d_matrix_float(nkernels, width, height);
+    struct conv_view image_view = conv_view_float3d(image, padded_height, nchannels);
+    struct conv_view loaded_view = conv_view_float3d(loaded, padded_height, nchannels);
+    struct conv_view kernel_view = conv_view_int16_4d(kernels, nchannels, kernel_order,
+                                                      kernel_order);
+    struct conv_view output_view = conv_view_float3d(output, width, height);
+    struct conv_view control_view = conv_view_float3d(control, width, height);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels, kernel_order,
+                                              kernels);
+    char raw_path[] = "conv-raw-XXXXXX", packed_path[] = "conv-tensor-XXXXXX";
+    int raw_fd = mkstemp(raw_path), packed_fd = mkstemp(packed_path);
+    int k, x, y, c, t;
+    long i;
+
+    if (raw_fd < 0 || packed_fd < 0)
+    {
+        fprintf(stderr, "FATAL: cannot create files in the current directory: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    close(packed_fd);
+    conv_plan_set_cache(plan, NULL);
+    printf("%.2f MB images, %d threads, engine %s\n", raw_bytes / (double)(1 << 20),
+           omp_get_max_threads(), engine_names[plan->engine]);
+    printf("%8s %7s %12s %14s %12s %12s %14s %10s\n", "image", "ratio", "save MB/s",
+           "load MB/s", "band us", "raw ms", "compressed ms", "SAD");
+    for (k = 0; k < 3; k++)
+    {
+        struct conv_tensor_file *file;
+        double start, save_seconds, load_seconds, band_seconds, raw_seconds, packed_seconds;
+        long file_bytes;
+        int dims[3], band = 16 < padded_width ? 16 : padded_width;
+
+        /* harness values; activations after a ReLU, zero over regions;
+           a smooth gradient with a little noise */
+        for (x = 0; x < padded_width; x++)
+        {
+            for (y = 0; y < padded_height; y++)
+            {
+                for (c = 0; c < nchannels; c++)
+                {
+                    float value = random_image[x][y][c];
+                    double field = 1024.0 * sin(x / 7.0 + c) * cos(y / 5.0) - 256.0;
+                    image[x][y][c] = k == 0   ? value
+                                     : k == 1 ? (field > 0.0 ? (float)(int)field : 0.0f)
+                                              : (float)((x + 2 * y + 64 * c) % 1024 +
+                                                        ((int)value & 3));
+                }
+            }
+        }
+        conv_plan_execute_view(plan, &image_view, &control_view);
+
+        start = now_seconds();
+        file_bytes = conv_tensor_save(packed_path, &image_view, padded_width, padded_height,
+                                      nchannels, 0);
+        save_seconds = now_seconds() - start;
+        file = conv_tensor_open(packed_path);
+        conv_tensor_dims(file, dims);
+        start = now_seconds();
+        conv_tensor_load_rows(file, 0, padded_width, &loaded_view);
+        load_seconds = now_seconds() - start;
+        if (memcmp(**loaded, **image, raw_bytes) != 0)
+        {
+            fprintf(stderr, "FATAL: the %s image does not load back as saved\n", kinds[k]);
+            exit(1);
+        }
+        start = now_seconds();
+        for (t = 0; t < 64; t++)
+        {
+            conv_tensor_load_rows(file, rand() % (padded_width - band + 1), band, &loaded_view);
+        }
+        band_seconds = (now_seconds() - start) / 64;
+
+        /* from disk: a raw file read whole and then convolved, or the
+           tensor file convolved band by band */
+        if (pwrite(raw_fd, **image, raw_bytes, 0) != raw_bytes)
+        {
+            fprintf(stderr, "FATAL: cannot write %s\n", raw_path);
+            exit(1);
+        }
+        drop_page_cache(raw_path);
+        start = now_seconds();
+        for (i = 0; i < raw_bytes;)
+        {
+            ssize_t n = pread(raw_fd, (char *)**loaded + i, raw_bytes - i, i);
+            if (n <= 0)
+            {
+                fprintf(stderr, "FATAL: cannot read %s\n", raw_path);
+                exit(1);
+            }
+            i += n;
+        }
+        conv_plan_execute_view(plan, &loaded_view, &output_view);
+        raw_seconds = now_seconds() - start;
+
+        drop_page_cache(packed_path);
+        memset(**output, 0, (long)nkernels * width * height * sizeof(float));
+        start = now_seconds();
+        conv_tensor_execute(file, &kernel_view, nkernels, kernel_order, &output_view);
+        packed_seconds = now_seconds() - start;
+        conv_tensor_close(file);
+
+        printf("%8s %7.2f %12.0f %14.0f %12.1f %12.2f %14.2f %10f\n", kinds[k],
+               (double)raw_bytes / file_bytes, raw_bytes / save_seconds / (1 << 20),
+               raw_bytes / load_seconds / (1 << 20), band_seconds * 1e6, raw_seconds * 1e3,
+               packed_seconds * 1e3, sum_abs_diff(output, control, nkernels, width, height));
+    }
+
+    close(raw_fd);
+    unlink(raw_path);
+    unlink(packed_path);
+    conv_plan_destroy(plan);
+    free_3d_matrix_float(image);
+    free_3d_matrix_float(loaded);
+    free_3d_matrix_float(random_image);
+    free_3d_matrix_float(output);
+    free_3d_matrix_float(control);
+    free_4d_matrix_int16(kernels);
+}
+
+/* a network of nlayers convolutions in which every third layer reads the
+   output from two layers back, leaving a side output, run with every
+   activation allocated on its own and through the planned arena */
+void run_network_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                        int nlayers)
+{
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    float ***image = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+    struct conv_view image_view = conv_view_float3d(image, padded_height, nchannels);
+    struct conv_net *net = conv_net_create(padded_width, padded_height, nchannels);
+    int16_t ****kernels[nlayers];
+    float ***naive[nlayers + 1];
+    struct conv_net_stats stats;
+    double start, naive_seconds, planned_seconds, difference = 0.0;
+    int l, t, runs;
+
+    for (l = 0; l < nlayers; l++)
+    {
+        int input = l % 3 == 2 ? l - 1 : l;
+        struct net_tensor *in = &net->tensors[input];
+        struct conv_view view;
+
+        if (in->rows <= kernel_order || in->cols <= kernel_order)
+        {
+            fprintf(stderr, "FATAL: the image is too small for %d layers of order %d\n",
+                    nlayers, kernel_order);
+            exit(1);
+        }
+        kernels[l] = gen_random_4d_matrix_int16(nkernels, in->channels, kernel_order,
+                                                kernel_order);
+        view = conv_view_int16_4d(kernels[l], in->channels, kernel_order, kernel_order);
+        conv_net_add(net, input, nkernels, kernel_order, &view);
+        conv_plan_set_cache(net->layers[l].plan, NULL);
+    }
+    conv_net_get_stats(net, &stats);
+
+    /* every activation on its own, as chained harness calls allocate them */
+    for (t = 1; t <= nlayers; t++)
+    {
+        naive[t] = new_empty_3d_matrix_float(net->tensors[t].channels, net->tensors[t].rows,
+                                             net->tensors[t].cols);
+    }
+    start = now_seconds();
+    for (runs = 0; runs < 3 || now_seconds() - start < 0.5; runs++)
+    {
+        for (l = 0; l < nlayers; l++)
+        {
+            struct net_layer *layer = &net->layers[l];
+            struct net_tensor *out = &net->tensors[l + 1];
+            struct conv_view output = conv_view_float3d(naive[l + 1], out->rows, out->cols);
+            struct conv_view input = image_view;
+
+            if (layer->input > 0)
+            {
+                struct net_tensor *in = &net->tensors[layer->input];
+                input = conv_view_float3d(naive[layer->input], in->rows, in->cols);
+                input.strides[2] = input.strides[0];
+                input.strides[0] = input.strides[1];
+                input.strides[1] = 1;
+            }
+            conv_plan_execute_view(layer->plan, &input, &output);
+        }
+    }
+    naive_seconds = (now_seconds() - start) / runs;
+
+    start = now_seconds();
+    for (runs = 0; runs < 3 || now_seconds() - start < 0.5; runs++)
+    {
+        conv_net_execute(net, &image_view);
+    }
+    planned_seconds = (now_seconds() - start) / runs;
+
+    printf("%d layers of %d kernels of order %d, engine of layer 0 %s\n", nlayers, nkernels,
+           kernel_order, engine_names[net->layers[0].plan->engine]);
+    printf("%7s %7s %16s %10s %10s %12s\n", "tensor", "read by", "shape", "MB", "live",
+           "offset MB");
+    for (t = 1; t <= nlayers; t++)
+    {
+        struct net_tensor *tensor = &net->tensors[t];
+        char shape[32], live[24], readers[16] = "";
+
+        for (l = 0; l < nlayers; l++)
+        {
+            if (net->layers[l].input == t)
+            {
+                snprintf(readers + strlen(readers), sizeof(readers) - strlen(readers), "%s%d",
+                         readers[0] != '\0' ? "," : "", l);
+            }
+        }
+        snprintf(shape, sizeof(shape), "%dx%dx%d", tensor->channels, tensor->rows, tensor->cols);
+        snprintf(live, sizeof(live), "%d-%d", tensor->first, tensor->last);
+        printf("%7d %7s %16s %10.2f %10s %12.2f\n", t, readers[0] != '\0' ? readers : "output",
+               shape, tensor->bytes / (double)(1 << 20), live,
+               tensor->offset / (double)(1 << 20));
+
+        /* outputs, live to the end, must match the separately allocated run */
+        if (tensor->last == nlayers - 1 && readers[0] == '\0')
+        {
+            struct conv_view view = conv_net_tensor(net, t);
+            const float *data = (const float *)view.data + view.offset;
+            long i, n = (long)tensor->channels * tensor->rows * tensor->cols;
+            for (i = 0; i < n; i++)
+            {
+                difference += fabs((double)data[i] - (**naive[t])[i]);
+            }
+        }
+    }
+    printf("activations: %.2f MB allocated one by one, %.2f MB planned (%.0f%% less), "
+           "%.2f MB live at most\n",
+           stats.naive_bytes / (double)(1 << 20), stats.planned_bytes / (double)(1 << 20),
+           100.0 * (1.0 - (double)stats.planned_bytes / stats.naive_bytes),
+           stats.live_bytes / (double)(1 << 20));
+    printf("engine scratch of the plans: %.2f MB\n", stats.scratch_bytes / (double)(1 << 20));
+    printf("time per network: %.2f ms one by one, %.2f ms planned; outputs SAD %f\n",
+           naive_seconds * 1e3, planned_seconds * 1e3, difference);
+
+    conv_net_destroy(net);
+    for (l = 0; l < nlayers; l++)
+    {
+        free_4d_matrix_int16(kernels[l]);
+        free_3d_matrix_float(naive[l + 1]);
+    }
+    free_3d_matrix_float(image);
+}
+
+/* a stem layer feeding nbranches independent branches of two narrow
+   layers each, run one layer after another on every core, with every
+   wave's branches concurrent, and as the cost model chooses; then the
+   chosen schedule's per-layer profile */
+void run_dag_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                    int nbranches)
+{
+    int padded_width = width + kernel_order, padded_height = height + kernel_order;
+    int nlayers = 1 + 2 * nbranches;
+    int narrow = nkernels / nbranches > CONV_MR ? nkernels / nbranches : CONV_MR;
+    float ***image = gen_random_3d_matrix_float(padded_width, padded_height, nchannels);
+    struct conv_view image_view = conv_view_float3d(image, padded_height, nchannels);
+    struct conv_net *net = conv_net_create(padded_width, padded_height, nchannels);
+    const char *mode_names[3] = {"intra-op", "inter-op", "auto"};
+    enum conv_net_parallelism modes[3] = {CONV_NET_INTRA, CONV_NET_INTER, CONV_NET_AUTO};
+    int16_t ****kernels[nlayers];
+    float *reference[nlayers + 1];
+    struct conv_net_stats stats;
+    struct conv_net_profile profile;
+    double start, seconds;
+    int l, b, m, t, runs;
+
+    for (l = 0; l < nlayers; l++)
+    {
+        /* layer 0 the stem, then each branch's first and second layer */
+        int input = l == 0 ? 0 : l % 2 == 1 ? 1 : l;
+        int count = l == 0 ? nkernels : narrow;
+        struct net_tensor *in = &net->tensors[input];
+        struct conv_view view;
+
+        if (in->rows <= kernel_order || in->cols <= kernel_order)
+        {
+            fprintf(stderr, "FATAL: the image is too small for three layers of order %d\n",
+                    kernel_order);
+            exit(1);
+        }
+        kernels[l] = gen_random_4d_matrix_int16(count, in->channels, kernel_order,
+                                                kernel_order);
+        view = conv_view_int16_4d(kernels[l], in->channels, kernel_order, kernel_order);
+        conv_net_add(net, input, count, kernel_order, &view);
+        conv_plan_set_cache(net->layers[l].plan, NULL);
+    }
+
+    printf("stem of %d kernels, %d branches of 2 layers of %d kernels, order %d, %d cores\n",
+           nkernels, nbranches, narrow, kernel_order, omp_get_max_threads());
+    printf("%10s %12s %14s %10s %12s\n", "schedule", "ms/network", "predicted ms", "arena MB",
+           "SAD");
+    for (m = 0; m < 3; m++)
+    {
+        double difference = 0.0;
+
+        conv_net_set_parallelism(net, modes[m]);
+        conv_net_execute(net, &image_view);
+        start = now_seconds();
+        for (runs = 0; runs < 3 || now_seconds() - start < 0.5; runs++)
+        {
+            conv_net_execute(net, &image_view);
+        }
+        seconds = (now_seconds() - start) / runs;
+        conv_net_get_stats(net, &stats);
+
+        /* the branch outputs, live to the end, must match the serial run */
+        for (b = 0; b < nbranches; b++)
+        {
+            struct net_tensor *tensor = &net->tensors[2 * b + 3];
+            struct conv_view view = conv_net_tensor(net, 2 * b + 3);
+            const float *data = (const float *)view.data + view.offset;
+            long i, n = (long)tensor->channels * tensor->rows * tensor->cols;
+
+            t = 2 * b + 3;
+            if (m == 0)
+            {
+                reference[t] = malloc(n * sizeof(float));
+                memcpy(reference[t], data, n * sizeof(float));
+            }
+            for (i = 0; i < n; i++)
+            {
+                difference += fabs((double)data[i] - reference[t][i]);
+            }
+        }
+        printf("%10s %12.3f %14.3f %10.2f %12f\n", mode_names[m], seconds * 1e3,
+               stats.predicted_seconds * 1e3, stats.planned_bytes / (double)(1 << 20),
+               difference);
+    }
+
+    printf("auto schedule:\n");
+    printf("%6s %6s %6s %7s %6s %12s %14s %12s\n", "layer", "reads", "wave", "worker", "cores",
+           "engine", "predicted us", "measured us");
+    for (l = 0; l < nlayers; l++)
+    {
+        char worker[16] = "caller";
+
+        conv_net_get_profile(net, l, &profile);
+        if (profile.worker >= 0)
+        {
+            snprintf(worker, sizeof(worker), "%d", profile.worker);
+        }
+        printf("%6d %6d %6d %7s %6d %12s %14.1f %12.1f\n", l, net->layers[l].input,
+               profile.wave, worker, profile.ncores, profile.engine,
+               profile.predicted_seconds * 1e6, profile.seconds * 1e6);
+    }
+
+    conv_net_destroy(net);
+    for (l = 0; l < nlayers; l++)
+    {
+        free_4d_matrix_int16(kernels[l]);
+    }
+    for (b = 0; b < nbranches; b++)
+    {
+        free(reference[2 * b + 3]);
+    }
+    free_3d_matrix_float(image);
+}
+
+/* one serving thread of the 'hotswap' mode: its own plan, called until
+   stopped, checking every output against both kernel versions */
+struct swap_server
+{
+    struct conv_plan *plan;
+    float ***image;
+    float ***output;
+    float ***expected[2];     /* outputs of kernels A and B */
+    long bytes;
+    int stop;
+    long calls, matched[2], torn;
+    double seconds, worst;    /* per call */
+};
+
+static void *swap_server_run(void *arg)
+{
+    struct swap_server *server = arg;
+
+    while (!__atomic_load_n(&server->stop, __ATOMIC_RELAXED))
+    {
+        double start = now_seconds(), seconds;
+        int v;
+
+        conv_plan_execute(server->plan, server->image, server->output);
+        seconds = now_seconds() - start;
+        server->seconds += seconds;
+        server->worst = seconds > server->worst ? seconds : server->worst;
+        server->calls++;
+        for (v = 0; v < 2; v++)
+        {
+            if (memcmp(**server->output, **server->expected[v], server->bytes) == 0)
+            {
+                server->matched[v]++;
+                break;
+            }
+        }
+        server->torn += v == 2;
+    }
+    return NULL;
+}
+
+/* nservers threads serve convolutions on plans of their own, first with
+   fixed kernels, then while the main thread swaps every plan between two
+   kernel versions every couple of milliseconds. Every output must be
+   exactly one version's, and serving should not slow down */
+void run_hotswap_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                        int nservers)
+{
+    int16_t ****kernels[2];
+    struct conv_view views[2];
+    struct swap_server servers[nservers];
+    float ***image = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
+                                                nchannels);
+    double duration = 1.0, interval = 2e-3;
+    long retired_before = kernel_sets_retired;
+    int pass, i, v;
+
+    for (v = 0; v < 2; v++)
+    {
+        kernels[v] = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                kernel_order);
+        views[v] = conv_view_int16_4d(kernels[v], nchannels, kernel_order, kernel_order);
+    }
+    for (i = 0; i < nservers; i++)
+    {
+        memset(&servers[i], 0, sizeof(servers[i]));
+        servers[i].plan = conv_plan_create(width, height, nchannels, nkernels, kernel_order,
+                                           kernels[0]);
+        conv_plan_set_cache(servers[i].plan, NULL);
+        servers[i].image = image;
+        servers[i].output = new_empty_3d_matrix_float(nkernels, width, height);
+        servers[i].bytes = (long)nkernels * width * height * sizeof(float);
+    }
+    for (v = 0; v < 2; v++)
+    {
+        struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels,
+                                                  kernel_order, kernels[v]);
+        conv_plan_set_cache(plan, NULL);
+        servers[0].expected[v] = new_empty_3d_matrix_float(nkernels, width, height);
+        conv_plan_execute(plan, image, servers[0].expected[v]);
+        conv_plan_destroy(plan);
+    }
+
+    printf("%d serving threads, engine %s, kernels swapped every %.1f ms in the second pass\n",
+           nservers, conv_plan_engine(servers[0].plan), interval * 1e3);
+    printf("%8s %8s %10s %12s %12s %10s %10s %8s\n", "pass", "swaps", "convs/s", "mean ms",
+           "worst ms", "kernels A", "kernels B", "torn");
+    for (pass = 0; pass < 2; pass++)
+    {
+        pthread_t threads[nservers];
+        double start, publish = 0.0, worst_publish = 0.0, seconds, worst = 0.0, busy = 0.0;
+        long swaps = 0, calls = 0, matched[2] = {0, 0}, torn = 0;
+
+        for (i = 0; i < nservers; i++)
+        {
+            conv_plan_set_kernels(servers[i].plan, &views[0]);
+            servers[i].expected[0] = servers[0].expected[0];
+            servers[i].expected[1] = servers[0].expected[1];
+            servers[i].stop = 0;
+            servers[i].calls = servers[i].matched[0] = servers[i].matched[1] = 0;
+            servers[i].torn = 0;
+            servers[i].seconds = servers[i].worst = 0.0;
+            pthread_create(&threads[i], NULL, swap_server_run, &servers[i]);
+        }
+        start = now_seconds();
+        while (now_seconds() - start < duration)
+        {
+            struct timespec pause = {0, (long)(interval * 1e9)};
+
+            nanosleep(&pause, NULL);
+            if (pass == 1)
+            {
+                for (i = 0; i < nservers; i++)
+                {
+                    double t = now_seconds();
+                    conv_plan_set_kernels(servers[i].plan, &views[(swaps + 1) % 2]);
+                    t = now_seconds() - t;
+                    publish += t;
+                    worst_publish = t > worst_publish ? t : worst_publish;
+                }
+                swaps++;
+            }
+        }
+        for (i = 0; i < nservers; i++)
+        {
+            __atomic_store_n(&servers[i].stop, 1, __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < nservers; i++)
+        {
+            pthread_join(threads[i], NULL);
+            calls += servers[i].calls;
+            matched[0] += servers[i].matched[0];
+            matched[1] += servers[i].matched[1];
+            torn += servers[i].torn;
+            busy += servers[i].seconds;
+            worst = servers[i].worst > worst ? servers[i].worst : worst;
+        }
+        seconds = now_seconds() - start;
+        printf("%8s %8ld %10.1f %12.3f %12.3f %10ld %10ld %8ld\n",
+               pass == 0 ? "fixed" : "swapping", swaps, calls / seconds,
+               calls > 0 ? busy / calls * 1e3 : 0.0, worst * 1e3, matched[0], matched[1], torn);
+        if (pass == 1 && swaps > 0)
+        {
+            printf("publishing new kernels: %.1f us mean, %.1f us worst per plan "
+                   "(packing and placing, off the serving threads)\n",
+                   publish / (swaps * nservers) * 1e6, worst_publish * 1e6);
+        }
+    }
+
+    for (i = 0; i < nservers; i++)
+    {
+        conv_plan_destroy(servers[i].plan);
+        free_3d_matrix_float(servers[i].output);
+    }
+    kernel_sets_reclaim(1);
+    printf("kernel sets retired %ld, freed %ld, waiting on a reader %d\n",
+           kernel_sets_retired - retired_before, kernel_sets_freed,
+           __atomic_load_n(&kernel_sets_pending, __ATOMIC_RELAXED));
+    for (v = 0; v < 2; v++)
+    {
+        free_3d_matrix_float(servers[0].expected[v]);
+        free_4d_matrix_int16(kernels[v]);
+    }
+    free_3d_matrix_float(image);
+}
+
+/* one request of the 'overload' mode */
+struct overload_request
+{
+    double arrival, deadline; /* offsets from the start */
+    double abandon;           /* when the client gives up, or 0 if it waits */
+    int cancel;
+    double finished;
+    enum conv_status status;
+};
+
+/* the clients: cancel each request they abandon when its time comes */
+struct overload_clients
+{
+    struct overload_request *requests;
+    int nrequests;
+    double start;
+    int done;
+};
+
+static void *overload_clients_run(void *arg)
+{
+    struct overload_clients *clients = arg;
+    int next = 0;
+
+    while (!__atomic_load_n(&clients->done, __ATOMIC_RELAXED) && next < clients->nrequests)
+    {
+        struct overload_request *r = &clients->requests[next];
+        double wait = r->abandon - (now_seconds() - clients->start);
+
+        if (r->abandon == 0.0)
+        {
+            next++;
+            continue;
+        }
+        if (wait > 0.0)
+        {
+            struct timespec pause = {0, (long)((wait < 1e-3 ? wait : 1e-3) * 1e9)};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        __atomic_store_n(&r->cancel, 1, __ATOMIC_RELAXED);
+        next++;
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* a server running one plan, fed open-loop arrivals at load times the
+   rate it can serve, each request due a few service times after it
+   arrives and one in ten abandoned by its client halfway there. Served
+   blind, every request is convolved in full however late; served with
+   deadlines and cancellation, expired or abandoned requests stop within
+   a task. Reports the latency of every request answered in full */
+void run_overload_report(int width, int height, int nchannels, int nkernels, int kernel_order,
+                         double load)
+{
+    float ***image = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
+                                                nchannels);
+    float ***output = new_empty_3d_matrix_float(nkernels, width, height);
+    int16_t ****kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order,
+                                                     kernel_order);
+    struct conv_plan *plan = conv_plan_create(width, height, nchannels, nkernels, kernel_order,
+                                              kernels);
+    struct conv_view image_view = conv_view_float3d(image, height + kernel_order, nchannels);
+    struct conv_view output_view = conv_view_float3d(output, width, height);
+    double service, start, slack = 4.0;
+    int nrequests, aware, i, runs;
+    struct overload_request *requests;
+    double *latency;
+
+    conv_plan_set_cache(plan, NULL);
+    conv_plan_execute(plan, image, output);
+    start = now_seconds();
+    for (runs = 0; runs < 5 || now_seconds() - start < 0.3; runs++)
+    {
+        conv_plan_execute(plan, image, output);
+    }
+    service = (now_seconds() - start) / runs;
+    nrequests = (int)(2.0 * load / service);
+    nrequests = nrequests < 100 ? 100 : nrequests > 20000 ? 20000 : nrequests;
+    requests = calloc(nrequests, sizeof(struct overload_request));
+    latency = malloc(nrequests * sizeof(double));
+
+    printf("service %.3f ms, load %.2f, %d requests due %.0f service times after arrival, "
+           "1 in 10 abandoned\n", service * 1e3, load, nrequests, slack);
+    printf("%10s %8s %8s %8s %10s %10s %10s %10s %10s %12s\n", "server", "in time", "late",
+           "expired", "cancelled", "serve ms", "p50 ms", "p99 ms", "p99.9 ms", "wasted busy");
+    for (aware = 0; aware < 2; aware++)
+    {
+        struct overload_clients clients = {requests, nrequests, 0.0, 0};
+        pthread_t client_thread;
+        double t = 0.0, wasted = 0.0, busy = 0.0;
+        int counts[3] = {0, 0, 0}, late = 0, ntimed = 0;
+
+        /* the same exponential arrivals for both servers */
+        srand(1);
+        for (i = 0; i < nrequests; i++)
+        {
+            t += -log((rand() + 1.0) / (RAND_MAX + 2.0)) * service / load;
+            requests[i].arrival = t;
+            requests[i].deadline = t + slack * service;
+            requests[i].abandon = i % 10 == 9 ? t + slack * service / 2 : 0.0;
+            requests[i].cancel = 0;
+        }
+        clients.start = start = now_seconds();
+        pthread_create(&client_thread, NULL, overload_clients_run, &clients);
+        for (i = 0; i < nrequests; i++)
+        {
+            struct overload_request *r = &requests[i];
+            double wait = r->arrival - (now_seconds() - start), began;
+
+            if (wait > 0.0)
+            {
+                struct timespec pause = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+                nanosleep(&pause, NULL);
+            }
+            began = now_seconds();
+            if (aware)
+            {
+                r->status = conv_plan_execute_until(plan, &image_view, &output_view,
+                                                    start + r->deadline, &r->cancel);
+            }
+            else
+            {
+                conv_plan_execute_view(plan, &image_view, &output_view);
+                r->status = CONV_OK;
+            }
+            r->finished = now_seconds() - start;
+            busy += r->finished - (began - start);
+
+            /* work on a request nobody waits for any more is wasted */
+            if (r->status != CONV_OK || __atomic_load_n(&r->cancel, __ATOMIC_RELAXED) ||
+                r->finished > r->deadline)
+            {
+                wasted += r->finished - (began - start);
+            }
+        }
+        __atomic_store_n(&clients.done, 1, __ATOMIC_RELAXED);
+        pthread_join(client_thread, NULL);
+
+        for (i = 0; i < nrequests; i++)
+        {
+            struct overload_request *r = &requests[i];
+            int abandoned = __atomic_load_n(&r->cancel, __ATOMIC_RELAXED);
+
+            if (r->status != CONV_OK || abandoned)
+            {
+                counts[r->status == CONV_EXPIRED ? 1 : 2]++;
+            }
+            else
+            {
+                late += r->finished > r->deadline;
+                counts[0] += r->finished <= r->deadline;
+                latency[ntimed++] = r->finished - r->arrival;
+            }
+        }
+        qsort(latency, ntimed, sizeof(double), compare_doubles);
+        printf("%10s %8d %8d %8d %10d %10.3f %10.3f %10.3f %10.3f %11.0f%%\n",
+               aware ? "deadlines" : "blind", counts[0], late, counts[1], counts[2],
+               busy / nrequests * 1e3,
+               ntimed > 0 ? latency[ntimed / 2] * 1e3 : 0.0,
+               ntimed > 0 ? latency[(int)(ntimed * 0.99)] * 1e3 : 0.0,
+               ntimed > 0 ? latency[(int)(ntimed * 0.999)] * 1e3 : 0.0,
+               busy > 0.0 ? 100.0 * wasted / busy : 0.0);
+    }
+
+    conv_plan_destroy(plan);
+    free(requests);
+    free(latency);
+    free_3d_matrix_float(image);
+    free_3d_matrix_float(output);
+    free_4d_matrix_int16(kernels);
+}
+
+#ifndef CONV_NO_MAIN
+int main(int argc, char **argv)
+{
+    // float image[W][H][C];
+    // float kernels[M][C][K][K];
+    // float output[M][W][H];
+
+    float ***image;
+    int16_t ****kernels;
+    float ***control_output, ***output;
+    long long mul_time, mul_time_control;
+    int width, height, kernel_order, nchannels, nkernels;
+    struct timeval start_time;
+    struct timeval stop_time;
+    struct timeval start_time_control;
+    struct timeval stop_time_control;
+    const char *mode = NULL;
+
+    /* started as a worker of a cluster */
+    if (argc > 1 && strcmp(argv[1], "--conv-worker") == 0)
+    {
+        return conv_cluster_worker_main(argc, argv);
+    }
+
+    if (argc < 6)
+    {
+        fprintf(stderr, "Usage: conv-harness <image_width> <image_height> <kernel_order> <number of channels> <number of kernels> [mode]\n");
+        fprintf(stderr, "Modes:\n");
+        fprintf(stderr, "  sweep      time odd heights and channel counts above the given shape\n");
+        fprintf(stderr, "  model      compare cost model predictions with measured engine times\n");
+        fprintf(stderr, "  memory     compare scratch and peak memory of direct, im2col and implicit GEMM\n");
+        fprintf(stderr, "  winograd   error and speed of every Winograd variant (kernel_order is ignored)\n");
+        fprintf(stderr, "  micro      cycles per FMA of every inner kernel on L1-resident data (shape is ignored)\n");
+        fprintf(stderr, "  tenants [N] [w1,w2,...]  N concurrent streams, shared vs weighted core partitions\n");
+        fprintf(stderr, "  isa        sustained throughput and measured clock of each vector ISA\n");
+        fprintf(stderr, "  topology   cpu topology, and plan time on one thread per core vs every cpu\n");
+        fprintf(stderr, "  numa       kernel page locality and remote loads, shared vs per-node kernel copies\n");
+        fprintf(stderr, "  views      every engine on strided views into larger image, kernel and output tensors\n");
+        fprintf(stderr, "  ragged [N] N images of mixed sizes: per-image calls vs one ragged batch\n");
+        fprintf(stderr, "  cache [N] [D]  N frames drawn from D distinct ones, with and without an output cache\n");
+        fprintf(stderr, "  delta [N] [R]  N video frames at several motion levels, full vs delta convolution refreshed every R\n");
+        fprintf(stderr, "  cluster [N] [unix|tcp]  one convolution spread over up to N worker processes\n");
+        fprintf(stderr, "  stream [N] [D]  N frames read from a file with D reads in flight, by each reader back end\n");
+        fprintf(stderr, "  tensorfile  compressed chunked tensor files: ratio, speed, band loads, convolution from disk\n");
+        fprintf(stderr, "  network [L]  L chained layers with skips: activation arena planned by liveness vs one by one\n");
+        fprintf(stderr, "  dag [B]  a stem and B independent branches: intra-op vs inter-op vs cost-model schedule, per-layer profile\n");
+        fprintf(stderr, "  hotswap [T]  T serving threads while kernels are swapped under them: throughput, torn outputs\n");
+        fprintf(stderr, "  overload [L]  requests arriving at L times capacity: tail latency with and without deadlines and cancellation\n");
+        exit(1);
+    }
+    else
+    {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+        kernel_order = atoi(argv[3]);
+        nchannels = atoi(argv[4]);
+        nkernels = atoi(argv[5]);
+        mode = argc > 6 ? argv[6] : NULL;
+    }
+    switch (kernel_order)
+    {
+    case 1:
+    case 3:
+    case 5:
+    case 7:
+        break;
+    default:
+        fprintf(stderr, "FATAL: kernel_order must be 1, 3, 5 or 7, not %d\n",
+                kernel_order);
+        exit(1);
+    }
+
+    /* the benchmark modes generate their own data */
+    if (mode != NULL)
+    {
+        if (strcmp(mode, "sweep") == 0)
+        {
+            run_tail_sweep(width, height, nchannels, nkernels, kernel_order);
+        }
+        else if (strcmp(mode, "model") == 0)
+        {
+            run_cost_model_report(width, height, nchannels, nkernels, kernel_order);
+        }
+        else if (strcmp(mode, "memory") == 0)
+        {
+            run_memory_report(width, height, nchannels, nkernels, kernel_order);
+        }
+        else if (strcmp(mode, "winograd") == 0)
+        {
+            run_winograd_report(width, height, nchannels, nkernels);
+        }
+        else if (strcmp(mode, "micro") == 0)
+        {
+            run_micro_report();
+        }
+        else if (strcmp(mode, "isa") == 0)
+        {
+            run_isa_report();
+        }
+        else if (strcmp(mode, "topology") == 0)
+        {
+            run_topology_report(width, height, nchannels, nkernels, kernel_order);
+        }
+        else if (strcmp(mode, "numa") == 0)
+        {
+            run_numa_report(width, height, nchannels, nkernels, kernel_order);
+        }
+        else if (strcmp(mode, "views") == 0)
+        {
+            run_views_report(width, height, nchannels, nkernels, kernel_order);
+        }
+        else if (strcmp(mode, "ragged") == 0)
+        {
+            int nimages = argc > 7 ? atoi(argv[7]) : 16;
+
+            if (nimages < 1)
+            {
+                fprintf(stderr, "FATAL: the number of images must be positive\n");
+                exit(1);
+            }
+            run_ragged_report(width, height, nchannels, nkernels, kernel_order, nimages);
+        }
+        else if (strcmp(mode, "cache") == 0)
+        {
+            int nframes = argc > 7 ? atoi(argv[7]) : 64;
+            int ndistinct = argc > 8 ? atoi(argv[8]) : 8;
+
+            if (nframes < 1 || ndistinct < 1)
+            {
+                fprintf(stderr, "FATAL: the numbers of frames must be positive\n");
+                exit(1);
+            }
+            run_cache_report(width, height, nchannels, nkernels, kernel_order, nframes,
+                             ndistinct);
+        }
+        else if (strcmp(mode, "delta") == 0)
+        {
+            int nframes = argc > 7 ? atoi(argv[7]) : 32;
+            int refresh = argc > 8 ? atoi(argv[8]) : 16;
+
+            if (nframes < 1 || refresh < 0)
+            {
+                fprintf(stderr, "FATAL: need at least one frame and a refresh period of 0 or more\n");
+                exit(1);
+            }
+            run_delta_report(width, height, nchannels, nkernels, kernel_order, nframes,
+                             refresh);
+        }
+        else if (strcmp(mode, "cluster") == 0)
+        {
+            int nworkers = argc > 7 ? atoi(argv[7]) : 4;
+            int transports = argc <= 8 ? 3 : strcmp(argv[8], "unix") == 0 ? 1
+                                         : strcmp(argv[8], "tcp") == 0  ? 2 : 0;
+
+            if (nworkers < 1 || transports == 0)
+            {
+                fprintf(stderr, "FATAL: need at least one worker, over unix or tcp\n");
+                exit(1);
+            }
+            run_cluster_report(width, height, nchannels, nkernels, kernel_order, nworkers,
+                               transports);
+        }
+        else if (strcmp(mode, "stream") == 0)
+        {
+            int nframes = argc > 7 ? atoi(argv[7]) : 64;
+            int depth = argc > 8 ? atoi(argv[8]) : 8;
+
+            if (nframes < 1 || depth < 1)
+            {
+                fprintf(stderr, "FATAL: need at least one frame and one read in flight\n");
+                exit(1);
+            }
+            run_stream_report(width, height, nchannels, nkernels, kernel_order, nframes, depth);
+        }
+        else if (strcmp(mode, "tensorfile") == 0)
+        {
+            run_tensorfile_report(width, height, nchannels, nkernels, kernel_order);
+        }
+        else if (strcmp(mode, "network") == 0)
+        {
+            int nlayers = argc > 7 ? atoi(argv[7]) : 6;
+
+            if (nlayers < 1)
+            {
+                fprintf(stderr, "FATAL: the number of layers must be positive\n");
+                exit(1);
+            }
+            run_network_report(width, height, nchannels, nkernels, kernel_order, nlayers);
+        }
+        else if (strcmp(mode, "dag") == 0)
+        {
+            int nbranches = argc > 7 ? atoi(argv[7]) : 4;
+
+            if (nbranches < 1)
+            {
+                fprintf(stderr, "FATAL: the number of branches must be positive\n");
+                exit(1);
+            }
+            run_dag_report(width, height, nchannels, nkernels, kernel_order, nbranches);
+        }
+        else if (strcmp(mode, "hotswap") == 0)
+        {
+            int nservers = argc > 7 ? atoi(argv[7]) : 2;
+
+            if (nservers < 1)
+            {
+                fprintf(stderr, "FATAL: the number of serving threads must be positive\n");
+                exit(1);
+            }
+            run_hotswap_report(width, height, nchannels, nkernels, kernel_order, nservers);
+        }
+        else if (strcmp(mode, "overload") == 0)
+        {
+            double load = argc > 7 ? atof(argv[7]) : 1.2;
+
+            if (load <= 0.0)
+            {
+                fprintf(stderr, "FATAL: the load must be positive\n");
+                exit(1);
+            }
+            run_overload_report(width, height, nchannels, nkernels, kernel_order, load);
+        }
+        else if (strcmp(mode, "tenants") == 0)
+        {
+            int nstreams = argc > 7 ? atoi(argv[7]) : 4;
+            double *weights = NULL;
+            int i;
+
+            if (nstreams < 1)
+            {
+                fprintf(stderr, "FATAL: the number of streams must be positive\n");
+                exit(1);
+            }
+            if (argc > 8)
+            {
+                char *next = argv[8];
+                weights = malloc(nstreams * sizeof(double));
+                for (i = 0; i < nstreams; i++)
+                {
+                    weights[i] = *next != '\0' ? strtod(next, &next) : 1.0;
+                    next += *next == ',';
+                }
+            }
+            run_tenants_report(width, height, nchannels, nkernels, kernel_order, nstreams,
+                               weights);
+            free(weights);
+        }
+        else
+        {
+            fprintf(stderr, "FATAL: unknown mode '%s'\n", mode);
+            exit(1);
+        }
+        return 0;
+    }
+
+    /* allocate the matrices */
+    image = gen_random_3d_matrix_float(width + kernel_order, height + kernel_order,
+                                       nchannels);
+    kernels = gen_random_4d_matrix_int16(nkernels, nchannels, kernel_order, kernel_order);
+    output = new_empty_3d_matrix_float(nkernels, width, height);
+    control_output = new_empty_3d_matrix_float(nkernels, width, height);
+
+    // DEBUGGING(write_out(A, a_dim1, a_dim2));
+
+    /* measure the cost model's machine parameters outside the timed region */
+    conv_machine_params();
+
+    gettimeofday(&start_time_control, NULL);
+    /* use a simple multichannel convolution routine to produce control result */
+    multichannel_conv(image, kernels, control_output, width,
+                      height, nchannels, nkernels, kernel_order);
+    gettimeofday(&stop_time_control, NULL);
+    mul_time_control = (stop_time_control.tv_sec - start_time_control.tv_sec) * 1000000L +
+               (stop_time_control.tv_usec - start_time_control.tv_usec);
+    printf("Control conv time: %lld microseconds\n", mul_time_control);
+
+    /* record starting time of student's code*/
+    gettimeofday(&start_time, NULL);
+
+    /* perform student's multichannel convolution */
+    student_conv(image, kernels, output, width,
+                 height, nchannels, nkernels, kernel_order);
+
+    /* record finishing time */
+    gettimeofday(&stop_time, NULL);
+    mul_time = (stop_time.tv_sec - start_time.tv_sec) * 1000000L +
+               (stop_time.tv_usec - start_time.tv_usec);
+    printf("Student conv time: %lld microseconds\n", mul_time);
+
+    DEBUGGING(write_out(output, nkernels, width, height));
+
+    /* now check that the student's multichannel convolution routine
+       gives the same answer as the known working version */
+    check_result(output, control_output, nkernels, width, height);
+
+    return 0;
+}
+#endif
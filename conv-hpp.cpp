@@ -0,0 +1,90 @@
+/* Checks the compile-time shapes of conv.hpp against multichannel_conv.
+
+   Each shape convolves one random image with the template and with the
+   runtime reference; strided shapes are compared against the reference's
+   stride 1 output at every Stride-th row and column, which it computes
+   from the same image.
+
+   Build:
+     gcc -O3 -fopenmp -DCONV_NO_MAIN -c conv-harness.c
+     g++ -std=c++17 -O3 -fopenmp -Wall -Wextra conv-hpp.cpp conv-harness.o -o conv-hpp -lm -lpthread
+
+   Usage:
+     conv-hpp [output_width] [output_height]
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "conv.h"
+#include "conv.hpp"
+
+namespace
+{
+
+/* run conv<K, C, M, Stride> on a width x height output and return its
+   sum of absolute differences from multichannel_conv */
+template <int K, int C, int M, int Stride>
+double check(int width, int height)
+{
+    /* the stride 1 reference covering every strided output */
+    int full_width = (width - 1) * Stride + 1, full_height = (height - 1) * Stride + 1;
+    float ***image = gen_random_3d_matrix_float(full_width + K, full_height + K, C);
+    int16_t ****kernels = gen_random_4d_matrix_int16(M, C, K, K);
+    float ***control = new_empty_3d_matrix_float(M, full_width, full_height);
+    float ***output = new_empty_3d_matrix_float(M, width, height);
+    double difference = 0.0;
+
+    multichannel_conv(image, kernels, control, full_width, full_height, C, M, K);
+    conv<K, C, M, Stride>::run(image, kernels, output, width, height);
+    for (int m = 0; m < M; m++)
+    {
+        for (int w = 0; w < width; w++)
+        {
+            for (int h = 0; h < height; h++)
+            {
+                difference += std::fabs((double)output[m][w][h] -
+                                        control[m][w * Stride][h * Stride]);
+            }
+        }
+    }
+
+    printf("%4d %4d %4d %4d %4d %12f\n", K, C, M, Stride, conv<K, C, M, Stride>::MB,
+           difference);
+    free_3d_matrix_float(image);
+    free_4d_matrix_int16(kernels);
+    free_3d_matrix_float(control);
+    free_3d_matrix_float(output);
+    return difference;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    int width = argc > 1 ? atoi(argv[1]) : 37, height = argc > 2 ? atoi(argv[2]) : 29;
+    double worst = 0.0;
+
+    if (width < 1 || height < 1)
+    {
+        fprintf(stderr, "Usage: conv-hpp [output_width] [output_height]\n");
+        exit(1);
+    }
+    printf("%d x %d outputs\n", width, height);
+    printf("%4s %4s %4s %4s %4s %12s\n", "K", "C", "M", "S", "MB", "SAD");
+    worst = fmax(worst, check<1, 4, 8, 1>(width, height));
+    worst = fmax(worst, check<3, 5, 19, 1>(width, height));
+    worst = fmax(worst, check<3, 16, 32, 1>(width, height));
+    worst = fmax(worst, check<5, 3, 21, 2>(width, height));
+    worst = fmax(worst, check<7, 2, 16, 2>(width, height));
+    worst = fmax(worst, check<3, 8, 6, 3>(width, height));
+
+    /* the sums are exact in double, so any difference is a bug */
+    if (worst != 0.0)
+    {
+        fprintf(stderr, "FATAL: conv.hpp differs from multichannel_conv by %f\n", worst);
+        exit(1);
+    }
+    return 0;
+}
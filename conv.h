@@ -0,0 +1,319 @@
+/* Interface of conv-harness.c for front ends in other translation units
+   and languages. Build conv-harness.c with -DCONV_NO_MAIN to link it
+   into a program that has its own main.
+
+   Tensors use the harness layout: image[W+K][H+K][C] floats, kernels
+   [M][C][K][K] 16-bit integers and output[M][W][H] floats, each a
+   pointer-of-pointers matrix from the new_/gen_ functions below.
+*/
+
+#ifndef CONV_H
+#define CONV_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* vector instruction sets the kernels are built for, narrowest first */
+enum conv_isa
+{
+    ISA_SCALAR,
+    ISA_AVX2,
+    ISA_AVX512VL,
+    ISA_AVX512
+};
+
+/* number of output kernels (MR) and output vectors along the height (NR)
+   computed by one call of a register-blocked kernel */
+#define CONV_MR 4
+#define CONV_NR 3
+
+/* one output row of the direct engine for up to CONV_MR kernels:
+   (image, kernels, output, channel_stride, row_stride, out_stride,
+    mcount, height, nchannels, kernel_order) */
+typedef void (*direct_row_fn)(const double *, const double *, float *, long, int,
+                              long, int, int, int, int);
+
+struct conv_plan;
+struct conv_schedule;
+
+/* a strided view of a tensor: element (i, j, k[, l]) is at
+   data[offset + i*strides[0] + j*strides[1] + k*strides[2] (+ l*strides[3])],
+   strides counted in elements. Views of crops, channel subsets, kernel
+   subsets or slices of a larger output are offsets into the same data */
+struct conv_view
+{
+    void *data;
+    long offset;
+    long strides[4];
+};
+
+float ***new_empty_3d_matrix_float(int dim0, int dim1, int dim2);
+float ***gen_random_3d_matrix_float(int dim0, int dim1, int dim2);
+int16_t ****new_empty_4d_matrix_int16(int dim0, int dim1, int dim2, int dim3);
+int16_t ****gen_random_4d_matrix_int16(int dim0, int dim1, int dim2, int dim3);
+void free_3d_matrix_float(float ***matrix);
+void free_4d_matrix_int16(int16_t ****matrix);
+double sum_abs_diff(float ***result, float ***control, int dim0, int dim1, int dim2);
+double now_seconds(void);
+
+void multichannel_conv(float ***image, int16_t ****kernels, float ***output,
+                       int width, int height, int nchannels, int nkernels,
+                       int kernel_order);
+void student_conv(float ***image, int16_t ****kernels, float ***output,
+                  int width, int height, int nchannels, int nkernels,
+                  int kernel_order);
+
+/* views of whole harness matrices, and the view from index start of an axis on */
+struct conv_view conv_view_float3d(float ***matrix, int dim1, int dim2);
+struct conv_view conv_view_int16_4d(int16_t ****matrix, int dim1, int dim2, int dim3);
+struct conv_view conv_view_slice(struct conv_view view, int axis, long start);
+
+enum conv_isa detect_isa(void);
+enum conv_isa select_isa(void);
+
+/* planar double copies of the image, [C][W+K][H+K], and of the kernels,
+   [M/MR][C][K][K][MR], as the engines read them */
+void pack_image(float ***image, double *packed, int padded_width,
+                int padded_height, int nchannels);
+void pack_image_view(const struct conv_view *image, double *packed, int padded_width,
+                     int padded_height, int nchannels);
+double *pack_kernels(int16_t ****kernels, int nchannels, int nkernels,
+                     int kernel_order);
+double *pack_kernels_view(const struct conv_view *kernels, int nchannels, int nkernels,
+                          int kernel_order);
+
+direct_row_fn conv_direct_row_kernel(enum conv_isa isa);
+
+/* packed_kernels holds one pointer per NUMA node; a NULL schedule runs
+   on the default OpenMP team and reads packed_kernels[0]. The output
+   view's height stride must be 1 */
+void direct_conv_packed(const double *packed_image, const double *const *packed_kernels,
+                        const struct conv_view *output, int width, int height, int nchannels,
+                        int nkernels, int kernel_order, enum conv_isa isa,
+                        const struct conv_schedule *schedule);
+
+struct conv_plan *conv_plan_create(int width, int height, int nchannels, int nkernels,
+                                   int kernel_order, int16_t ****kernels);
+struct conv_plan *conv_plan_create_view(int width, int height, int nchannels, int nkernels,
+                                        int kernel_order, const struct conv_view *kernels);
+void conv_plan_execute(struct conv_plan *plan, float ***image, float ***output);
+void conv_plan_execute_view(struct conv_plan *plan, const struct conv_view *image,
+                            const struct conv_view *output);
+void conv_plan_destroy(struct conv_plan *plan);
+const char *conv_plan_engine(const struct conv_plan *plan);
+
+/* how an execute with a deadline or cancellation flag ended */
+enum conv_status
+{
+    CONV_OK,
+    CONV_CANCELLED,           /* the flag was set first */
+    CONV_EXPIRED              /* the deadline passed first */
+};
+
+/* deadline on the now_seconds clock, 0 for none; cancel NULL for none.
+   Stops within one engine task, leaving the output partly written */
+enum conv_status conv_plan_execute_until(struct conv_plan *plan, const struct conv_view *image,
+                                         const struct conv_view *output, double deadline,
+                                         const int *cancel);
+
+/* swap in new [M][C][K][K] kernels of the plan's shape while another
+   thread executes it, without locking it out: a running call finishes on
+   the old kernels, later calls use the new ones. A plan runs one execute
+   at a time, since every call shares its packed image, columns and
+   output scratch; concurrent executes need a plan per thread. No other
+   plan setting may change while a call runs: conv_plan_set_cache, and
+   the engine, core and replication setters of conv-harness.c, need the
+   plan idle */
+void conv_plan_set_kernels(struct conv_plan *plan, const struct conv_view *kernels);
+
+/* a byte-capped LRU cache of plan outputs, keyed by a digest of the
+   plan's shape, engine and kernels and a 128-bit hash of the image
+   contents */
+struct conv_cache;
+
+struct conv_cache_stats
+{
+    long hits, misses, insertions, evictions;
+    long entries, bytes;      /* held now */
+    long hashed_bytes;        /* of images */
+    double hash_seconds;
+};
+
+struct conv_cache *conv_cache_create(long max_bytes);
+void conv_cache_destroy(struct conv_cache *cache);
+void conv_cache_get_stats(struct conv_cache *cache, struct conv_cache_stats *stats);
+void conv_cache_release(const float *output);
+
+/* the cache plans start with: CONV_CACHE_MB megabytes, NULL if unset */
+struct conv_cache *conv_default_cache(void);
+void conv_plan_set_cache(struct conv_plan *plan, struct conv_cache *cache);
+const float *conv_plan_execute_aliased(struct conv_plan *plan, const struct conv_view *image);
+
+/* a video stream run through a plan, convolving only the thresholded
+   change from the previous frame into the previous output, with a full
+   convolution every refresh frames (0: only the first) */
+struct conv_delta;
+
+struct conv_delta_stats
+{
+    long frames;
+    long refreshes;           /* full convolutions, first and periodic */
+    long dense_frames;        /* convolved in full as the change was too dense */
+    long nonzeros;            /* changes scattered, over all frames */
+    long changed;             /* changes found, dense frames included */
+    double last_density;      /* changed share of the last frame's inputs */
+};
+
+struct conv_delta *conv_delta_create(struct conv_plan *plan, float threshold, int refresh);
+void conv_delta_execute(struct conv_delta *delta, const struct conv_view *image,
+                        const struct conv_view *output);
+void conv_delta_get_stats(const struct conv_delta *delta, struct conv_delta_stats *stats);
+void conv_delta_destroy(struct conv_delta *delta);
+
+/* one convolution split into blocks of outputs, each shipped with its
+   image halo to one of a set of worker processes over Unix socket pairs
+   or loopback TCP. Workers are the program run again with
+   --conv-worker: a program with its own main passes its arguments to
+   conv_cluster_worker_main first, which returns -1 if they are not a
+   worker's */
+struct conv_cluster;
+
+enum conv_transport
+{
+    CONV_UNIX,
+    CONV_TCP
+};
+
+struct conv_cluster_stats
+{
+    int nblocks, block_width, block_height;
+    double wall_seconds;
+    double compute_seconds;   /* summed over workers */
+    double max_worker_seconds; /* of the busiest worker */
+    double comm_seconds;      /* coordinator gathering, sending, receiving, scattering */
+    long bytes_sent, bytes_received;
+};
+
+struct conv_cluster *conv_cluster_create(int nworkers, enum conv_transport transport,
+                                         const char *program);
+void conv_cluster_execute(struct conv_cluster *cluster, const struct conv_view *image,
+                          const struct conv_view *kernels, const struct conv_view *output,
+                          int width, int height, int nchannels, int nkernels, int kernel_order,
+                          struct conv_cluster_stats *stats);
+void conv_cluster_destroy(struct conv_cluster *cluster);
+int conv_cluster_worker_main(int argc, char **argv);
+
+/* frames read ahead from a file of raw [W+K][H+K][C] float images, with
+   depth reads in flight, through io_uring or else a pool of pread
+   threads */
+struct conv_reader;
+
+#define CONV_READ_DIRECT 1    /* O_DIRECT where the file system allows it */
+#define CONV_READ_THREADS 2   /* the pread pool even where io_uring works */
+
+struct conv_reader_stats
+{
+    long frames;
+    long bytes;               /* read, with O_DIRECT's block alignment */
+    double wait_seconds;      /* the caller blocked on a frame */
+    double seconds;           /* since the reader was opened */
+    int uring, direct;        /* what the reader ended up using */
+};
+
+struct conv_reader *conv_reader_open(const char *path, long frame_bytes, int depth, int flags);
+const float *conv_reader_next(struct conv_reader *reader);
+long conv_reader_frames(const struct conv_reader *reader);
+void conv_reader_get_stats(const struct conv_reader *reader, struct conv_reader_stats *stats);
+void conv_reader_close(struct conv_reader *reader);
+
+/* a 3D float tensor saved in compressed chunks of whole rows of its
+   first dimension, with an index for loading any band of rows; chunk_rows
+   0 picks chunks of about 64 KB. conv_tensor_execute convolves the
+   [W+K][H+K][C] image of a file band by band as it decompresses */
+struct conv_tensor_file;
+
+long conv_tensor_save(const char *path, const struct conv_view *tensor, int dim0, int dim1,
+                      int dim2, int chunk_rows);
+struct conv_tensor_file *conv_tensor_open(const char *path);
+void conv_tensor_dims(const struct conv_tensor_file *file, int dims[3]);
+void conv_tensor_load_rows(struct conv_tensor_file *file, int row0, int nrows,
+                           const struct conv_view *dest);
+void conv_tensor_execute(struct conv_tensor_file *file, const struct conv_view *kernels,
+                         int nkernels, int kernel_order, const struct conv_view *output);
+void conv_tensor_close(struct conv_tensor_file *file);
+
+/* a network of convolutions: tensor 0 is the [X][Y][C] input, tensor
+   i+1 the [M][W][H] output of layer i, which reads any earlier tensor
+   as its image. Activations share one arena, placed by their lifetimes.
+   A layer's wave is one deeper than the layer writing its input, and the
+   layers of a wave are independent: CONV_NET_INTER runs them
+   concurrently on disjoint core sets, CONV_NET_AUTO where the cost model
+   predicts that sooner than one after another on every core
+   (CONV_NET_INTRA, the default) */
+struct conv_net;
+
+enum conv_net_parallelism
+{
+    CONV_NET_INTRA,
+    CONV_NET_INTER,
+    CONV_NET_AUTO
+};
+
+struct conv_net_stats
+{
+    long naive_bytes;         /* every activation allocated on its own */
+    long planned_bytes;       /* the arena */
+    long live_bytes;          /* the most live at once, a floor for any arena */
+    long scratch_bytes;       /* engine scratch of the layers' plans */
+    double predicted_seconds; /* the cost model's time for the schedule */
+};
+
+/* one layer as scheduled, with its mean measured time since planned */
+struct conv_net_profile
+{
+    int wave;                 /* layers of a wave are independent */
+    int worker;               /* running it concurrently, -1 on the caller's team */
+    int ncores;
+    double predicted_seconds;
+    double seconds;
+    long calls;
+    const char *engine;
+};
+
+struct conv_net *conv_net_create(int padded_width, int padded_height, int nchannels);
+int conv_net_add(struct conv_net *net, int input, int nkernels, int kernel_order,
+                 const struct conv_view *kernels);
+void conv_net_set_parallelism(struct conv_net *net, enum conv_net_parallelism parallelism);
+void conv_net_execute(struct conv_net *net, const struct conv_view *image);
+struct conv_view conv_net_tensor(const struct conv_net *net, int tensor);
+void conv_net_get_stats(struct conv_net *net, struct conv_net_stats *stats);
+void conv_net_get_profile(struct conv_net *net, int layer, struct conv_net_profile *profile);
+void conv_net_destroy(struct conv_net *net);
+
+/* one image of a ragged batch: its output size, and views of its
+   [W+K][H+K][C] image and [M][W][H] output (height stride 1) */
+struct conv_batch_image
+{
+    int width, height;
+    struct conv_view image;
+    struct conv_view output;
+};
+
+/* kernels shared by batches of images of different sizes, run as one
+   pool of tiles across the batch */
+struct conv_batch;
+
+struct conv_batch *conv_batch_create(int nchannels, int nkernels, int kernel_order,
+                                     const struct conv_view *kernels);
+void conv_batch_execute(struct conv_batch *batch, int nimages,
+                        const struct conv_batch_image *images);
+void conv_batch_destroy(struct conv_batch *batch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
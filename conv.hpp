@@ -0,0 +1,154 @@
+/* Header-only convolution with the shape fixed at compile time.
+
+   conv<K, C, M, Stride, InT, KernT, OutT> is the multichannel
+   convolution of conv-harness.c with the kernel order, channel and
+   kernel counts, and stride as template arguments, so every loop but
+   the ones over the image has a constant trip count and is unrolled
+   for the shape at hand; there is no branch on the kernel order.
+
+   Tensors are the runtime API's pointer-of-pointer matrices:
+     image   InT   [(W-1)*Stride+K][(H-1)*Stride+K][C]
+     kernels KernT [M][C][K][K]
+     output  OutT  [M][W][H]
+   With Stride 1 and the default types this is exactly student_conv, and
+   the harness' (W+K) x (H+K) images can be passed unchanged. Sums are
+   taken in double, as in the runtime engines.
+
+     conv<3, 64, 128> layer(kernels);   // packs the kernels once
+     layer(image, output, width, height);
+
+   Build with -fopenmp to run output rows in parallel; -fopenmp-simd
+   alone keeps the inner loop vectorised across kernels. conv-hpp.cpp
+   checks a set of shapes against multichannel_conv.
+*/
+
+#ifndef CONV_HPP
+#define CONV_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+template <int K, int C, int M, int Stride = 1, typename InT = float,
+          typename KernT = int16_t, typename OutT = float>
+class conv
+{
+    static_assert(K == 1 || K == 3 || K == 5 || K == 7, "kernel order must be 1, 3, 5 or 7");
+    static_assert(C > 0, "need at least one channel");
+    static_assert(M > 0, "need at least one kernel");
+    static_assert(Stride >= 1, "stride must be positive");
+    static_assert(std::is_arithmetic<InT>::value && std::is_arithmetic<KernT>::value &&
+                      std::is_arithmetic<OutT>::value,
+                  "tensor element types must be arithmetic");
+
+public:
+    /* kernels per block, the width of the vectors the inner loop runs on */
+    static constexpr int MB = M < 16 ? M : 16;
+    static constexpr int MBLOCKS = (M + MB - 1) / MB;
+
+    /* output heights computed together, sharing every kernel load */
+    static constexpr int NP = 4;
+
+    using image_type = InT ***;
+    using kernels_type = KernT ****;
+    using output_type = OutT ***;
+
+    /* copy the kernels into [M/MB][K][K][C][MB] doubles, the kernels of a
+       block innermost and the missing ones of the last block zero */
+    explicit conv(kernels_type kernels)
+        : packed_(new double[(std::size_t)MBLOCKS * K * K * C * MB]())
+    {
+        for (int m = 0; m < M; m++)
+        {
+            for (int x = 0; x < K; x++)
+            {
+                for (int y = 0; y < K; y++)
+                {
+                    for (int c = 0; c < C; c++)
+                    {
+                        packed_[(((std::size_t)(m / MB * K + x) * K + y) * C + c) * MB + m % MB] =
+                            kernels[m][c][x][y];
+                    }
+                }
+            }
+        }
+    }
+
+    void operator()(image_type image, output_type output, int width, int height) const
+    {
+#pragma omp parallel for collapse(2) schedule(static)
+        for (int mb = 0; mb < MBLOCKS; mb++)
+        {
+            for (int w = 0; w < width; w++)
+            {
+                int h = 0;
+                for (; h + NP <= height; h += NP)
+                {
+                    block<NP>(image, output, mb, w, h);
+                }
+                for (; h < height; h++)
+                {
+                    block<1>(image, output, mb, w, h);
+                }
+            }
+        }
+    }
+
+    /* one-off convolution, packing the kernels on every call */
+    static void run(image_type image, kernels_type kernels, output_type output, int width,
+                    int height)
+    {
+        conv layer(kernels);
+        layer(image, output, width, height);
+    }
+
+private:
+    /* outputs h .. h+P-1 of row w for kernel block mb: each image value
+       is broadcast against MB kernels, so the innermost loop is a plain
+       vector multiply-add with no reduction */
+    template <int P>
+    void block(image_type image, output_type output, int mb, int w, int h) const
+    {
+        const double *k = packed_.get() + (std::size_t)mb * K * K * C * MB;
+        double sum[P][MB] = {};
+
+        for (int x = 0; x < K; x++)
+        {
+            InT *const *rows = image[w * Stride + x];
+            for (int y = 0; y < K; y++)
+            {
+                const double *kxy = k + (x * K + y) * C * MB;
+                const InT *pixel[P];
+
+                for (int p = 0; p < P; p++)
+                {
+                    pixel[p] = rows[(h + p) * Stride + y];
+                }
+                for (int c = 0; c < C; c++)
+                {
+                    for (int p = 0; p < P; p++)
+                    {
+                        double v = pixel[p][c];
+#pragma omp simd
+                        for (int j = 0; j < MB; j++)
+                        {
+                            sum[p][j] += v * kxy[c * MB + j];
+                        }
+                    }
+                }
+            }
+        }
+        for (int j = 0; j < MB && mb * MB + j < M; j++)
+        {
+            for (int p = 0; p < P; p++)
+            {
+                output[mb * MB + j][w][h + p] = (OutT)sum[p][j];
+            }
+        }
+    }
+
+    std::unique_ptr<double[]> packed_;
+};
+
+#endif
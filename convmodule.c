@@ -0,0 +1,342 @@
+/* Python bindings for the convolution plans of conv-harness.c.
+
+   Arrays are taken through the buffer protocol, so NumPy arrays,
+   memoryviews and array.array objects all work without a third-party
+   dependency, with whatever strides they have:
+
+     import conv
+     plan = conv.Plan(kernels, width, height)   # int16 [M][C][K][K]
+     plan.execute(image, output)                # float32 [W+K][H+K][C] -> [M][W][H]
+
+   execute reads the image and writes the output in place, with the GIL
+   released. Every array is passed to the plan as a strided view of its
+   own memory, so crops, channel subsets, kernel sub-batches and slices
+   of a larger output need no copy. One plan runs one call at a time;
+   use a plan per thread to convolve concurrently.
+
+   plan.set_kernels(kernels) swaps in new weights of the same shape
+   without waiting for a running execute, which finishes on the old ones.
+
+   Build: python3 setup.py build_ext --inplace
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include "conv.h"
+
+typedef struct
+{
+    PyObject_HEAD
+    struct conv_plan *plan;
+    int width, height, nchannels, nkernels, kernel_order;
+    PyThread_type_lock lock;
+} PlanObject;
+
+/* get a buffer of the given element format and shape, with any strides;
+   returns -1 with an exception set if obj does not fit */
+static int get_tensor(PyObject *obj, Py_buffer *view, char format, int writable,
+                      int ndim, const Py_ssize_t *shape, const char *name)
+{
+    const char *f;
+    int i;
+
+    if (PyObject_GetBuffer(obj, view, PyBUF_STRIDES | PyBUF_FORMAT |
+                                          (writable ? PyBUF_WRITABLE : 0)) < 0)
+    {
+        return -1;
+    }
+    /* native or little-endian standard size; the kernels are x86 only */
+    f = view->format != NULL ? view->format : "B";
+    if (*f == '@' || *f == '=' || *f == '<')
+    {
+        f++;
+    }
+    if (f[0] != format || f[1] != '\0')
+    {
+        PyErr_Format(PyExc_TypeError, "%s must have element format '%c', not '%s'", name,
+                     format, view->format != NULL ? view->format : "B");
+        PyBuffer_Release(view);
+        return -1;
+    }
+    if (view->ndim != ndim)
+    {
+        PyErr_Format(PyExc_ValueError, "%s must have %d dimensions, not %d", name, ndim,
+                     view->ndim);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    for (i = 0; i < ndim; i++)
+    {
+        if (shape != NULL && view->shape[i] != shape[i])
+        {
+            PyErr_Format(PyExc_ValueError, "%s dimension %d must be %zd, not %zd", name, i,
+                         shape[i], view->shape[i]);
+            PyBuffer_Release(view);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* the conv_view of a buffer from get_tensor; strides are in elements,
+   so each must be a multiple of the element size */
+static int get_view(const Py_buffer *buffer, struct conv_view *view, const char *name)
+{
+    int i;
+
+    view->data = buffer->buf;
+    view->offset = 0;
+    for (i = 0; i < 4; i++)
+    {
+        view->strides[i] = 0;
+        if (i >= buffer->ndim)
+        {
+            continue;
+        }
+        if (buffer->strides[i] % buffer->itemsize != 0)
+        {
+            PyErr_Format(PyExc_ValueError,
+                         "%s stride %zd of dimension %d is not a multiple of its element size",
+                         name, buffer->strides[i], i);
+            return -1;
+        }
+        view->strides[i] = buffer->strides[i] / buffer->itemsize;
+    }
+    return 0;
+}
+
+static void Plan_dealloc(PlanObject *self)
+{
+    if (self->plan != NULL)
+    {
+        conv_plan_destroy(self->plan);
+    }
+    if (self->lock != NULL)
+    {
+        PyThread_free_lock(self->lock);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Plan(kernels, width, height): kernels is int16 [M][C][K][K] */
+static int Plan_init(PlanObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *keywords[] = {"kernels", "width", "height", NULL};
+    PyObject *kernels_obj;
+    Py_buffer kernels;
+    struct conv_view view;
+    int width, height;
+
+    if (self->plan != NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Plan is already initialised");
+        return -1;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oii:Plan", keywords, &kernels_obj, &width,
+                                     &height))
+    {
+        return -1;
+    }
+    if (get_tensor(kernels_obj, &kernels, 'h', 0, 4, NULL, "kernels") < 0)
+    {
+        return -1;
+    }
+    if (kernels.shape[2] != kernels.shape[3] ||
+        (kernels.shape[2] != 1 && kernels.shape[2] != 3 && kernels.shape[2] != 5 &&
+         kernels.shape[2] != 7) ||
+        kernels.shape[0] < 1 || kernels.shape[1] < 1 || width < 1 || height < 1)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "kernels must be [M][C][K][K] with K 1, 3, 5 or 7, and the output "
+                        "at least 1 x 1");
+        PyBuffer_Release(&kernels);
+        return -1;
+    }
+    self->nkernels = (int)kernels.shape[0];
+    self->nchannels = (int)kernels.shape[1];
+    self->kernel_order = (int)kernels.shape[2];
+    self->width = width;
+    self->height = height;
+
+    if (get_view(&kernels, &view, "kernels") < 0)
+    {
+        PyBuffer_Release(&kernels);
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    self->plan = conv_plan_create_view(width, height, self->nchannels, self->nkernels,
+                                       self->kernel_order, &view);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&kernels);
+
+    self->lock = PyThread_allocate_lock();
+    if (self->lock == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/* execute(image, output): image float32 [W+K][H+K][C], output float32
+   [M][W][H], written in place */
+static PyObject *Plan_execute(PlanObject *self, PyObject *args)
+{
+    PyObject *image_obj, *output_obj;
+    Py_buffer image, output;
+    int padded_width = self->width + self->kernel_order;
+    int padded_height = self->height + self->kernel_order;
+    Py_ssize_t image_shape[3] = {padded_width, padded_height, self->nchannels};
+    Py_ssize_t output_shape[3] = {self->nkernels, self->width, self->height};
+    struct conv_view image_view, output_view;
+
+    if (self->plan == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Plan is not initialised");
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "OO:execute", &image_obj, &output_obj))
+    {
+        return NULL;
+    }
+    if (get_tensor(image_obj, &image, 'f', 0, 3, image_shape, "image") < 0)
+    {
+        return NULL;
+    }
+    if (get_tensor(output_obj, &output, 'f', 1, 3, output_shape, "output") < 0)
+    {
+        PyBuffer_Release(&image);
+        return NULL;
+    }
+    if (get_view(&image, &image_view, "image") < 0 ||
+        get_view(&output, &output_view, "output") < 0)
+    {
+        PyBuffer_Release(&image);
+        PyBuffer_Release(&output);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    conv_plan_execute_view(self->plan, &image_view, &output_view);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&image);
+    PyBuffer_Release(&output);
+    Py_RETURN_NONE;
+}
+
+/* set_kernels(kernels): new int16 [M][C][K][K] kernels of the plan's
+   shape, published to the next execute without taking the plan's lock */
+static PyObject *Plan_set_kernels(PlanObject *self, PyObject *args)
+{
+    PyObject *kernels_obj;
+    Py_buffer kernels;
+    Py_ssize_t shape[4] = {self->nkernels, self->nchannels, self->kernel_order,
+                           self->kernel_order};
+    struct conv_view view;
+
+    if (self->plan == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Plan is not initialised");
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "O:set_kernels", &kernels_obj))
+    {
+        return NULL;
+    }
+    if (get_tensor(kernels_obj, &kernels, 'h', 0, 4, shape, "kernels") < 0)
+    {
+        return NULL;
+    }
+    if (get_view(&kernels, &view, "kernels") < 0)
+    {
+        PyBuffer_Release(&kernels);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    conv_plan_set_kernels(self->plan, &view);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&kernels);
+    Py_RETURN_NONE;
+}
+
+static PyObject *Plan_get_engine(PlanObject *self, void *closure)
+{
+    if (self->plan == NULL)
+    {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(conv_plan_engine(self->plan));
+}
+
+static PyObject *Plan_get_shape(PlanObject *self, void *closure)
+{
+    return Py_BuildValue("(iiiii)", self->width, self->height, self->nchannels,
+                         self->nkernels, self->kernel_order);
+}
+
+static PyMethodDef Plan_methods[] = {
+    {"execute", (PyCFunction)Plan_execute, METH_VARARGS,
+     "execute(image, output)\n\nConvolve a float32 [W+K][H+K][C] image into a writable "
+     "float32 [M][W][H] output, in place and with the GIL released."},
+    {"set_kernels", (PyCFunction)Plan_set_kernels, METH_VARARGS,
+     "set_kernels(kernels)\n\nReplace the plan's weights with int16 kernels of the same "
+     "shape; an execute already running finishes on the old ones."},
+    {NULL, NULL, 0, NULL}};
+
+static PyGetSetDef Plan_getset[] = {
+    {"engine", (getter)Plan_get_engine, NULL, "the convolution engine the plan runs", NULL},
+    {"shape", (getter)Plan_get_shape, NULL, "(width, height, channels, kernels, kernel_order)",
+     NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyTypeObject PlanType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "conv.Plan",
+    .tp_doc = "Plan(kernels, width, height)\n\nA convolution plan for int16 [M][C][K][K] "
+              "kernels and a width x height output.",
+    .tp_basicsize = sizeof(PlanObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Plan_init,
+    .tp_dealloc = (destructor)Plan_dealloc,
+    .tp_methods = Plan_methods,
+    .tp_getset = Plan_getset,
+};
+
+static struct PyModuleDef conv_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "conv",
+    .m_doc = "Multichannel convolution plans over buffer-protocol arrays.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_conv(void)
+{
+    PyObject *module;
+
+    if (PyType_Ready(&PlanType) < 0)
+    {
+        return NULL;
+    }
+    module = PyModule_Create(&conv_module);
+    if (module == NULL)
+    {
+        return NULL;
+    }
+    Py_INCREF(&PlanType);
+    if (PyModule_AddObject(module, "Plan", (PyObject *)&PlanType) < 0)
+    {
+        Py_DECREF(&PlanType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
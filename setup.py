@@ -0,0 +1,17 @@
+"""Build the conv extension: python3 setup.py build_ext --inplace"""
+
+from setuptools import Extension, setup
+
+setup(
+    name="conv",
+    version="1.7",
+    ext_modules=[
+        Extension(
+            "conv",
+            sources=["convmodule.c", "conv-harness.c"],
+            define_macros=[("CONV_NO_MAIN", None)],
+            extra_compile_args=["-O3", "-fopenmp"],
+            extra_link_args=["-fopenmp"],
+        )
+    ],
+)